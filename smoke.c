@@ -24,12 +24,15 @@
 
 #include "tinyexpr.h"
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
 #include "minctest.h"
 
 
 typedef struct {
     const char *expr;
-    double answer;
+    te_real answer;
 } test_case;
 
 typedef struct {
@@ -150,10 +153,10 @@ void test_results() {
     int i;
     for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
         const char *expr = cases[i].expr;
-        const double answer = cases[i].answer;
+        const te_real answer = cases[i].answer;
 
         int err;
-        const double ev = te_interp(expr, &err);
+        const te_real ev = te_interp(expr, &err);
         lok(!err);
         lfequal(ev, answer);
 
@@ -189,7 +192,7 @@ void test_syntax() {
         const int e = errors[i].answer;
 
         int err;
-        const double r = te_interp(expr, &err);
+        const te_real r = te_interp(expr, &err);
         lequal(err, e);
         lok(r != r);
 
@@ -201,7 +204,7 @@ void test_syntax() {
             printf("FAILED: %s\n", expr);
         }
 
-        const double k = te_interp(expr, 0);
+        const te_real k = te_interp(expr, 0);
         lok(k != k);
     }
 }
@@ -228,14 +231,14 @@ void test_nans() {
         const char *expr = nans[i];
 
         int err;
-        const double r = te_interp(expr, &err);
+        const te_real r = te_interp(expr, &err);
         lequal(err, 0);
         lok(r != r);
 
         te_expr *n = te_compile(expr, 0, 0, &err);
         lok(n);
         lequal(err, 0);
-        const double c = te_eval(n);
+        const te_real c = te_eval(n);
         lok(c != c);
         te_free(n);
     }
@@ -262,14 +265,14 @@ void test_infs() {
         const char *expr = infs[i];
 
         int err;
-        const double r = te_interp(expr, &err);
+        const te_real r = te_interp(expr, &err);
         lequal(err, 0);
         lok(r == r + 1);
 
         te_expr *n = te_compile(expr, 0, 0, &err);
         lok(n);
         lequal(err, 0);
-        const double c = te_eval(n);
+        const te_real c = te_eval(n);
         lok(c == c + 1);
         te_free(n);
     }
@@ -278,7 +281,7 @@ void test_infs() {
 
 void test_variables() {
 
-    double x, y, test;
+    te_real x, y, test;
     te_variable lookup[] = {{"x", &x}, {"y", &y}, {"te_st", &test}};
 
     int err;
@@ -301,7 +304,7 @@ void test_variables() {
 
     for (y = 2; y < 3; ++y) {
         for (x = 0; x < 5; ++x) {
-            double ev;
+            te_real ev;
 
             ev = te_eval(expr1);
             lfequal(ev, cos(x) + sin(y));
@@ -354,7 +357,7 @@ void test_variables() {
 
 void test_functions() {
 
-    double x, y;
+    te_real x, y;
     te_variable lookup[] = {{"x", &x}, {"y", &y}};
 
     int err;
@@ -387,35 +390,35 @@ void test_functions() {
 }
 
 
-double sum0() {
+te_real sum0() {
     return 6;
 }
-double sum1(double a) {
+te_real sum1(te_real a) {
     return a * 2;
 }
-double sum2(double a, double b) {
+te_real sum2(te_real a, te_real b) {
     return a + b;
 }
-double sum3(double a, double b, double c) {
+te_real sum3(te_real a, te_real b, te_real c) {
     return a + b + c;
 }
-double sum4(double a, double b, double c, double d) {
+te_real sum4(te_real a, te_real b, te_real c, te_real d) {
     return a + b + c + d;
 }
-double sum5(double a, double b, double c, double d, double e) {
+te_real sum5(te_real a, te_real b, te_real c, te_real d, te_real e) {
     return a + b + c + d + e;
 }
-double sum6(double a, double b, double c, double d, double e, double f) {
+te_real sum6(te_real a, te_real b, te_real c, te_real d, te_real e, te_real f) {
     return a + b + c + d + e + f;
 }
-double sum7(double a, double b, double c, double d, double e, double f, double g) {
+te_real sum7(te_real a, te_real b, te_real c, te_real d, te_real e, te_real f, te_real g) {
     return a + b + c + d + e + f + g;
 }
 
 
 void test_dynamic() {
 
-    double x, f;
+    te_real x, f;
     te_variable lookup[] = {
         {"x", &x},
         {"f", &f},
@@ -460,7 +463,7 @@ void test_dynamic() {
     int i;
     for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
         const char *expr = cases[i].expr;
-        const double answer = cases[i].answer;
+        const te_real answer = cases[i].answer;
 
         int err;
         te_expr *ex = te_compile(expr, lookup, sizeof(lookup)/sizeof(te_variable), &err);
@@ -471,28 +474,28 @@ void test_dynamic() {
 }
 
 
-double clo0(void *context) {
-    if (context) return *((double*)context) + 6;
+te_real clo0(void *context) {
+    if (context) return *((te_real*)context) + 6;
     return 6;
 }
-double clo1(void *context, double a) {
-    if (context) return *((double*)context) + a * 2;
+te_real clo1(void *context, te_real a) {
+    if (context) return *((te_real*)context) + a * 2;
     return a * 2;
 }
-double clo2(void *context, double a, double b) {
-    if (context) return *((double*)context) + a + b;
+te_real clo2(void *context, te_real a, te_real b) {
+    if (context) return *((te_real*)context) + a + b;
     return a + b;
 }
 
-double cell(void *context, double a) {
-    double *c = context;
+te_real cell(void *context, te_real a) {
+    te_real *c = context;
     return c[(int)a];
 }
 
 void test_closure() {
 
-    double extra;
-    double c[] = {5,6,7,8,9};
+    te_real extra;
+    te_real c[] = {5,6,7,8,9};
 
     te_variable lookup[] = {
         {"c0", clo0, TE_CLOSURE0, &extra},
@@ -510,7 +513,7 @@ void test_closure() {
     int i;
     for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
         const char *expr = cases[i].expr;
-        const double answer = cases[i].answer;
+        const te_real answer = cases[i].answer;
 
         int err;
         te_expr *ex = te_compile(expr, lookup, sizeof(lookup)/sizeof(te_variable), &err);
@@ -535,7 +538,7 @@ void test_closure() {
 
     for (i = 0; i < sizeof(cases2) / sizeof(test_case); ++i) {
         const char *expr = cases2[i].expr;
-        const double answer = cases2[i].answer;
+        const te_real answer = cases2[i].answer;
 
         int err;
         te_expr *ex = te_compile(expr, lookup, sizeof(lookup)/sizeof(te_variable), &err);
@@ -557,7 +560,7 @@ void test_optimize() {
     int i;
     for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
         const char *expr = cases[i].expr;
-        const double answer = cases[i].answer;
+        const te_real answer = cases[i].answer;
 
         int err;
         te_expr *ex = te_compile(expr, 0, 0, &err);
@@ -612,7 +615,7 @@ void test_pow() {
     };
 #endif
 
-    double a = 2, b = 3;
+    te_real a = 2, b = 3;
 
     te_variable lookup[] = {
         {"a", &a},
@@ -630,8 +633,8 @@ void test_pow() {
         lok(ex1);
         lok(ex2);
 
-        double r1 = te_eval(ex1);
-        double r2 = te_eval(ex2);
+        te_real r1 = te_eval(ex1);
+        te_real r2 = te_eval(ex2);
 
         fflush(stdout);
         const int olfail = lfails;
@@ -676,10 +679,10 @@ void test_combinatorics() {
     int i;
     for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
         const char *expr = cases[i].expr;
-        const double answer = cases[i].answer;
+        const te_real answer = cases[i].answer;
 
         int err;
-        const double ev = te_interp(expr, &err);
+        const te_real ev = te_interp(expr, &err);
         lok(!err);
         lfequal(ev, answer);
 
@@ -690,6 +693,2101 @@ void test_combinatorics() {
 }
 
 
+void test_integer() {
+    te_real n, k, m;
+    te_variable lookup[] = {{"n", &n}, {"k", &k}, {"m", &m}};
+
+    int err;
+    te_expr *expr = te_compile("ncr(n,k)*fac(m) - npr(n,k) % 7", lookup, 3, &err);
+    lok(expr);
+
+    /* Pascal's triangle and factorials as the reference. */
+    double row[19] = {1}, f[19] = {1};
+    int i, j;
+    for (i = 0; i <= 18; ++i) {
+        if (i) f[i] = f[i-1] * i;
+        if (i) for (j = i; j > 0; --j) row[j] += row[j-1];
+        for (j = 0; j <= i; ++j) {
+            n = i; k = j; m = 3;
+            lfequal(te_eval(expr), row[j] * 6 - fmod(row[j] * f[j], 7));
+        }
+    }
+
+    /* Exact where doubles would round. */
+    te_free(expr);
+    expr = te_compile("fac(n) + 1 - fac(n)", lookup, 3, &err);
+    lok(expr);
+    n = 20;
+    lfequal(te_eval(expr), 1);
+
+    te_free(expr);
+    expr = te_compile("ncr(n,k)*fac(m) - npr(n,k) % 7", lookup, 3, &err);
+
+    /* Fractional variables still truncate as before. */
+    n = 5.5; k = 2; m = 3.9;
+    lfequal(te_eval(expr), 10 * 6 - 20 % 7);
+
+    /* Overflowing integers fall back to floating point. */
+    te_free(expr);
+    expr = te_compile("fac(n)*fac(n) + 1", lookup, 3, &err);
+    lok(expr);
+    n = 20;
+    lok(fabs(te_eval(expr) / (2432902008176640000.0 * 2432902008176640000.0) - 1) < 1e-6);
+    n = 21;
+    lok(te_eval(expr) == INFINITY);
+    n = -1;
+    lok(te_eval(expr) != te_eval(expr));
+
+    /* An exact zero is kept, not left to the rounded floating point result. */
+    te_free(expr);
+    expr = te_compile("(fac(n) + 1) - fac(n) - 1", lookup, 3, &err);
+    lok(expr);
+    n = 20;
+    lok(te_eval(expr) == 0);
+
+    /* Batches, derivatives and gradients are exact as well, and rows */
+    /* that overflow fall back to floating point. */
+    te_free(expr);
+    expr = te_compile("(fac(n) + 1) - fac(n)", lookup, 3, &err);
+    lok(expr);
+    te_real ns[3] = {20, 19, -1}, results[3], value, derivative, slope;
+    te_column column[] = {{&n, ns}};
+    te_eval_batch(expr, column, 1, 3, results);
+    lok(results[0] == 1 && results[1] == 1 && results[2] != results[2]);
+    n = 20;
+    lok(te_eval(expr) == 1);
+    te_eval_dual(expr, &k, &value, &derivative);
+    lok(value == 1);
+    const te_real *wrt[] = {&k};
+    lok(te_gradient(expr, wrt, 1, &slope) == 1);
+
+    /* Variables and constants agree outside the float domain as well. */
+    te_free(expr);
+    expr = te_compile("ncr(n, 1) + npr(n, 1)", lookup, 3, &err);
+    lok(expr);
+    te_expr *folded = te_compile("ncr(5e9, 1) + npr(5e9, 1)", lookup, 3, &err);
+    lok(folded);
+    n = 5e9;
+    lok(te_eval(expr) == te_eval(folded));
+    n = 4e9;
+    lfequal(te_eval(expr), 8e9);
+    te_free(folded);
+
+    /* Zero keeps its sign. */
+    te_free(expr);
+    expr = te_compile("1/(fac(n)*-0)", lookup, 3, &err);
+    lok(expr);
+    n = 3;
+    lok(te_eval(expr) == -INFINITY);
+
+    te_free(expr);
+}
+
+
+void test_variadic() {
+    test_case cases[] = {
+        {"min(3, 1, 2)", 1},
+        {"max(3, 1, 2)", 3},
+        {"sum(1, 2, 3, 4)", 10},
+        {"mean(2, 4, 9)", 5},
+        {"hypot(3, 4)", 5},
+        {"hypot(2, 3, 6)", 7},
+        {"hypot(-3)", 3},
+        {"min(5)", 5},
+        {"sum(-1)", -1},
+        {"max(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12)", 12},
+        {"mean(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11)", 6},
+        {"min(max(1, 2), max(3, 0)) + sum(1, 1)", 4},
+        {"sum(1 ? 2 : 3, 1, 2) * 2", 10},
+        {"max(-1, -2)^2", 1},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+        const te_real answer = cases[i].answer;
+
+        int err;
+        const te_real ev = te_interp(expr, &err);
+        lok(!err);
+        lfequal(ev, answer);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", expr, err);
+        }
+    }
+
+    test_case errors[] = {
+        {"min()", 5},
+        {"min", 3},
+        {"max 1", 5},
+        {"sum(1, 2", 8},
+        {"mean(1,)", 8},
+    };
+
+    for (i = 0; i < sizeof(errors) / sizeof(test_case); ++i) {
+        int err;
+        const te_real r = te_interp(errors[i].expr, &err);
+        lequal(err, (int)errors[i].answer);
+        lok(r != r);
+    }
+
+    lok(te_interp("min(1, 0/0, 2)", 0) != te_interp("min(1, 0/0, 2)", 0));
+    lok(te_interp("max(0/0, 2)", 0) != te_interp("max(0/0, 2)", 0));
+
+    /* Far more arguments than a function can take. */
+    char big[4000] = "sum(0";
+    for (i = 1; i <= 500; ++i) sprintf(big + strlen(big), ",%d", i);
+    strcat(big, ")");
+    lfequal(te_interp(big, 0), 500 * 501 / 2);
+
+    /* User variables still take precedence over the builtins. */
+    te_real x, y, sum = 7;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"sum", &sum}};
+    int err;
+    te_expr *n = te_compile("sum + max(x, y, 2) + min(x, -y) + hypot(x, y)", lookup, 3, &err);
+    lok(n);
+
+    te_real xs[100], ys[100], out[100];
+    for (i = 0; i < 100; ++i) {
+        xs[i] = i - 50;
+        ys[i] = (i * 7) % 13;
+    }
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+    te_eval_batch(n, columns, 2, 100, out);
+    for (i = 0; i < 100; ++i) {
+        x = xs[i]; y = ys[i];
+        lfequal(out[i], te_eval(n));
+        lfequal(out[i], 7 + fmax(fmax(x, y), 2) + fmin(x, -y) + sqrt(x*x + y*y));
+    }
+
+    te_range ranges[] = {{&x, -1, 3}, {&y, 2, 4}};
+    te_real lo, hi;
+    lok(!te_eval_interval(n, ranges, 2, &lo, &hi));
+    lfequal(lo, 7 + 2 - 4 + 2);
+    lfequal(hi, 7 + 4 - 2 + 5);
+    te_free(n);
+
+    n = te_compile("mean(x, y)", lookup, 3, &err);
+    lok(!te_eval_interval(n, ranges, 2, &lo, &hi));
+    lfequal(lo, 0.5);
+    lfequal(hi, 3.5);
+    te_free(n);
+
+    /* A single argument hypot is its absolute value on every path. */
+    n = te_compile("hypot(x)", lookup, 3, &err);
+    lok(n);
+    te_eval_batch(n, columns, 2, 100, out);
+    for (i = 0; i < 100; ++i) lfequal(out[i], fabs(xs[i]));
+    x = -3;
+    lfequal(te_eval(n), 3);
+    te_real value, slope;
+    te_eval_dual(n, &x, &value, &slope);
+    lfequal(value, 3);
+    lfequal(slope, -1);
+    const te_real *wrt[] = {&x};
+    lfequal(te_gradient(n, wrt, 1, &slope), 3);
+    lfequal(slope, -1);
+    lok(!te_eval_interval(n, ranges, 2, &lo, &hi));
+    lfequal(lo, 0);
+    lfequal(hi, 3);
+    te_free(n);
+}
+
+
+static int counted_calls;
+
+te_real counted(void *context, te_real a) {
+    ++counted_calls;
+    return a * *(te_real*)context;
+}
+
+static const te_expr *reentered;
+te_real reenter(te_real a) {
+    /* Evaluates the expression being tested once from inside itself. */
+    const te_expr *n = reentered;
+    reentered = 0;
+    return n ? te_eval(n) : 1;
+}
+
+static const te_expr *regraded;
+static te_real regrad_x;
+static int regrad_calls;
+te_real regrad(te_real a) {
+    /* Takes the gradient of the expression being tested on the fourth */
+    /* call, which comes from the outer te_gradient()'s backward pass. */
+    const te_real *wrt = &regrad_x;
+    te_real slope;
+    if (++regrad_calls == 4) te_gradient(regraded, &wrt, 1, &slope);
+    return a;
+}
+
+void test_loops() {
+    test_case cases[] = {
+        {"prod(i = 1 : 5, i)", 120},
+        {"sum(i = 1 : 4, i^2)", 30},
+        {"sum(i = 3 : 2, i)", 0},
+        {"prod(i = 3 : 2, i)", 1},
+        {"sum(k = 0.5 : 2.9, k)", 0.5 + 1.5 + 2.5},
+        {"sum(i = 1 : 3, sum(j = 1 : i, i*j))", 1 + (2 + 4) + (3 + 6 + 9)},
+        {"sum(i = 1 : 3, sum(i = 1 : 2, i))", 9},
+        {"sum(i = 1 : 10, 2)", 20},
+        {"prod(n = 1 : 3, 2^n) + 1", 65},
+        {"prod(2, 3, 4)", 24},
+        {"sum(i = 1 : 2, i) * sum(j = 1 : 3, j)", 18},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+        const te_real answer = cases[i].answer;
+
+        int err;
+        const te_real ev = te_interp(expr, &err);
+        lok(!err);
+        lfequal(ev, answer);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", expr, err);
+        }
+    }
+
+    test_case errors[] = {
+        {"sum(i = 1 : 2)", 14},
+        {"sum(i = 1 : 2, i", 16},
+        {"sum(i = 1 : 2, i, 3)", 17},
+        {"sum(i = 1 : i, 2)", 13},
+        {"i + sum(i = 1 : 2, i)", 1},
+        {"sum(i = 1, 2, i)", 10},
+        {"sum(i, 1, 2, i)", 5},
+    };
+
+    for (i = 0; i < sizeof(errors) / sizeof(test_case); ++i) {
+        int err;
+        const te_real r = te_interp(errors[i].expr, &err);
+        lequal(err, (int)errors[i].answer);
+        lok(r != r);
+    }
+
+    lfequal(te_interp("sum(i = 1 : 1000, 1/i^2)", 0), 1.6439345);
+    lok(te_interp("sum(i = 0/0 : 2, i)", 0) != te_interp("sum(i = 0/0 : 2, i)", 0));
+    lok(te_interp("sum(i = 1 : 1e300, i)", 0) != te_interp("sum(i = 1 : 1e300, i)", 0));
+
+    /* Pure invariants are evaluated once per loop, impure ones every time. */
+    te_real x, y, two = 2;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"twice", counted, TE_CLOSURE1 | TE_FLAG_PURE, &two},
+        {"twice_", counted, TE_CLOSURE1, &two},
+        {"reenter", reenter, TE_FUNCTION1},
+    };
+
+    int err;
+    te_expr *n = te_compile("sum(i = 1 : 10, i * twice(x) + twice(i))", lookup, 4, &err);
+    lok(n);
+    x = 3;
+    counted_calls = 0;
+    lfequal(te_eval(n), 55 * 6 + 110);
+    lequal(counted_calls, 11);
+    te_free(n);
+
+    n = te_compile("sum(i = 1 : 10, i * twice_(x))", lookup, 4, &err);
+    lok(n);
+    counted_calls = 0;
+    lfequal(te_eval(n), 55 * 6);
+    lequal(counted_calls, 10);
+    te_free(n);
+
+    /* Without a binder, bound names are plain variadic arguments. */
+    n = te_compile("sum(x, 1, 2, x)", lookup, 4, &err);
+    lok(n);
+    x = 3;
+    lfequal(te_eval(n), 9);
+    te_free(n);
+
+    /* A binder hides a variable of the same name. */
+    n = te_compile("sum(x = 1 : 10, x^2) + prod(y = 1 : 4, y)", lookup, 4, &err);
+    lok(n);
+    lfequal(te_eval(n), 385 + 24);
+    lfequal(x, 3);
+    te_free(n);
+
+    /* te_eval() keeps the index out of the expression, so it can reenter. */
+    n = te_compile("sum(i = 1 : 3, reenter(i) ? i : 0)", lookup, 5, &err);
+    lok(n);
+    reentered = n;
+    lfequal(te_eval(n), 6);
+    te_free(n);
+
+    /* So does te_gradient(). */
+    te_variable regrad_lookup[] = {{"x", &regrad_x}, {"regrad", regrad, TE_FUNCTION1}};
+    n = te_compile("sum(i = 1 : 3, regrad(i) ? x*i : 0)", regrad_lookup, 2, &err);
+    lok(n);
+    const te_real *regrad_wrt = &regrad_x;
+    te_real regrad_slope;
+    regraded = n;
+    regrad_x = 2;
+    lfequal(te_gradient(n, &regrad_wrt, 1, &regrad_slope), 12);
+    lfequal(regrad_slope, 6);
+    lok(regrad_calls > 4);
+    te_free(n);
+
+    /* Batches give the same results as rows one at a time. */
+    n = te_compile("sum(i = x : y, sum(j = 1 : i, x*j + twice(y)))", lookup, 4, &err);
+    lok(n);
+    te_real xs[300], ys[300], out[300];
+    for (i = 0; i < 300; ++i) {
+        xs[i] = i % 7 - 2;
+        ys[i] = i % 11 - 1;
+    }
+    ys[299] = NAN;
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+    te_eval_batch(n, columns, 2, 300, out);
+    for (i = 0; i < 300; ++i) {
+        x = xs[i]; y = ys[i];
+        const te_real expected = te_eval(n);
+        if (expected == expected) {
+            lfequal(out[i], expected);
+        } else {
+            lok(out[i] != out[i]);
+        }
+    }
+    te_free(n);
+
+    /* Loops with more invariants than are hoisted still evaluate and derive. */
+    char many[1024] = "sum(i = 1 : 3, i * (0";
+    for (i = 1; i <= 20; ++i) sprintf(many + strlen(many), " + sin(x + %d)", i);
+    strcat(many, "))");
+    n = te_compile(many, lookup, 4, &err);
+    lok(n);
+    te_real value, slope, expected = 0, expected_slope = 0;
+    for (i = 1; i <= 20; ++i) {
+        expected += 6 * sin(2 + i);
+        expected_slope += 6 * cos(2 + i);
+    }
+    x = 2;
+    lfequal(te_eval(n), expected);
+    xs[0] = 2;
+    te_eval_batch(n, columns, 1, 1, out);
+    lfequal(out[0], expected);
+    te_eval_dual(n, &x, &value, &slope);
+    lfequal(value, expected);
+    lfequal(slope, expected_slope);
+    te_expr *d = te_derive(n, &x);
+    lok(d);
+    lfequal(te_eval(d), expected_slope);
+    te_free(d);
+    te_free(n);
+}
+
+
+void test_arrays() {
+    te_real x, v[] = {5, 6, 7, 8}, w[] = {1, 2};
+    te_array a = {v, 4}, b = {w, 2};
+    te_variable lookup[] = {{"x", &x}, {"a", &a, TE_ARRAY}, {"b", &b, TE_ARRAY}};
+
+    test_case cases[] = {
+        {"a[0]", 5},
+        {"a[3]", 8},
+        {"a [ 1 ] + b[1]", 8},
+        {"a[b[0]]", 6},
+        {"a[x - 1] * 2", 12},
+        {"a[1]^2 - a[0]", 31},
+        {"a[x > 1 ? 3 : 0]", 8},
+        {"sum(i = 0 : 3, a[i])", 26},
+        {"sum(i = 0 : 1, a[i] * b[i])", 17},
+    };
+
+    int i, err;
+    x = 2;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+        te_expr *n = te_compile(expr, lookup, 3, &err);
+        lok(n);
+        lfequal(te_eval(n), cases[i].answer);
+        te_free(n);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", expr, err);
+        }
+    }
+
+    /* Out of bounds and fractional indices read NaN. */
+    const char *nans[] = {"a[4]", "a[-1]", "a[1.5]", "b[2]", "a[0/0]"};
+    for (i = 0; i < sizeof(nans) / sizeof(const char *); ++i) {
+        te_expr *n = te_compile(nans[i], lookup, 3, &err);
+        lok(n);
+        const te_real r = te_eval(n);
+        lok(r != r);
+        te_free(n);
+    }
+
+    test_case errors[] = {
+        {"a", 1},
+        {"a[1", 3},
+        {"a[1, 2]", 4},
+        {"x[1]", 2},
+        {"a(1)", 2},
+        {"[1]", 1},
+        {"1]", 2},
+    };
+
+    for (i = 0; i < sizeof(errors) / sizeof(test_case); ++i) {
+        te_expr *n = te_compile(errors[i].expr, lookup, 3, &err);
+        lok(!n);
+        lequal(err, (int)errors[i].answer);
+    }
+
+    /* Arrays are read at evaluation time, so they can be rebound. */
+    te_expr *n = te_compile("a[x] + a[0]", lookup, 3, &err);
+    lok(n);
+    x = 3;
+    lfequal(te_eval(n), 13);
+    v[0] = 1;
+    lfequal(te_eval(n), 9);
+    a.data = w;
+    a.length = 2;
+    x = 1;
+    lfequal(te_eval(n), 3);
+    x = 3;
+    lok(te_eval(n) != te_eval(n));
+
+    te_real xs[40], out[40];
+    for (i = 0; i < 40; ++i) xs[i] = i % 3;
+    te_column columns[] = {{&x, xs}};
+    te_eval_batch(n, columns, 1, 40, out);
+    for (i = 0; i < 40; ++i) {
+        if (i % 3 == 2) {
+            lok(out[i] != out[i]);
+        } else {
+            lfequal(out[i], w[i % 3] + 1);
+        }
+    }
+    te_free(n);
+    a.data = v;
+    a.length = 4;
+}
+
+
+void test_vectors() {
+    te_real x, pv[] = {1, 2, 3}, qv[] = {4, 5, 6}, rv[] = {3, 4};
+    te_array p = {pv, 3}, q = {qv, 3}, r = {rv, 2};
+    te_variable lookup[] = {{"x", &x}, {"p", &p, TE_VECTOR}, {"q", &q, TE_VECTOR}, {"r", &r, TE_VECTOR}};
+
+    typedef struct {
+        const char *expr;
+        int width;
+        te_real answer[4];
+    } vector_case;
+
+    vector_case cases[] = {
+        {"p", 3, {1, 2, 3}},
+        {"p + q", 3, {5, 7, 9}},
+        {"2 * p - x", 3, {0, 2, 4}},
+        {"-(p^2)", 3, {-1, -4, -9}},
+        {"dot(p, q)", 1, {32}},
+        {"cross(p, q)", 3, {-3, 6, -3}},
+        {"length(r)", 1, {5}},
+        {"r / length(r)", 2, {0.6, 0.8}},
+        {"vec(x, 1, 0, -x)", 4, {2, 1, 0, -2}},
+        {"dot(cross(p, q), p)", 1, {0}},
+        {"p[1] + q[2]", 1, {8}},
+        {"max(p, 2)", 3, {2, 2, 3}},
+        {"min(p, 4, q, 3, p, 9, 8, 7, 2 * p)", 3, {1, 2, 3}},
+        {"mean(p, q, x)", 3, {7.0 / 3, 3, 11.0 / 3}},
+        {"hypot(-p)", 3, {1, 2, 3}},
+        {"p > 1 ? p : 0", 3, {0, 2, 3}},
+        {"sum(i = 1 : 3, p * i)", 3, {6, 12, 18}},
+        {"dot(p, vec(1, 0, 0)) * x", 1, {2}},
+        {"sqrt(r)^2", 2, {3, 4}},
+        {"x + 1", 1, {3}},
+    };
+
+    int i, j, err;
+    x = 2;
+    for (i = 0; i < sizeof(cases) / sizeof(vector_case); ++i) {
+        const char *expr = cases[i].expr;
+        te_expr *n = te_compile(expr, lookup, 4, &err);
+        lok(n);
+        te_real out[TE_VECTOR_MAX];
+        lequal(te_eval_vector(n, out), cases[i].width);
+        for (j = 0; j < cases[i].width; ++j) {
+            lfequal(out[j], cases[i].answer[j]);
+        }
+        te_free(n);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", expr, err);
+        }
+    }
+
+    /* Vectors of different sizes don't mix. */
+    const char *mismatched[] = {"p + r", "dot(p, r)", "cross(p, r)", "vec(p, 1)", "length(p) + r * p"};
+    for (i = 0; i < sizeof(mismatched) / sizeof(const char *); ++i) {
+        te_expr *n = te_compile(mismatched[i], lookup, 4, &err);
+        lok(n);
+        te_real out[TE_VECTOR_MAX];
+        lequal(te_eval_vector(n, out), 0);
+        te_free(n);
+    }
+
+    test_case errors[] = {
+        {"dot(p)", 6},
+        {"cross(p, q, p)", 14},
+        {"length(p, q)", 12},
+        {"vec(1)", 6},
+        {"vec(1, 2, 3, 4, 5)", 18},
+        {"p[1", 3},
+    };
+
+    for (i = 0; i < sizeof(errors) / sizeof(test_case); ++i) {
+        te_expr *n = te_compile(errors[i].expr, lookup, 4, &err);
+        lok(!n);
+        lequal(err, (int)errors[i].answer);
+    }
+
+    /* Scalar results of vectors work everywhere, vectors themselves are NaN. */
+    te_expr *n = te_compile("length(p - x * q)", lookup, 4, &err);
+    lok(n);
+    lfequal(te_eval(n), sqrt(49 + 64 + 81));
+
+    te_real xs[50], out[50];
+    for (i = 0; i < 50; ++i) xs[i] = i * 0.5;
+    te_column columns[] = {{&x, xs}};
+    te_eval_batch(n, columns, 1, 50, out);
+    for (i = 0; i < 50; ++i) {
+        x = xs[i];
+        lfequal(out[i], te_eval(n));
+    }
+    te_free(n);
+
+    n = te_compile("p + 1", lookup, 4, &err);
+    lok(n);
+    lok(te_eval(n) != te_eval(n));
+    te_free(n);
+
+    /* Scalar parts shared by the components are evaluated once. */
+    te_real k = 2;
+    te_variable counting[] = {{"x", &x}, {"p", &p, TE_VECTOR}, {"f", counted, TE_CLOSURE1, &k}};
+    te_real v[TE_VECTOR_MAX];
+    x = 2;
+    n = te_compile("vec(1, 2, 3) * f(x)", counting, 3, &err);
+    lok(n);
+    counted_calls = 0;
+    lequal(te_eval_vector(n, v), 3);
+    lequal(counted_calls, 1);
+    lfequal(v[2], 12);
+    te_free(n);
+
+    n = te_compile("length(p * f(x) + f(1))", counting, 3, &err);
+    lok(n);
+    counted_calls = 0;
+    lfequal(te_eval(n), sqrt(332));
+    lequal(counted_calls, 2);
+    counted_calls = 0;
+    te_eval_batch(n, columns, 1, 50, out);
+    lequal(counted_calls, 100);
+    te_free(n);
+
+    /* Rows of a block may take different branches. */
+    n = te_compile("length(x > 5 ? p * f(x) : p - 1)", counting, 3, &err);
+    lok(n);
+    te_eval_batch(n, columns, 1, 50, out);
+    for (i = 0; i < 50; ++i) {
+        x = xs[i];
+        lfequal(out[i], te_eval(n));
+    }
+    te_free(n);
+}
+
+
+void test_sets() {
+    te_real x, y, two = 2;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"twice", counted, TE_CLOSURE1 | TE_FLAG_PURE, &two},
+        {"twice_", counted, TE_CLOSURE1, &two},
+    };
+
+    const char *exprs[] = {
+        "sin(x)*y + sqrt(x*x + y*y)",
+        "sqrt(x*x + y*y)",
+        "cos(x) + sin(x)*y",
+        "5",
+        "x",
+        "sin(x)*y + sqrt(x*x + y*y)",
+        "twice(x + y) + twice(x + y)^2",
+        "twice(x + y) - twice_(x) - twice_(x)",
+        "x > y ? sin(x)*y : x*x + y*y",
+        "sum(i = 1 : 3, i*x) + sum(i = 1 : 3, i*x)",
+    };
+    const int count = sizeof(exprs) / sizeof(const char *);
+
+    int i, j, err;
+    te_set *set = te_compile_set(exprs, count, lookup, 4, &err);
+    lok(set);
+    lequal(err, 0);
+
+    te_expr *single[sizeof(exprs) / sizeof(const char *)];
+    for (i = 0; i < count; ++i) {
+        single[i] = te_compile(exprs[i], lookup, 4, &err);
+        lok(single[i]);
+    }
+
+    te_real out[sizeof(exprs) / sizeof(const char *)];
+    for (j = 0; j < 20; ++j) {
+        x = j * 0.3 - 2;
+        y = 1 - j * 0.1;
+        te_eval_set(set, out);
+        for (i = 0; i < count; ++i) {
+            lfequal(out[i], te_eval(single[i]));
+        }
+    }
+
+    /* Pure functions of the same arguments are called once for the whole set. */
+    counted_calls = 0;
+    te_eval_set(set, out);
+    lequal(counted_calls, 3);
+
+    for (i = 0; i < count; ++i) te_free(single[i]);
+    te_free_set(set);
+
+    const char *bad[] = {"x + y", "sin(x", "y"};
+    set = te_compile_set(bad, 3, lookup, 4, &err);
+    lok(!set);
+    lequal(err, 5);
+
+    set = te_compile_set(exprs, 0, lookup, 4, &err);
+    lok(set);
+    te_eval_set(set, out);
+    te_free_set(set);
+    te_free_set(0);
+}
+
+
+void test_sparse_sets() {
+    te_real v[100];
+    char names[100][8];
+    te_variable lookup[100];
+    int i, j, err;
+    for (i = 0; i < 100; ++i) {
+        sprintf(names[i], "v%d", i);
+        lookup[i].name = names[i];
+        lookup[i].address = v + i;
+        lookup[i].type = TE_VARIABLE;
+        lookup[i].context = 0;
+    }
+
+    /* Affine and other expressions mixed, including repeated variables. */
+    const char *exprs[] = {
+        "2*v3 - v7/4 + 1.5",
+        "v1 + v1 + v2",
+        "-(v5 - 3)",
+        "sum(v1, v2, v3) * 2",
+        "mean(v1, v3)",
+        "v1*v2",
+        "v4 - v4",
+        "7",
+        "sin(v1) + v2",
+        "v0 + sin(v1)*3",
+        "0*v9",
+        "v2/0",
+    };
+    const int count = sizeof(exprs) / sizeof(const char *);
+
+    te_set *set = te_compile_set(exprs, count, lookup, 100, &err);
+    lok(set);
+    te_expr *single[sizeof(exprs) / sizeof(const char *)];
+    for (i = 0; i < count; ++i) single[i] = te_compile(exprs[i], lookup, 100, &err);
+
+    te_real out[500];
+    for (j = 0; j < 10; ++j) {
+        for (i = 0; i < 100; ++i) v[i] = (i * 7 + j * 3) % 11 - 5;
+        if (j == 9) v[9] = NAN;
+        te_eval_set(set, out);
+        for (i = 0; i < count; ++i) {
+            const te_real expected = te_eval(single[i]);
+            if (expected != expected) {
+                lok(out[i] != out[i]);
+            } else if (isinf(expected)) {
+                lok(out[i] == expected);
+            } else {
+                lfequal(out[i], expected);
+            }
+        }
+    }
+    for (i = 0; i < count; ++i) te_free(single[i]);
+    te_free_set(set);
+
+    /* Many sparse linear combinations over a shared pool. */
+    static char text[500][200];
+    const char *many[500];
+    unsigned int seed = 12345;
+    for (i = 0; i < 500; ++i) {
+        sprintf(text[i], "%d", i % 7);
+        for (j = 0; j < 5; ++j) {
+            seed = seed * 1103515245 + 12345;
+            sprintf(text[i] + strlen(text[i]), " + %d*v%d", (int)(seed >> 16) % 9 - 4, (int)(seed >> 8) % 100);
+        }
+        many[i] = text[i];
+    }
+    set = te_compile_set(many, 500, lookup, 100, &err);
+    lok(set);
+    for (i = 0; i < 100; ++i) v[i] = i * 0.25 - 10;
+    te_eval_set(set, out);
+    for (i = 0; i < 500; ++i) {
+        te_expr *n = te_compile(many[i], lookup, 100, &err);
+        lfequal(out[i], te_eval(n));
+        te_free(n);
+    }
+    te_free_set(set);
+}
+
+
+te_real cubed(te_real a) {
+    return a * a * a;
+}
+
+te_real cubed_partial(const te_real *args, int i) {
+    (void)i;
+    return 3 * args[0] * args[0];
+}
+
+te_real weighted(void *context, te_real a, te_real b) {
+    return *(te_real*)context * a * b;
+}
+
+te_real scaled_partial(void *context, const te_real *args, int i) {
+    return *(te_real*)context * args[1 - i];
+}
+
+te_real wobble(te_real a) {
+    return a * sin(a);
+}
+
+void test_dual() {
+    te_real x, y, k = 3, pv[] = {1, 2, 2};
+    te_array p = {pv, 3};
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y}, {"p", &p, TE_VECTOR},
+        {"cubed", cubed, TE_FUNCTION1, 0, cubed_partial},
+        {"weighted", weighted, TE_CLOSURE2, &k, scaled_partial},
+        {"wobble", wobble, TE_FUNCTION1},
+    };
+
+    /* Each expression with its derivative in x. */
+    const char *cases[][2] = {
+        {"x", "1"},
+        {"y", "0"},
+        {"3*x^2 - x/2 + 1", "6*x - 0.5"},
+        {"-x * y", "-y"},
+        {"x / (1 + x^2)", "(1 - x^2) / (1 + x^2)^2"},
+        {"sin(x) * cos(x)", "cos(x)^2 - sin(x)^2"},
+        {"tan(x)", "1 / cos(x)^2"},
+        {"exp(2*x)", "2*exp(2*x)"},
+        {"ln(x)", "1/x"},
+        {"log10(x)", "1 / (x * ln(10))"},
+        {"sqrt(x)", "0.5 / sqrt(x)"},
+        {"asin(x/4) + acos(x/5)", "1 / sqrt(16 - x^2) - 1 / sqrt(25 - x^2)"},
+        {"atan(x)", "1 / (1 + x^2)"},
+        {"atan2(x, y)", "y / (x^2 + y^2)"},
+        {"sinh(x) + cosh(x) + tanh(x)", "cosh(x) + sinh(x) + 1 - tanh(x)^2"},
+        {"abs(-x)", "1"},
+        {"floor(x) + ceil(x)", "0"},
+        {"x^y", "y * x^(y - 1)"},
+        {"y^x", "y^x * ln(y)"},
+        {"x % 1.5", "1"},
+        {"x > 1 ? x^2 : -x", "x > 1 ? 2*x : -1"},
+        {"(x < y) * x", "x < y"},
+        {"y, 2*x", "2"},
+        {"max(x, y, 2)", "x > y && x > 2"},
+        {"min(x, 1)", "x < 1"},
+        {"sum(x, x^2, y) + mean(x, 3)", "1 + 2*x + 0.5"},
+        {"prod(x, x, y)", "2*x*y"},
+        {"hypot(x, y)", "x / hypot(x, y)"},
+        {"sum(i = 1 : 3, x^i)", "1 + 2*x + 3*x^2"},
+        {"prod(i = 1 : 2, x + i*y)", "2*x + 3*y"},
+        {"sum(i = 1 : 4, sin(x) * i)", "10 * cos(x)"},
+        {"cubed(x) + cubed(y)", "3*x^2"},
+        {"weighted(x, y) + weighted(y, 2*x)", "9*y"},
+        {"wobble(x)", "sin(x) + x*cos(x)"},
+        {"length(p * x)", "3"},
+        {"dot(p, vec(x, x^2, 1))", "1 + 4*x"},
+        {"length(cross(p, vec(x, 0, 0)))", "sqrt(8)"},
+    };
+
+    int i, j, err;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        te_expr *n = te_compile(cases[i][0], lookup, 6, &err);
+        te_expr *d = te_compile(cases[i][1], lookup, 6, &err);
+        lok(n && d);
+        for (j = 0; j < 4; ++j) {
+            x = 1.25 + j * 0.5;
+            y = 1.5 + j * 0.25;
+            te_real value, derivative;
+            te_eval_dual(n, &x, &value, &derivative);
+            lfequal(value, te_eval(n));
+            lfequal(derivative, te_eval(d));
+        }
+        te_free(n);
+        te_free(d);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", cases[i][0], err);
+        }
+    }
+
+    /* Seeding a variable the expression doesn't use. */
+    te_expr *n = te_compile("x^2", lookup, 6, &err);
+    te_real value, derivative;
+    x = 3;
+    te_eval_dual(n, &y, &value, &derivative);
+    lfequal(value, 9);
+    lfequal(derivative, 0);
+    te_free(n);
+
+    te_eval_dual(0, &x, &value, &derivative);
+    lok(value != value && derivative != derivative);
+
+    /* Derivative callbacks are used as given. */
+    n = te_compile("cubed(x)", lookup, 6, &err);
+    x = 1.5;
+    te_eval_dual(n, &x, &value, &derivative);
+    lfequal(value, 3.375);
+    lfequal(derivative, 6.75);
+    te_free(n);
+
+    /* Batches agree with scalar evaluation, with the seed read from a column. */
+    te_real xs[300], ys[300], values[300], derivatives[300];
+    for (i = 0; i < 300; ++i) {
+        xs[i] = 0.5 + i * 0.01;
+        ys[i] = 2 - i * 0.005;
+    }
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+    const char *batch[] = {"x^3 * y", "x > y ? sin(x) : y/x", "sum(i = 1 : 4, x*i + y)", "weighted(x, x) + wobble(x*y)"};
+    for (i = 0; i < sizeof(batch) / sizeof(const char *); ++i) {
+        n = te_compile(batch[i], lookup, 6, &err);
+        lok(n);
+        te_eval_dual_batch(n, columns, 2, 300, &x, values, derivatives);
+        for (j = 0; j < 300; j += 7) {
+            x = xs[j];
+            y = ys[j];
+            te_eval_dual(n, &x, &value, &derivative);
+            lfequal(values[j], value);
+            lfequal(derivatives[j], derivative);
+        }
+        te_free(n);
+    }
+}
+
+
+void test_gradient() {
+    te_real x, y, z, pv[] = {1, 2, 2}, k = 3;
+    te_array p = {pv, 3};
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y}, {"z", &z}, {"p", &p, TE_VECTOR},
+        {"cubed", cubed, TE_FUNCTION1, 0, cubed_partial},
+        {"weighted", weighted, TE_CLOSURE2, &k, scaled_partial},
+        {"wobble", wobble, TE_FUNCTION1},
+    };
+    const te_real *wrt[] = {&x, &y, &z, &x};
+
+    /* Every derivative matches forward mode. */
+    const char *cases[] = {
+        "x*y*z + x^2 - z/y",
+        "sin(x*y) * exp(-z) + atan2(y, z)",
+        "sqrt(x^2 + y^2 + z^2)",
+        "x > y ? x*z : y^z",
+        "x < y ? x*z : y^z",
+        "(x > 0) * y + floor(z) * x",
+        "min(x, y, z) + max(x*2, y) * mean(x, y, z)",
+        "sum(x, y, z) * prod(x, y, z, 2)",
+        "prod(x, y - 2, z, y - 2)",
+        "hypot(x, y, z)",
+        "sum(i = 1 : 5, x^i * sin(y))",
+        "prod(i = 1 : 4, x + i*z)",
+        "prod(i = 0 : 3, x - i)",
+        "sum(i = 1 : 3, sum(j = 1 : i, x*j + y*cos(z)))",
+        "cubed(x*y) + weighted(y, z) + wobble(z*x)",
+        "length(p * x) + dot(p, vec(y, z, x*y))",
+        "sum(i = 1 : 2, dot(p, vec(i*x, y, sin(z))))",
+        "x % 1.5 + 3, y*z",
+        "sin(x)",
+        "7",
+    };
+
+    int i, j, err;
+    for (i = 0; i < sizeof(cases) / sizeof(const char *); ++i) {
+        te_expr *n = te_compile(cases[i], lookup, 7, &err);
+        lok(n);
+        for (j = 0; j < 3; ++j) {
+            te_real gradient[4], value, derivative;
+            int v;
+            x = 1.5 + j * 0.5;
+            y = 2 - j * 0.25;
+            z = 0.75 + j;
+            lfequal(te_gradient(n, wrt, 4, gradient), te_eval(n));
+            for (v = 0; v < 4; ++v) {
+                te_eval_dual(n, wrt[v], &value, &derivative);
+                lfequal(gradient[v], derivative);
+            }
+        }
+        te_free(n);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", cases[i], err);
+        }
+    }
+
+    /* Many variables in one pass. */
+    te_real v[200];
+    char names[200][8];
+    te_variable many[200];
+    const te_real *addresses[200];
+    char text[4000] = "0";
+    for (i = 0; i < 200; ++i) {
+        sprintf(names[i], "v%d", i);
+        many[i].name = names[i];
+        many[i].address = v + i;
+        many[i].type = TE_VARIABLE;
+        many[i].context = 0;
+        many[i].derivative = 0;
+        addresses[i] = v + (199 - i);
+        v[i] = i * 0.01;
+        if (i % 2) sprintf(text + strlen(text), "+v%d^2", i);
+    }
+    te_expr *n = te_compile(text, many, 200, &err);
+    lok(n);
+    te_real gradient[200];
+    te_gradient(n, addresses, 200, gradient);
+    for (i = 0; i < 200; ++i) {
+        const int at = 199 - i;
+        lfequal(gradient[i], at % 2 ? 2 * v[at] : 0);
+    }
+    te_free(n);
+
+    lok(te_gradient(0, wrt, 4, gradient) != te_gradient(0, wrt, 4, gradient));
+    lok(gradient[0] != gradient[0]);
+}
+
+
+void test_derive() {
+    te_real x, y, z, pv[] = {1, 2, 2}, k = 3;
+    te_array p = {pv, 3};
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y}, {"z", &z}, {"p", &p, TE_VECTOR},
+        {"cubed", cubed, TE_FUNCTION1, 0, cubed_partial},
+        {"weighted", weighted, TE_CLOSURE2, &k, scaled_partial},
+        {"wobble", wobble, TE_FUNCTION1},
+    };
+
+    /* The derivative expressions agree with forward mode. */
+    const char *cases[] = {
+        "x*y*z + x^2 - z/x",
+        "sin(x*y) * exp(-x) + atan2(y, x) + atan(x/4)",
+        "sqrt(x^2 + y^2) + ln(x) + log10(x*2)",
+        "tan(x) + cosh(x) - sinh(y*x) + tanh(x)",
+        "asin(x/5) + acos(x/6) + abs(1 - x)",
+        "x > y ? x*z : y^x",
+        "(x > 0) * y + floor(z) * x + fac(4)",
+        "min(x, y, z) + max(x*2, y) * mean(x, y, z)",
+        "sum(x, y, z) * prod(x, y, z, 2)",
+        "prod(x, y - 2, z, x - 2)",
+        "hypot(x, y, z)",
+        "x % 1.5 + 7 % x",
+        "(x, y*x)",
+        "sum(i = 1 : 5, x^i * sin(y))",
+        "sum(i = 1 : 3, sin(x) * cos(y*i) + i*x)",
+        "prod(i = 1 : 4, x + i*z)",
+        "prod(i = 0 : 3, x - i)",
+        "sum(i = 1 : 3, sum(j = 1 : i, x*j + y*cos(x)))",
+        "cubed(x*y) + weighted(y, x) + wobble(z*x)",
+        "length(p * x) + dot(p, vec(y, z, x*y))",
+        "length(cross(p, vec(x, 1, x^2))) + dot(p + x, p)",
+        "sum(i = 1 : 2, dot(p, vec(i*x, y, sin(x))))",
+        "y*z",
+        "7",
+    };
+
+    int i, j, err;
+    for (i = 0; i < sizeof(cases) / sizeof(const char *); ++i) {
+        te_expr *n = te_compile(cases[i], lookup, 7, &err);
+        lok(n);
+        te_expr *d = te_derive(n, &x);
+        lok(d);
+        for (j = 0; j < 3; ++j) {
+            te_real value, derivative;
+            x = 1.5 + j * 0.5;
+            y = 2 - j * 0.25;
+            z = 0.75 + j;
+            te_eval_dual(n, &x, &value, &derivative);
+            lfequal(te_eval(d), derivative);
+        }
+        te_free(n);
+        te_free(d);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", cases[i], err);
+        }
+    }
+
+    /* Terms that don't depend on the variable are left out, NaNs and all. */
+    te_expr *n = te_compile("3*x + y*ln(z) - 2", lookup, 7, &err);
+    te_expr *d = te_derive(n, &x);
+    y = INFINITY;
+    z = -1;
+    lok(d);
+    lfequal(te_eval(d), 3);
+    te_free(d);
+    d = te_derive(n, &k);
+    lok(d);
+    lfequal(te_eval(d), 0);
+    te_free(d);
+    te_free(n);
+
+    /* Second derivatives, outliving the original. */
+    n = te_compile("x^3 + sin(x)*y", lookup, 7, &err);
+    d = te_derive(n, &x);
+    te_expr *d2 = te_derive(d, &x);
+    te_free(n);
+    te_free(d);
+    for (j = 0; j < 3; ++j) {
+        x = j - 0.5;
+        y = 2;
+        lfequal(te_eval(d2), 6*x - sin(x)*y);
+    }
+    te_free(d2);
+
+    lok(te_derive(0, &x) == 0);
+}
+
+
+void test_solve() {
+    te_real x, a;
+    te_variable lookup[] = {{"x", &x}, {"a", &a}};
+    int i, err;
+
+    /* Roots of a cubic for many targets. */
+    te_expr *n = te_compile("x^3 - 2*x - 5", lookup, 2, &err);
+    lok(n);
+    te_real targets[300], brackets[600], out[300], as[300];
+    unsigned char converged[300];
+    for (i = 0; i < 300; ++i) {
+        targets[i] = i * 0.5 - 10;
+        brackets[2 * i] = i % 2 ? -10 : 10;
+        brackets[2 * i + 1] = -brackets[2 * i];
+    }
+    /* Rows with no sign change in their bracket don't converge. */
+    brackets[2 * 7] = 2.5;
+    lequal(te_solve_batch(n, &x, 0, 0, 300, targets, brackets, out, converged), 299);
+    for (i = 0; i < 300; ++i) {
+        if (i == 7) {
+            lok(!converged[i] && out[i] != out[i]);
+            continue;
+        }
+        lok(converged[i]);
+        x = out[i];
+        lfequal(te_eval(n), targets[i]);
+    }
+
+    te_free(n);
+
+    /* Roots right at the ends of their brackets, and no targets. */
+    n = te_compile("x^2 - 4", lookup, 2, &err);
+    te_real ends[] = {2, 3, -1, 1, -5, -2};
+    lequal(te_solve_batch(n, &x, 0, 0, 3, 0, ends, out, 0), 2);
+    lfequal(out[0], 2);
+    lok(out[1] != out[1]);
+    lfequal(out[2], -2);
+    te_free(n);
+
+    /* Other variables come from columns. */
+    n = te_compile("a * x^2 + sin(x)", lookup, 2, &err);
+    for (i = 0; i < 300; ++i) {
+        as[i] = 1 + i * 0.1;
+        targets[i] = i;
+        brackets[2 * i] = 0;
+        brackets[2 * i + 1] = 100;
+    }
+    te_column columns[] = {{&a, as}};
+    lequal(te_solve_batch(n, &x, columns, 1, 300, targets, brackets, out, converged), 300);
+    for (i = 0; i < 300; ++i) {
+        lok(converged[i]);
+        a = as[i];
+        x = out[i];
+        lfequal(te_eval(n), targets[i]);
+    }
+    te_free(n);
+
+    /* Steps and kinks are left to bisection. */
+    n = te_compile("(x > 1.25) - 0.5 + abs(x - 3) * 0", lookup, 2, &err);
+    te_real wide[] = {-4, 4};
+    lequal(te_solve_batch(n, &x, 0, 0, 1, 0, wide, out, converged), 1);
+    lfequal(out[0], 1.25);
+    te_free(n);
+
+    lequal(te_solve_batch(0, &x, 0, 0, 1, 0, wide, out, converged), 0);
+    lok(out[0] != out[0] && !converged[0]);
+}
+
+
+void test_integrate() {
+    te_real x, a;
+    te_variable lookup[] = {{"x", &x}, {"a", &a}};
+    int i, err;
+
+    te_expr *n = te_compile("sin(x)", lookup, 2, &err);
+    lok(n);
+    lfequal(te_integrate(n, &x, 0, 3.14159265358979, 1e-5), 2);
+    lfequal(te_integrate(n, &x, 3.14159265358979, 0, 1e-5), -2);
+    lfequal(te_integrate(n, &x, 1, 1, 1e-5), 0);
+    te_free(n);
+
+    /* Kinks and infinite slopes need the range split further. */
+    n = te_compile("abs(x - 1) + sqrt(x)", lookup, 2, &err);
+    te_real ranges[] = {0, 3, 0, 1, 1, 0};
+    te_real out[300];
+    unsigned char converged[300];
+    lequal(te_integrate_batch(n, &x, 0, 0, 3, ranges, 1e-5, out, converged), 3);
+    lfequal(out[0], 2.5 + 2 * sqrt(3));
+    lfequal(out[1], 0.5 + 2.0 / 3);
+    lfequal(out[2], -0.5 - 2.0 / 3);
+
+    te_free(n);
+
+    /* Rows that can't meet the tolerance still give their estimate. */
+    n = te_compile("1 / sqrt(x)", lookup, 2, &err);
+    lequal(te_integrate_batch(n, &x, 0, 0, 1, ranges + 2, 0, out, converged), 0);
+    lok(!converged[0]);
+    lfequal(out[0], 2);
+    te_free(n);
+
+    /* NaNs anywhere in the range give NaN. */
+    n = te_compile("sqrt(x)", lookup, 2, &err);
+    te_real nan_range[] = {-1, 1};
+    lequal(te_integrate_batch(n, &x, 0, 0, 1, nan_range, 1e-5, out, converged), 0);
+    lok(!converged[0] && out[0] != out[0]);
+    te_free(n);
+
+    /* Densities with a parameter from a column, over many ranges. */
+    n = te_compile("exp((x / a)^2 / -2) / (a * sqrt(2 * pi))", lookup, 2, &err);
+    te_real as[300], bounds[600];
+    for (i = 0; i < 300; ++i) {
+        as[i] = 0.5 + i * 0.01;
+        bounds[2 * i] = i % 2 ? 0 : -8 * as[i];
+        bounds[2 * i + 1] = 8 * as[i];
+    }
+    te_column columns[] = {{&a, as}};
+    lequal(te_integrate_batch(n, &x, columns, 1, 300, bounds, 1e-5, out, converged), 300);
+    for (i = 0; i < 300; ++i) {
+        lok(converged[i]);
+        lfequal(out[i], i % 2 ? 0.5 : 1);
+    }
+    te_free(n);
+
+    lok(te_integrate(0, &x, 0, 1, 1e-5) != te_integrate(0, &x, 0, 1, 1e-5));
+}
+
+
+void test_random() {
+    te_real x;
+    te_variable lookup[] = {{"x", &x}};
+    te_real first[1000], out[1000], mean = 0, square = 0;
+    int i, err;
+
+    te_expr *n = te_compile("unif()", lookup, 1, &err);
+    lok(n);
+    te_seed(42, 0);
+    for (i = 0; i < 1000; ++i) {
+        first[i] = te_eval(n);
+        lok(first[i] >= 0 && first[i] < 1);
+        mean += first[i] / 1000;
+    }
+    lok(fabs(mean - 0.5) < 0.05);
+
+    /* The same seed and stream repeat the draws, in scalar or batch. */
+    te_seed(42, 0);
+    te_eval_batch(n, 0, 0, 1000, out);
+    for (i = 0; i < 1000; ++i) lok(out[i] == first[i]);
+
+    te_seed(42, 1);
+    int same = 0;
+    for (i = 0; i < 1000; ++i) same += te_eval(n) == first[i];
+    lok(same < 5);
+    te_free(n);
+
+    n = te_compile("normal", lookup, 1, &err);
+    lok(n);
+    te_seed(7, 0);
+    te_eval_batch(n, 0, 0, 1000, out);
+    mean = 0;
+    for (i = 0; i < 1000; ++i) {
+        mean += out[i] / 1000;
+        square += out[i] * out[i] / 1000;
+    }
+    lok(fabs(mean) < 0.1);
+    lok(fabs(square - 1) < 0.1);
+
+    te_real lo, hi;
+    lok(!te_eval_interval(n, 0, 0, &lo, &hi));
+    lok(lo == -INFINITY && hi == INFINITY);
+    te_free(n);
+
+    /* Every call draws again, so nothing is folded or hoisted. */
+    n = te_compile("unif() - unif()", lookup, 1, &err);
+    lok(n && te_eval(n) != 0);
+    lok(te_eval_interval(n, 0, 0, &lo, &hi) == 0);
+    lfequal(lo, -1);
+    lfequal(hi, 1);
+    te_free(n);
+
+    /* With two calls, batch rows take their draws a block at a time, so */
+    /* they differ from scalar rows, but use up the same draws. */
+    n = te_compile("floor(unif()*100) + 1000*floor(unif()*100)", lookup, 1, &err);
+    lok(n);
+    te_real rows[4], batch[4], again[4];
+    te_seed(1, 0);
+    for (i = 0; i < 4; ++i) rows[i] = te_eval(n);
+    te_seed(1, 0);
+    te_eval_batch(n, 0, 0, 4, batch);
+    te_seed(1, 0);
+    te_eval_batch(n, 0, 0, 4, again);
+    for (i = 0; i < 4; ++i) {
+        const te_real low = fmod(batch[i], 1000), high = floor(batch[i] / 1000);
+        lok(batch[i] == again[i]);
+        /* Row i's first call gets draw i, its second draw 4 + i. */
+        lok(low == fmod(rows[i / 2], 1000) || low == floor(rows[i / 2] / 1000));
+        lok(high == fmod(rows[2 + i / 2], 1000) || high == floor(rows[2 + i / 2] / 1000));
+    }
+    lok(batch[0] != rows[0]);
+    te_free(n);
+
+    n = te_compile("sum(i = 1 : 1000, (unif() - 0.5)^2) / 1000", lookup, 1, &err);
+    lok(n);
+    lok(fabs(te_eval(n) - 1.0 / 12) < 0.01);
+    te_free(n);
+
+    /* A row's draws in a loop don't depend on how long the other rows run. */
+    n = te_compile("sum(i = 1 : x, unif())", lookup, 1, &err);
+    lok(n);
+    te_real steps[2][3] = {{3, 1, 2}, {3, 5, 2}}, sums[2][3];
+    te_column columns[] = {{&x, 0}};
+    for (i = 0; i < 2; ++i) {
+        columns[0].data = steps[i];
+        te_seed(42, 0);
+        te_eval_batch(n, columns, 1, 3, sums[i]);
+    }
+    lok(sums[0][0] == sums[1][0]);
+    lok(sums[0][2] == sums[1][2]);
+    lok(sums[0][1] != sums[1][1]);
+    x = 3;
+    te_seed(42, 0);
+    lok(te_eval(n) == sums[0][0]);
+    te_free(n);
+}
+
+
+void test_batch() {
+    te_real x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+    const char *exprs[] = {
+        "x+y", "x-y", "x*y", "x/y", "-x", "x^2+y", "atan2(x,y)", "sqrt(abs(x))*2", "x, y", "5+5",
+    };
+
+    te_real xs[200], ys[200], out[200];
+    int i, j;
+    for (i = 0; i < 200; ++i) {
+        xs[i] = i * 0.37 - 20;
+        ys[i] = 3 - i * 0.11;
+    }
+
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+
+    for (j = 0; j < sizeof(exprs) / sizeof(const char *); ++j) {
+        int err;
+        te_expr *n = te_compile(exprs[j], lookup, 2, &err);
+        lok(n);
+
+        te_eval_batch(n, columns, 2, 200, out);
+        for (i = 0; i < 200; ++i) {
+            x = xs[i]; y = ys[i];
+            lfequal(out[i], te_eval(n));
+        }
+
+        /* Unbound variables keep their scalar value. */
+        y = 4;
+        te_eval_batch(n, columns, 1, 100, out);
+        for (i = 0; i < 100; ++i) {
+            x = xs[i];
+            lfequal(out[i], te_eval(n));
+        }
+
+        te_free(n);
+    }
+}
+
+
+void test_reduce() {
+    te_real x;
+    te_variable lookup[] = {{"x", &x}};
+
+    te_real xs[1000];
+    int i;
+    for (i = 0; i < 1000; ++i) xs[i] = i + 1;
+
+    te_column column = {&x, xs};
+
+    int err;
+    te_expr *n = te_compile("1/x", lookup, 1, &err);
+    lok(n);
+
+    te_reduction r;
+    te_reduce(n, &column, 1, 1000, TE_REDUCE_SUM | TE_REDUCE_MIN | TE_REDUCE_MAX | TE_REDUCE_MEAN | TE_REDUCE_COUNT, &r);
+
+    te_real sum = 0;
+    for (i = 0; i < 1000; ++i) sum += 1 / xs[i];
+    lfequal(r.sum, sum);
+    lfequal(r.min, 0.001);
+    lfequal(r.max, 1);
+    lfequal(r.mean, sum / 1000);
+    lequal(r.count, 1000);
+    te_free(n);
+
+    /* NaN rows are skipped. */
+    n = te_compile("sqrt(x-501)", lookup, 1, &err);
+    te_reduce(n, &column, 1, 1000, TE_REDUCE_COUNT | TE_REDUCE_MIN | TE_REDUCE_MEAN, &r);
+    lequal(r.count, 500);
+    lfequal(r.min, 0);
+    lok(r.mean == r.mean);
+    te_free(n);
+
+    /* Pairwise summation keeps the error small. */
+    n = te_compile("x*0+0.1", lookup, 1, &err);
+    te_reduce(n, &column, 1, 1000, TE_REDUCE_SUM, &r);
+    lok(fabs(r.sum - 100) < 1e-12);
+    te_free(n);
+
+    te_reduce(n = te_compile("x", lookup, 1, &err), &column, 1, 0, TE_REDUCE_MIN | TE_REDUCE_COUNT, &r);
+    lequal(r.count, 0);
+    lok(r.min != r.min);
+    te_free(n);
+}
+
+
+void test_logic() {
+    test_case cases[] = {
+        {"1 < 2", 1},
+        {"2 < 1", 0},
+        {"2 <= 2", 1},
+        {"3 > 2", 1},
+        {"2 >= 3", 0},
+        {"2 == 2", 1},
+        {"2 != 2", 0},
+        {"1 && 0", 0},
+        {"1 && 2", 1},
+        {"0 || 0", 0},
+        {"0 || 3", 1},
+        {"1+1 == 2", 1},
+        {"2*3 > 5", 1},
+        {"1 < 2 && 3 < 2", 0},
+        {"1 < 2 || 3 < 2", 1},
+        {"0 && 0 || 1", 1},
+        {"1 || 0 && 0", 1},
+        {"1 < 2 < 3", 1},
+        {"3 > 2 > 1", 0},
+        {"-1 < 0", 1},
+        {"(1 < 2) * 5", 5},
+        {"1, 2 == 2", 1},
+        {"pow(2, 1 < 2)", 2},
+        {"0/0 == 0/0", 0},
+        {"0/0 != 0/0", 1},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+        const te_real answer = cases[i].answer;
+
+        int err;
+        const te_real ev = te_interp(expr, &err);
+        lok(!err);
+        lfequal(ev, answer);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", expr, err);
+        }
+    }
+
+    test_case errors[] = {
+        {"1 = 2", 3},
+        {"1 & 2", 3},
+        {"1 | 2", 3},
+        {"1 <", 3},
+        {"1 < < 2", 5},
+    };
+
+    for (i = 0; i < sizeof(errors) / sizeof(test_case); ++i) {
+        int err;
+        const te_real r = te_interp(errors[i].expr, &err);
+        lequal(err, (int)errors[i].answer);
+        lok(r != r);
+    }
+}
+
+
+static int branch_calls;
+
+te_real branch(te_real a) {
+    ++branch_calls;
+    return a;
+}
+
+void test_ternary() {
+    test_case cases[] = {
+        {"1 ? 2 : 3", 2},
+        {"0 ? 2 : 3", 3},
+        {"1 ? 2 : 3 + 4", 2},
+        {"0 ? 2 : 3 + 4", 7},
+        {"0 || 1 ? 5 : 6", 5},
+        {"1 < 2 ? 5 : 6", 5},
+        {"0 ? 1 : 0 ? 2 : 3", 3},
+        {"1 ? 0 ? 7 : 8 : 9", 8},
+        {"(1 ? 2 : 3) * 4", 8},
+        {"pow(0 ? 1 : 2, 3)", 8},
+        {"1, 0 ? 1 : 2", 2},
+        {"-1 ? 2 : 3", 2},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+        const te_real answer = cases[i].answer;
+
+        int err;
+        const te_real ev = te_interp(expr, &err);
+        lok(!err);
+        lfequal(ev, answer);
+
+        if (err) {
+            printf("FAILED: %s (%d)\n", expr, err);
+        }
+    }
+
+    test_case errors[] = {
+        {"1 ? 2", 5},
+        {"1 ? 2 :", 7},
+        {"1 : 2", 3},
+        {"1 ? : 2", 5},
+        {"?", 1},
+    };
+
+    for (i = 0; i < sizeof(errors) / sizeof(test_case); ++i) {
+        int err;
+        const te_real r = te_interp(errors[i].expr, &err);
+        lequal(err, (int)errors[i].answer);
+        lok(r != r);
+    }
+
+    lok(te_interp("0/0 ? 1 : 2", 0) != te_interp("0/0 ? 1 : 2", 0));
+
+    /* Only the branch taken is evaluated. */
+    te_real x;
+    te_variable lookup[] = {{"x", &x}, {"f", branch, TE_FUNCTION1}};
+    int err;
+    te_expr *n = te_compile("x > 0 ? f(x) : f(-x) * 2", lookup, 2, &err);
+    lok(n);
+
+    branch_calls = 0;
+    x = 3;
+    lfequal(te_eval(n), 3);
+    x = -3;
+    lfequal(te_eval(n), 6);
+    lequal(branch_calls, 2);
+
+    te_free(n);
+    n = te_compile("x > 1 && f(x) > 0 || f(x)", lookup, 2, &err);
+    lok(n);
+    branch_calls = 0;
+    x = 3;
+    lfequal(te_eval(n), 1);
+    lequal(branch_calls, 1);
+    x = 0;
+    lfequal(te_eval(n), 0);
+    lequal(branch_calls, 2);
+    te_free(n);
+
+    /* Batches blend both branches only where the condition varies. */
+    n = te_compile("x > 0 ? f(x) : f(-x) * 2", lookup, 2, &err);
+    te_real xs[128], out[128];
+    for (i = 0; i < 128; ++i) xs[i] = i < 64 ? i + 1 : (i % 2 ? i : -i);
+    te_column columns[] = {{&x, xs}};
+    branch_calls = 0;
+    te_eval_batch(n, columns, 1, 128, out);
+    lequal(branch_calls, 64 + 128);
+    for (i = 0; i < 128; ++i) {
+        lfequal(out[i], xs[i] > 0 ? xs[i] : -xs[i] * 2);
+    }
+
+    /* A condition known from the ranges leaves one branch. */
+    te_range range = {&x, 1, 5};
+    n = te_optimize(n, &range, 1);
+    lequal(n->type, TE_FUNCTION1);
+    te_free(n);
+
+    /* Otherwise the bounds cover both branches. */
+    te_real lo, hi;
+    range.lo = -2;
+    n = te_compile("x > 0 ? x : -2*x", lookup, 2, &err);
+    lok(!te_eval_interval(n, &range, 1, &lo, &hi));
+    lfequal(lo, -10);
+    lfequal(hi, 5);
+    te_free(n);
+}
+
+
+void test_filter() {
+    te_real x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+    te_real xs[300], ys[300];
+    int i;
+    for (i = 0; i < 300; ++i) {
+        xs[i] = i;
+        ys[i] = i % 7;
+    }
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+
+    int err;
+    te_expr *n = te_compile("x >= 10 && x < 250 && y != 3", lookup, 2, &err);
+    lok(n);
+
+    unsigned char bitmap[(300 + 7) / 8];
+    int selection[300];
+    const int count = te_filter(n, columns, 2, 300, bitmap);
+    lequal(te_select(n, columns, 2, 300, selection), count);
+
+    int expected = 0;
+    for (i = 0; i < 300; ++i) {
+        const int keep = xs[i] >= 10 && xs[i] < 250 && ys[i] != 3;
+        lequal((bitmap[i / 8] >> (i % 8)) & 1, keep);
+        if (keep) lequal(selection[expected++], i);
+    }
+    lequal(count, expected);
+    te_free(n);
+
+    /* NaN is never selected. */
+    n = te_compile("sqrt(x-100)", lookup, 1, &err);
+    lequal(te_filter(n, columns, 1, 300, bitmap), 199);
+    lequal(bitmap[0], 0);
+    te_free(n);
+}
+
+
+void test_interval() {
+    te_real x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+    const char *exprs[] = {
+        "abs x", "acos x", "asin x", "atan x", "ceil x", "cos x", "cosh x", "exp x",
+        "fac x", "floor x", "ln x", "log x", "log10 x", "sin x", "sinh x", "sqrt x",
+        "tan x", "tanh x", "-x", "atan2(x,y)", "atan2(y,x)", "pow(x,y)", "x^2", "x^3",
+        "x^-1", "x^-2", "ncr(x,y)", "npr(x,y)", "x+y", "x-y", "x*y", "x/y", "x%y",
+        "x<y", "x<=y", "x>y", "x>=y", "x==y", "x!=y", "x&&y", "x||y", "x,y",
+        "sin(x)*cos(y)+sqrt(abs(x*y))", "x > 1 && y < 2",
+    };
+
+    const te_range boxes[][2] = {
+        {{&x, -3, 4}, {&y, -2, 3}},
+        {{&x, 0.5, 2}, {&y, 1, 5}},
+        {{&x, -5, -1}, {&y, -0.5, -0.25}},
+        {{&x, 2, 2}, {&y, -1, 1}},
+        {{&x, 0, 7}, {&y, 0, 3}},
+    };
+
+    int i, j, k, l;
+    for (i = 0; i < sizeof(exprs) / sizeof(const char *); ++i) {
+        int err;
+        te_expr *n = te_compile(exprs[i], lookup, 2, &err);
+        lok(n);
+
+        for (j = 0; j < sizeof(boxes) / sizeof(boxes[0]); ++j) {
+            te_real lo, hi;
+            const int nan = te_eval_interval(n, boxes[j], 2, &lo, &hi);
+
+            int fails = 0;
+            for (k = 0; k <= 20; ++k) {
+                for (l = 0; l <= 20; ++l) {
+                    x = boxes[j][0].lo + (boxes[j][0].hi - boxes[j][0].lo) * k / 20;
+                    y = boxes[j][1].lo + (boxes[j][1].hi - boxes[j][1].lo) * l / 20;
+                    const te_real v = te_eval(n);
+                    if (v != v ? !nan : !(v >= lo && v <= hi)) ++fails;
+                }
+            }
+            lequal(fails, 0);
+            if (fails) printf("FAILED: %s in box %d\n", exprs[i], j);
+        }
+        te_free(n);
+    }
+
+    te_real lo, hi;
+    te_range r[] = {{&x, 0, 5}, {&y, -1, 1}};
+    te_expr *n;
+    int err;
+
+    n = te_compile("x > 10", lookup, 2, &err);
+    lequal(te_eval_interval(n, r, 2, &lo, &hi), 0);
+    lfequal(lo, 0); lfequal(hi, 0);
+    te_free(n);
+
+    n = te_compile("x >= 0 && y <= 1", lookup, 2, &err);
+    lequal(te_eval_interval(n, r, 2, &lo, &hi), 0);
+    lfequal(lo, 1); lfequal(hi, 1);
+    te_free(n);
+
+    n = te_compile("sqrt(y)", lookup, 2, &err);
+    lequal(te_eval_interval(n, r, 2, &lo, &hi), 1);
+    lfequal(lo, 0); lfequal(hi, 1);
+    te_free(n);
+
+    n = te_compile("sin(x) + 2*y", lookup, 2, &err);
+    te_eval_interval(n, r, 2, &lo, &hi);
+    lfequal(lo, -3); lfequal(hi, 3);
+    te_free(n);
+
+    /* Unranged variables use their current value. */
+    y = 3;
+    n = te_compile("x*y", lookup, 2, &err);
+    te_eval_interval(n, r, 1, &lo, &hi);
+    lfequal(lo, 0); lfequal(hi, 15);
+    te_free(n);
+}
+
+
+void test_ranges() {
+    te_real x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+    te_range ranges[] = {{&x, 0, 5}, {&y, -3, -1}};
+
+    const char *exprs[] = {
+        "abs(x) + abs(y)", "floor(x/10) + ceil(y/4)", "pow(x, 0.5) + pow(y, 2) + pow(x+y, 1)",
+        "floor(floor(x) + 1)", "(x == x) + (y != y)", "sin(x) * (y < 0)", "abs(x*y) + x^2",
+    };
+
+    int i, j;
+    for (i = 0; i < sizeof(exprs) / sizeof(const char *); ++i) {
+        int err;
+        te_expr *a = te_compile(exprs[i], lookup, 2, &err);
+        te_expr *b = te_compile(exprs[i], lookup, 2, &err);
+        lok(a);
+        b = te_optimize(b, ranges, 2);
+        lok(b);
+
+        for (j = 0; j <= 10; ++j) {
+            x = j * 0.5;
+            y = -3 + j * 0.2;
+            lfequal(te_eval(a), te_eval(b));
+        }
+
+        te_free(a);
+        te_free(b);
+    }
+
+    int err;
+    te_expr *n;
+
+    /* Folded to a constant. */
+    n = te_optimize(te_compile("floor(x/10) + (y < 0)", lookup, 2, &err), ranges, 2);
+    lfequal(n->value, 1);
+    x = 1; y = -2;
+    lfequal(te_eval(n), 1);
+    te_free(n);
+
+    /* The abs is dropped, so values outside the declared range show it. */
+    n = te_optimize(te_compile("abs(x)", lookup, 2, &err), ranges, 2);
+    x = -2;
+    lfequal(te_eval(n), -2);
+    te_free(n);
+
+    /* The NaN guard is dropped. */
+    n = te_optimize(te_compile("(x == x) * 5", lookup, 2, &err), ranges, 2);
+    lfequal(n->value, 5);
+    te_free(n);
+
+    /* Unranged variables are left alone. */
+    n = te_optimize(te_compile("abs(x) + floor(y/10)", lookup, 2, &err), ranges, 1);
+    x = 2; y = -20;
+    lfequal(te_eval(n), 0);
+    te_free(n);
+}
+
+
+static int curve_calls;
+
+void curve(const te_real **args, te_real *out, int count) {
+    int i;
+    ++curve_calls;
+    for (i = 0; i < count; ++i) out[i] = args[0][i] * args[0][i] + args[1][i];
+}
+
+void scaled(void *context, const te_real **args, te_real *out, int count) {
+    const te_real scale = *(te_real*)context;
+    int i;
+    ++curve_calls;
+    for (i = 0; i < count; ++i) out[i] = args[0][i] * scale;
+}
+
+void test_batch_functions() {
+    te_real x, y, scale = 3;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"curve", curve, TE_FUNCTION2 | TE_FLAG_PURE | TE_FLAG_BATCH},
+        {"scaled", scaled, TE_CLOSURE1 | TE_FLAG_BATCH, &scale},
+    };
+
+    int err;
+    te_expr *n = te_compile("curve(x, y) + scaled(x)", lookup, 4, &err);
+    lok(n);
+
+    x = 2; y = 5;
+    lfequal(te_eval(n), 4 + 5 + 6);
+
+    te_real xs[150], ys[150], out[150];
+    int i;
+    for (i = 0; i < 150; ++i) {
+        xs[i] = i * 0.1;
+        ys[i] = 150 - i;
+    }
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+
+    curve_calls = 0;
+    te_eval_batch(n, columns, 2, 150, out);
+    lequal(curve_calls, 6);
+    for (i = 0; i < 150; ++i) {
+        lfequal(out[i], xs[i] * xs[i] + ys[i] + xs[i] * 3);
+    }
+    te_free(n);
+
+    /* Pure batch functions of constants are folded. */
+    n = te_compile("curve(3, 1)", lookup, 4, &err);
+    lok(n);
+    curve_calls = 0;
+    lfequal(te_eval(n), 10);
+    lequal(curve_calls, 0);
+    te_free(n);
+
+    /* Impure ones are called for every row. */
+    n = te_compile("scaled(2)", lookup, 4, &err);
+    lok(n);
+    curve_calls = 0;
+    te_eval_batch(n, columns, 2, 150, out);
+    lequal(curve_calls, 3);
+    lfequal(out[149], 6);
+    te_free(n);
+}
+
+
+static int slow_calls;
+
+te_real slow(void *context, te_real a, te_real b) {
+    ++slow_calls;
+    return a * *(te_real*)context + b;
+}
+
+void test_memo() {
+    te_real x, y, ten = 10, hundred = 100;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y},
+        {"slow", slow, TE_CLOSURE2 | TE_FLAG_PURE | TE_FLAG_MEMO, &ten},
+        {"slow2", slow, TE_CLOSURE2 | TE_FLAG_PURE | TE_FLAG_MEMO, &hundred},
+    };
+
+    int err;
+    te_expr *n = te_compile("slow(x, y) + slow(y, x)", lookup, 4, &err);
+    lok(n);
+
+    te_memo_clear();
+    slow_calls = 0;
+    x = 1; y = 2;
+    lfequal(te_eval(n), 12 + 21);
+    lfequal(te_eval(n), 12 + 21);
+    lequal(slow_calls, 2);
+
+    long hits, misses;
+    te_memo_stats(&hits, &misses);
+    lequal((int)hits, 2);
+    lequal((int)misses, 2);
+
+    /* The context is part of the key. */
+    te_expr *m = te_compile("slow2(x, y)", lookup, 4, &err);
+    lok(m);
+    lfequal(te_eval(m), 102);
+    lequal(slow_calls, 3);
+    te_free(m);
+
+    /* Repeated rows are served from the cache. */
+    te_real xs[200], ys[200], out[200];
+    int i;
+    for (i = 0; i < 200; ++i) {
+        xs[i] = i % 5;
+        ys[i] = i % 2;
+    }
+    te_column columns[] = {{&x, xs}, {&y, ys}};
+    te_memo_clear();
+    slow_calls = 0;
+    te_eval_batch(n, columns, 2, 200, out);
+    lequal(slow_calls, 16); /* Distinct argument pairs across both calls. */
+    for (i = 0; i < 200; ++i) {
+        lfequal(out[i], xs[i] * 10 + ys[i] + ys[i] * 10 + xs[i]);
+    }
+
+    te_memo_stats(&hits, &misses);
+    lequal((int)(hits + misses), 400);
+    lequal((int)misses, 16);
+
+    te_free(n);
+}
+
+
+static int ticks;
+te_real tick(void) {
+    return ++ticks;
+}
+
+
+void test_rle() {
+    te_real x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"tick", tick, TE_FUNCTION0}};
+
+    const te_real xv[] = {1, 2, 3, 4};
+    const int xl[] = {100, 50, 0, 150};
+    const te_real yv[] = {10, 20, 20, 30, 40};
+    const int yl[] = {30, 70, 60, 40, 100};
+    te_rle_column rle[] = {{&x, xv, xl, 4}, {&y, yv, yl, 5}};
+
+    te_real xs[300], ys[300];
+    int i, j, row = 0;
+    for (i = 0; i < 4; ++i) for (j = 0; j < xl[i]; ++j) xs[row++] = xv[i];
+    row = 0;
+    for (i = 0; i < 5; ++i) for (j = 0; j < yl[i]; ++j) ys[row++] = yv[i];
+    te_column dense[] = {{&x, xs}, {&y, ys}};
+
+    int err;
+    te_expr *n = te_compile("x*y + sqrt(y)", lookup, 2, &err);
+    lok(n);
+
+    te_real expected[300], out[300];
+    te_eval_batch(n, dense, 2, 300, expected);
+    te_eval_rle(n, rle, 2, 300, out);
+    for (i = 0; i < 300; ++i) lfequal(out[i], expected[i]);
+
+    te_real values[9];
+    int lengths[9];
+    const int runs = te_eval_rle_runs(n, rle, 2, 300, values, lengths, 9);
+    lequal(runs, 6);
+    row = 0;
+    for (i = 0; i < runs; ++i) {
+        for (j = 0; j < lengths[i]; ++j) lfequal(values[i], expected[row++]);
+    }
+    lequal(row, 300);
+    te_free(n);
+
+    /* Equal neighbouring results are merged. */
+    n = te_compile("y > 15", lookup, 2, &err);
+    lequal(te_eval_rle_runs(n, rle, 2, 300, values, lengths, 9), 2);
+    lequal(lengths[0], 30);
+    lequal(lengths[1], 270);
+    te_free(n);
+
+    /* Impure expressions are evaluated for every row of a run. */
+    const te_real fives[] = {5};
+    const int four[] = {4};
+    te_rle_column run[] = {{&x, fives, four, 1}};
+    n = te_compile("x + tick()", lookup, 3, &err);
+    lok(n);
+    ticks = 0;
+    te_eval_rle(n, run, 1, 4, out);
+    for (i = 0; i < 4; ++i) lfequal(out[i], 6 + i);
+    lequal(te_eval_rle_runs(n, run, 1, 4, values, lengths, 4), 4);
+    lfequal(values[3], 13);
+    te_free(n);
+
+    n = te_compile("x + unif()", lookup, 3, &err);
+    lok(n);
+    te_eval_rle(n, run, 1, 4, out);
+    for (i = 1; i < 4; ++i) lok(out[i] != out[0]);
+
+    /* Impure runs need one entry per row, and fewer is an error rather than */
+    /* an overflow. */
+    te_real one, each[100];
+    int one_length, each_length[100];
+    const int hundred[] = {100};
+    te_rle_column long_run[] = {{&x, fives, hundred, 1}};
+    lequal(te_eval_rle_runs(n, long_run, 1, 100, &one, &one_length, 1), -1);
+    lequal(te_eval_rle_runs(n, long_run, 1, 100, each, each_length, 100), 100);
+    for (i = 0; i < 100; ++i) lok(each_length[i] == 1 && each[i] >= 5 && each[i] < 6);
+    te_free(n);
+}
+
+
+static int counter_calls = 0;
+te_real counter(te_real a) {
+    ++counter_calls;
+    return a;
+}
+
+
+void test_dict() {
+    te_real x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"counter", counter, TE_FUNCTION1 | TE_FLAG_PURE}};
+
+    const te_real xd[] = {1.5, -2, 7};
+    const te_real yd[] = {10, 20};
+    int xc[500], yc[500];
+    te_real xs[500], ys[500];
+    int i;
+    for (i = 0; i < 500; ++i) {
+        xc[i] = (i * 7) % 3;
+        yc[i] = (i / 5) % 2;
+        xs[i] = xd[xc[i]];
+        ys[i] = yd[yc[i]];
+    }
+
+    te_dict_column dict[] = {{&x, xd, 3, xc}, {&y, yd, 2, yc}};
+    te_column dense[] = {{&x, xs}, {&y, ys}};
+
+    int err;
+    te_expr *n = te_compile("counter(x) * y - x^2", lookup, 3, &err);
+    lok(n);
+
+    te_real expected[500], out[500];
+    te_eval_batch(n, dense, 2, 500, expected);
+
+    /* Only the six combinations are evaluated. */
+    counter_calls = 0;
+    te_eval_dict(n, dict, 2, 500, out);
+    lequal(counter_calls, 6);
+    for (i = 0; i < 500; ++i) lfequal(out[i], expected[i]);
+
+    /* With more combinations than rows every row is evaluated. */
+    counter_calls = 0;
+    te_eval_dict(n, dict, 2, 4, out);
+    lequal(counter_calls, 4);
+    for (i = 0; i < 4; ++i) lfequal(out[i], expected[i]);
+
+    te_free(n);
+}
+
+
+typedef struct {
+    int id;
+    te_real x;
+    float pad;
+    te_real y;
+    te_real result;
+} record;
+
+void test_strided() {
+    te_real x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+    record records[150];
+    int i;
+    for (i = 0; i < 150; ++i) {
+        records[i].x = i * 0.5;
+        records[i].y = 100 - i;
+        records[i].result = 0;
+    }
+
+    te_column columns[] = {
+        {&x, records, sizeof(record), offsetof(record, x)},
+        {&y, &records[0].y, sizeof(record)},
+    };
+
+    int err;
+    te_expr *n = te_compile("x*y + 1", lookup, 2, &err);
+    lok(n);
+
+    te_real out[150];
+    te_eval_batch(n, columns, 2, 150, out);
+    te_eval_strided(n, columns, 2, 150, &records[0].result, sizeof(record));
+    for (i = 0; i < 150; ++i) {
+        lfequal(out[i], records[i].x * records[i].y + 1);
+        lfequal(records[i].result, out[i]);
+    }
+
+    te_free(n);
+}
+
+
+void test_typed() {
+    te_real a, b, c, d;
+    te_variable lookup[] = {{"a", &a}, {"b", &b}, {"c", &c}, {"d", &d}};
+
+    float fs[100];
+    int32_t is[100];
+    int64_t ls[100];
+    uint8_t flags[100];
+    int i;
+    for (i = 0; i < 100; ++i) {
+        fs[i] = i * 0.25f;
+        is[i] = i - 50;
+        ls[i] = (int64_t)i * 1000000000;
+        flags[i] = (uint8_t)(i % 3 == 0);
+    }
+
+    te_column columns[] = {
+        {&a, fs, 0, 0, TE_COLUMN_FLOAT},
+        {&b, is, 0, 0, TE_COLUMN_INT32},
+        {&c, ls, 0, 0, TE_COLUMN_INT64},
+        {&d, flags, 0, 0, TE_COLUMN_UINT8},
+    };
+
+    int err;
+    te_expr *n = te_compile("(a + b + c/1e9) * d", lookup, 4, &err);
+    lok(n);
+
+    te_real out[100];
+    te_eval_batch(n, columns, 4, 100, out);
+    for (i = 0; i < 100; ++i) {
+        lfequal(out[i], (i * 0.25 + (i - 50) + i) * (i % 3 == 0));
+    }
+
+    /* Doubles are converted when te_real is float. */
+    double ds[100];
+    for (i = 0; i < 100; ++i) ds[i] = i / 8.0;
+    te_column wide[] = {{&a, ds, 0, 0, TE_COLUMN_DOUBLE}, {&d, flags, 0, 0, TE_COLUMN_UINT8}};
+    te_free(n);
+    n = te_compile("a * d", lookup, 4, &err);
+    lok(n);
+    te_eval_batch(n, wide, 2, 100, out);
+    for (i = 0; i < 100; ++i) {
+        lfequal(out[i], i / 8.0 * (i % 3 == 0));
+    }
+
+    /* Strided integer fields. */
+    struct {int32_t id; uint8_t flag;} rows[20];
+    for (i = 0; i < 20; ++i) {
+        rows[i].id = i * 7;
+        rows[i].flag = (uint8_t)(i & 1);
+    }
+    te_column fields[] = {
+        {&a, rows, sizeof(rows[0]), 0, TE_COLUMN_INT32},
+        {&b, &rows[0].flag, sizeof(rows[0]), 0, TE_COLUMN_UINT8},
+    };
+
+    te_free(n);
+    n = te_compile("a + b", lookup, 4, &err);
+    lok(n);
+    te_eval_batch(n, fields, 2, 20, out);
+    for (i = 0; i < 20; ++i) {
+        lfequal(out[i], i * 7 + (i & 1));
+    }
+
+    te_free(n);
+}
+
+
 int main(int argc, char *argv[])
 {
     lrun("Results", test_results);
@@ -703,6 +2801,32 @@ int main(int argc, char *argv[])
     lrun("Optimize", test_optimize);
     lrun("Pow", test_pow);
     lrun("Combinatorics", test_combinatorics);
+    lrun("Integer", test_integer);
+    lrun("Variadic", test_variadic);
+    lrun("Loops", test_loops);
+    lrun("Arrays", test_arrays);
+    lrun("Vectors", test_vectors);
+    lrun("Sets", test_sets);
+    lrun("Sparse sets", test_sparse_sets);
+    lrun("Dual", test_dual);
+    lrun("Gradient", test_gradient);
+    lrun("Derive", test_derive);
+    lrun("Solve", test_solve);
+    lrun("Integrate", test_integrate);
+    lrun("Random", test_random);
+    lrun("Batch", test_batch);
+    lrun("Reduce", test_reduce);
+    lrun("Logic", test_logic);
+    lrun("Ternary", test_ternary);
+    lrun("Filter", test_filter);
+    lrun("Interval", test_interval);
+    lrun("Ranges", test_ranges);
+    lrun("RLE", test_rle);
+    lrun("Dictionary", test_dict);
+    lrun("Strided", test_strided);
+    lrun("Typed", test_typed);
+    lrun("Batch funcs", test_batch_functions);
+    lrun("Memo", test_memo);
     lresults();
 
     return lfails != 0;
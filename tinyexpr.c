@@ -35,6 +35,30 @@ For log = base 10 log do nothing
 For log = natural log uncomment the next line. */
 /* #define TE_NAT_LOG */
 
+/* Loops
+Most iterations a sum or prod loop may run; more give NaN. */
+#ifndef TE_LOOP_MAX
+#define TE_LOOP_MAX 100000000
+#endif
+
+/* Root finding
+Most iterations te_solve_batch() runs for a row before giving up. */
+#ifndef TE_SOLVE_MAX
+#define TE_SOLVE_MAX 100
+#endif
+
+/* Integration
+Most panels te_integrate() splits a range into before giving up. */
+#ifndef TE_INTEGRATE_MAX
+#define TE_INTEGRATE_MAX 200
+#endif
+
+/* Memoization
+Number of results cached for functions flagged with TE_FLAG_MEMO. */
+#ifndef TE_MEMO_SIZE
+#define TE_MEMO_SIZE 4096
+#endif
+
 #include "tinyexpr.h"
 #include <stdlib.h>
 #include <math.h>
@@ -42,6 +66,45 @@ For log = natural log uncomment the next line. */
 #include <stdio.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdint.h>
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define TE_MEMO_ATOMIC
+#endif
+
+/* Random draws are counted per thread where the compiler allows. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define TE_THREAD_LOCAL _Thread_local
+#else
+#define TE_THREAD_LOCAL
+#endif
+
+#ifdef TE_FLOAT
+/* Use the single precision versions of the math library throughout. */
+#define fabs fabsf
+#define acos acosf
+#define asin asinf
+#define atan atanf
+#define atan2 atan2f
+#define ceil ceilf
+#define cos cosf
+#define cosh coshf
+#define exp expf
+#define floor floorf
+#define fmod fmodf
+#define hypot hypotf
+#define log logf
+#define log10 log10f
+#define pow powf
+#define sin sinf
+#define sinh sinhf
+#define sqrt sqrtf
+#define tan tanf
+#define tanh tanhf
+#define trunc truncf
+#define strtod strtof
+#endif
 
 #ifndef NAN
 #define NAN (0.0/0.0)
@@ -52,26 +115,64 @@ For log = natural log uncomment the next line. */
 #endif
 
 
-typedef double (*te_fun2)(double, double);
+typedef te_real (*te_fun2)(te_real, te_real);
 
+/* Token kinds lie above every node type and flag, so they never equal */
+/* the type of a function token. */
 enum {
-    TOK_NULL = TE_CLOSURE7+1, TOK_ERROR, TOK_END, TOK_SEP,
-    TOK_OPEN, TOK_CLOSE, TOK_NUMBER, TOK_VARIABLE, TOK_INFIX
+    TOK_NULL = 1 << 10, TOK_ERROR, TOK_END, TOK_SEP,
+    TOK_OPEN, TOK_CLOSE, TOK_NUMBER, TOK_VARIABLE, TOK_INFIX, TOK_QUESTION, TOK_COLON,
+    TOK_OPEN_BRACKET, TOK_CLOSE_BRACKET
 };
 
 
 enum {TE_CONSTANT = 1};
 
+/* Builtins taking any number of arguments. Nodes keep the count in the */
+/* bits above TE_VARIADIC_SHIFT and reduce their arguments with function. */
+enum {TE_VARIADIC = 2, TE_VARIADIC_SHIFT = 16, TE_VARIADIC_MAX = 32767};
+
+/* sum(i = from : to, body) and prod(...) loops, counted like TE_VARIADIC. */
+/* The parameters are the index, from, to and body, followed by a holder */
+/* and expression for every loop invariant hoisted out of the body. */
+/* Index and holders are constant nodes whose value the body's variables */
+/* are bound to. function is add or mul. */
+enum {TE_LOOP = 3};
+
+/* vec, dot, cross and length, counted like TE_VARIADIC. Vector variables */
+/* are TE_CLOSURE0 nodes calling vector_ref() on their te_array, and other */
+/* nodes apply componentwise, see eval_block_vector(). */
+enum {TE_VECTOR_OP = 6};
+
+/* Marks the root of an integer-valued subtree, see eval_integer(). */
+enum {TE_FLAG_INTEGER = 256};
+
+/* User functions with a derivative keep it after their context, see PARTIALS. */
+enum {TE_FLAG_PARTIALS = 512};
+
+
+typedef struct local {
+    const char *name;
+    int len;
+    const te_real *address;
+    const struct local *next;
+} local;
+
 
 typedef struct state {
     const char *start;
     const char *next;
     int type;
-    union {double value; const double *bound; const void *function;};
+    union {te_real value; const te_real *bound; const void *function;};
     void *context;
 
     const te_variable *lookup;
     int lookup_len;
+
+    /* Loop indices in scope, innermost first. */
+    const struct local *locals;
+
+    const void *derivative;
 } state;
 
 
@@ -80,14 +181,16 @@ typedef struct state {
 #define IS_PURE(TYPE) (((TYPE) & TE_FLAG_PURE) != 0)
 #define IS_FUNCTION(TYPE) (((TYPE) & TE_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TE_CLOSURE0) != 0)
-#define ARITY(TYPE) ( ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
+#define ARITY(TYPE) ( TYPE_MASK(TYPE) == TE_VARIADIC || TYPE_MASK(TYPE) == TE_LOOP || TYPE_MASK(TYPE) == TE_VECTOR_OP ? ((TYPE) >> TE_VARIADIC_SHIFT) : \
+        ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
+#define PARTIALS(n) ((n)->parameters[ARITY((n)->type) + (IS_CLOSURE((n)->type) ? 1 : 0)])
 #define NEW_EXPR(type, ...) new_expr((type), (const te_expr*[]){__VA_ARGS__})
 #define CHECK_NULL(ptr, ...) if ((ptr) == NULL) { __VA_ARGS__; return NULL; }
 
 static te_expr *new_expr(const int type, const te_expr *parameters[]) {
     const int arity = ARITY(type);
     const int psize = sizeof(void*) * arity;
-    const int size = (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
+    const int size = (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0) + (type & TE_FLAG_PARTIALS ? sizeof(void*) : 0);
     te_expr *ret = malloc(size);
     CHECK_NULL(ret);
 
@@ -103,6 +206,11 @@ static te_expr *new_expr(const int type, const te_expr *parameters[]) {
 
 void te_free_parameters(te_expr *n) {
     if (!n) return;
+    if (TYPE_MASK(n->type) == TE_VARIADIC || TYPE_MASK(n->type) == TE_LOOP || TYPE_MASK(n->type) == TE_VECTOR_OP) {
+        int i;
+        for (i = 0; i < ARITY(n->type); ++i) te_free(n->parameters[i]);
+        return;
+    }
     switch (TYPE_MASK(n->type)) {
         case TE_FUNCTION7: case TE_CLOSURE7: te_free(n->parameters[6]);     /* Falls through. */
         case TE_FUNCTION6: case TE_CLOSURE6: te_free(n->parameters[5]);     /* Falls through. */
@@ -122,37 +230,104 @@ void te_free(te_expr *n) {
 }
 
 
-static double pi(void) {return 3.14159265358979323846;}
-static double e(void) {return 2.71828182845904523536;}
-static double fac(double a) {/* simplest version of fac */
+static te_real pi(void) {return 3.14159265358979323846;}
+static te_real e(void) {return 2.71828182845904523536;}
+/* Every factorial that fits in 64 bits. */
+static const uint64_t factorials[21] = {
+    1, 1, 2, 6, 24, 120, 720, 5040, 40320, 362880, 3628800, 39916800, 479001600,
+    6227020800ULL, 87178291200ULL, 1307674368000ULL, 20922789888000ULL, 355687428096000ULL,
+    6402373705728000ULL, 121645100408832000ULL, 2432902008176640000ULL
+};
+
+static te_real fac(te_real a) {
     if (a < 0.0)
         return NAN;
     if (a > UINT_MAX)
         return INFINITY;
     unsigned int ua = (unsigned int)(a);
-    unsigned long int result = 1, i;
-    for (i = 1; i <= ua; i++) {
-        if (i > ULONG_MAX / result)
-            return INFINITY;
-        result *= i;
+    return ua < 21 ? (te_real)factorials[ua] : INFINITY;
+}
+static int ncr_integer(uint64_t n, uint64_t r, uint64_t *result) {
+    /* Multiplicative formula; returns 0 on overflow. */
+    uint64_t i;
+    *result = 1;
+    if (r > n / 2) r = n - r;
+    for (i = 1; i <= r; i++) {
+        if (*result > UINT64_MAX / (n - r + i))
+            return 0;
+        *result *= n - r + i;
+        *result /= i;
     }
-    return (double)result;
+    return 1;
 }
-static double ncr(double n, double r) {
+static te_real ncr(te_real n, te_real r) {
     if (n < 0.0 || r < 0.0 || n < r) return NAN;
     if (n > UINT_MAX || r > UINT_MAX) return INFINITY;
-    unsigned long int un = (unsigned int)(n), ur = (unsigned int)(r), i;
-    unsigned long int result = 1;
-    if (ur > un / 2) ur = un - ur;
-    for (i = 1; i <= ur; i++) {
-        if (result > ULONG_MAX / (un - ur + i))
-            return INFINITY;
-        result *= un - ur + i;
-        result /= i;
-    }
-    return result;
+    uint64_t result;
+    if (!ncr_integer((unsigned int)(n), (unsigned int)(r), &result)) return INFINITY;
+    return (te_real)result;
+}
+static te_real npr(te_real n, te_real r) {return ncr(n, r) * fac(r);}
+
+/* Reductions for the variadic builtins. NaN arguments propagate. */
+static te_real minimum(te_real a, te_real b) {return b < a || b != b ? b : a;}
+static te_real maximum(te_real a, te_real b) {return b > a || b != b ? b : a;}
+static te_real mean(te_real a, te_real b) {return (a + b) / 2;}
+static te_real total(te_real a, te_real b) {return a + b;}
+static te_real product(te_real a, te_real b) {return a * b;}
+
+/* Vector builtins, see eval_block_vector(). As scalars they are NaN. */
+static te_real vector_ref(void *array) {(void)array; return NAN;}
+static te_real vec(void) {return NAN;}
+static te_real dot(void) {return NAN;}
+static te_real cross(void) {return NAN;}
+static te_real length(void) {return NAN;}
+
+/* Random builtins. Draw k of a stream is a SplitMix64 hash of k offset by */
+/* a key made from the seed and stream, so draws need no state but a */
+/* counter, and a block of them can be made at once, see draw_block(). */
+#ifdef TE_FLOAT
+#define TE_RANDOM_BITS 24
+#else
+#define TE_RANDOM_BITS 53
+#endif
+
+typedef struct random_stream {
+    uint64_t key, counter;
+} random_stream;
+
+static TE_THREAD_LOCAL random_stream rng;
+
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+    return x ^ (x >> 31);
+}
+
+static uint64_t draw(uint64_t key, uint64_t k) {return mix(key + (k + 1) * 0x9e3779b97f4a7c15u);}
+
+/* Uniform in [0, 1), with as many bits as te_real holds exactly. */
+static te_real uniform(uint64_t bits) {return (te_real)(bits >> (64 - TE_RANDOM_BITS)) / ((uint64_t)1 << TE_RANDOM_BITS);}
+
+/* Box-Muller, taking the second uniform from a rehash. */
+static te_real gaussian(uint64_t bits) {return sqrt(-2 * log(1 - uniform(bits))) * cos(2 * pi() * uniform(mix(bits)));}
+
+static te_real unif(void) {return uniform(draw(rng.key, rng.counter++));}
+static te_real normal(void) {return gaussian(draw(rng.key, rng.counter++));}
+
+void te_seed(unsigned long long seed, unsigned long long stream) {
+    rng.key = mix(seed + mix(stream));
+    rng.counter = 0;
+}
+
+static random_stream row_stream(random_stream outer, int row) {
+    /* A stream of a block row's own, keyed by the draw the row would make */
+    /* from outer, so its numbering doesn't depend on the other rows. */
+    random_stream s;
+    s.key = draw(outer.key, outer.counter + row);
+    s.counter = 0;
+    return s;
 }
-static double npr(double n, double r) {return ncr(n, r) * fac(r);}
 
 #ifdef _MSC_VER
 #pragma function (ceil)
@@ -169,10 +344,14 @@ static const te_variable functions[] = {
     {"ceil", ceil,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"cos", cos,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"cosh", cosh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"cross", cross,  TE_VECTOR_OP, 0},
+    {"dot", dot,      TE_VECTOR_OP, 0},
     {"e", e,          TE_FUNCTION0 | TE_FLAG_PURE, 0},
     {"exp", exp,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"fac", fac,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"floor", floor,  TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"hypot", hypot,  TE_VARIADIC | TE_FLAG_PURE, 0},
+    {"length", length, TE_VECTOR_OP, 0},
     {"ln", log,       TE_FUNCTION1 | TE_FLAG_PURE, 0},
 #ifdef TE_NAT_LOG
     {"log", log,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
@@ -180,15 +359,23 @@ static const te_variable functions[] = {
     {"log", log10,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
 #endif
     {"log10", log10,  TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"max", maximum,  TE_VARIADIC | TE_FLAG_PURE, 0},
+    {"mean", mean,    TE_VARIADIC | TE_FLAG_PURE, 0},
+    {"min", minimum,  TE_VARIADIC | TE_FLAG_PURE, 0},
     {"ncr", ncr,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
+    {"normal", normal, TE_FUNCTION0, 0},
     {"npr", npr,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
     {"pi", pi,        TE_FUNCTION0 | TE_FLAG_PURE, 0},
     {"pow", pow,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
+    {"prod", product, TE_VARIADIC | TE_FLAG_PURE, 0},
     {"sin", sin,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"sinh", sinh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"sqrt", sqrt,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"sum", total,    TE_VARIADIC | TE_FLAG_PURE, 0},
     {"tan", tan,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"tanh", tanh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"unif", unif,    TE_FUNCTION0, 0},
+    {"vec", vec,      TE_VECTOR_OP, 0},
     {0, 0, 0, 0}
 };
 
@@ -228,12 +415,32 @@ static const te_variable *find_lookup(const state *s, const char *name, int len)
 
 
 
-static double add(double a, double b) {return a + b;}
-static double sub(double a, double b) {return a - b;}
-static double mul(double a, double b) {return a * b;}
-static double divide(double a, double b) {return a / b;}
-static double negate(double a) {return -a;}
-static double comma(double a, double b) {(void)a; return b;}
+static te_real add(te_real a, te_real b) {return a + b;}
+static te_real sub(te_real a, te_real b) {return a - b;}
+static te_real mul(te_real a, te_real b) {return a * b;}
+static te_real divide(te_real a, te_real b) {return a / b;}
+static te_real negate(te_real a) {return -a;}
+static te_real square(te_real a) {return a * a;}
+static te_real comma(te_real a, te_real b) {(void)a; return b;}
+static te_real greater(te_real a, te_real b) {return a > b;}
+static te_real greater_eq(te_real a, te_real b) {return a >= b;}
+static te_real lower(te_real a, te_real b) {return a < b;}
+static te_real lower_eq(te_real a, te_real b) {return a <= b;}
+static te_real equal(te_real a, te_real b) {return a == b;}
+static te_real not_equal(te_real a, te_real b) {return a != b;}
+static te_real logical_and(te_real a, te_real b) {return a != 0.0 && b != 0.0;}
+static te_real logical_or(te_real a, te_real b) {return a != 0.0 || b != 0.0;}
+static te_real ternary(te_real c, te_real a, te_real b) {return c != c ? NAN : (c != 0.0 ? a : b);}
+static te_real array_at(void *array, te_real i) {
+    /* Indices must be whole numbers within bounds. */
+    const te_array *a = array;
+    return i >= 0 && i < a->length && i == floor(i) ? a->data[(int)i] : NAN;
+}
+static te_fun2 variadic_step(const te_expr *n) {
+    /* Means are sums until they're divided by the count at the end. */
+    if (n->function == product) return mul;
+    return n->function == mean || n->function == total ? add : (te_fun2)n->function;
+}
 
 
 void next_token(state *s) {
@@ -257,10 +464,16 @@ void next_token(state *s) {
                 start = s->next;
                 while (isalpha(s->next[0]) || isdigit(s->next[0]) || (s->next[0] == '_')) s->next++;
                 
+                const local *scope = s->locals;
+                while (scope && (scope->len != s->next - start || strncmp(start, scope->name, scope->len))) scope = scope->next;
+
                 const te_variable *var = find_lookup(s, start, s->next - start);
                 if (!var) var = find_builtin(start, s->next - start);
 
-                if (!var) {
+                if (scope) {
+                    s->type = TOK_VARIABLE;
+                    s->bound = scope->address;
+                } else if (!var) {
                     s->type = TOK_ERROR;
                 } else {
                     switch(TYPE_MASK(var->type))
@@ -270,14 +483,22 @@ void next_token(state *s) {
                             s->bound = var->address;
                             break;
 
+                        case TE_ARRAY: case TE_VECTOR:
+                            s->type = TYPE_MASK(var->type);
+                            s->context = (void*)var->address;
+                            break;
+
                         case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:         /* Falls through. */
                         case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:         /* Falls through. */
                             s->context = var->context;                                                  /* Falls through. */
 
                         case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:     /* Falls through. */
                         case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:     /* Falls through. */
+                        case TE_VARIADIC: case TE_VECTOR_OP:                                            /* Falls through. */
                             s->type = var->type;
                             s->function = var->address;
+                            s->derivative = var->derivative;
+                            if (var->derivative && (IS_FUNCTION(var->type) || IS_CLOSURE(var->type))) s->type |= TE_FLAG_PARTIALS;
                             break;
                     }
                 }
@@ -291,6 +512,30 @@ void next_token(state *s) {
                     case '/': s->type = TOK_INFIX; s->function = divide; break;
                     case '^': s->type = TOK_INFIX; s->function = pow; break;
                     case '%': s->type = TOK_INFIX; s->function = fmod; break;
+                    case '>':
+                        s->type = TOK_INFIX;
+                        if (s->next[0] == '=') {s->next++; s->function = greater_eq;} else s->function = greater;
+                        break;
+                    case '<':
+                        s->type = TOK_INFIX;
+                        if (s->next[0] == '=') {s->next++; s->function = lower_eq;} else s->function = lower;
+                        break;
+                    case '=':
+                        if (s->next[0] == '=') {s->next++; s->type = TOK_INFIX; s->function = equal;} else s->type = TOK_ERROR;
+                        break;
+                    case '!':
+                        if (s->next[0] == '=') {s->next++; s->type = TOK_INFIX; s->function = not_equal;} else s->type = TOK_ERROR;
+                        break;
+                    case '&':
+                        if (s->next[0] == '&') {s->next++; s->type = TOK_INFIX; s->function = logical_and;} else s->type = TOK_ERROR;
+                        break;
+                    case '|':
+                        if (s->next[0] == '|') {s->next++; s->type = TOK_INFIX; s->function = logical_or;} else s->type = TOK_ERROR;
+                        break;
+                    case '?': s->type = TOK_QUESTION; break;
+                    case ':': s->type = TOK_COLON; break;
+                    case '[': s->type = TOK_OPEN_BRACKET; break;
+                    case ']': s->type = TOK_CLOSE_BRACKET; break;
                     case '(': s->type = TOK_OPEN; break;
                     case ')': s->type = TOK_CLOSE; break;
                     case ',': s->type = TOK_SEP; break;
@@ -306,13 +551,16 @@ void next_token(state *s) {
 static te_expr *list(state *s);
 static te_expr *expr(state *s);
 static te_expr *power(state *s);
+static int loop_index(state *s);
+static te_expr *loop(state *s, te_fun2 function);
+static void optimize(te_expr *n);
 
 static te_expr *base(state *s) {
-    /* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> | <function-X> "(" <expr> {"," <expr>} ")" | "(" <list> ")" */
+    /* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> | <function-X> "(" <expr> {"," <expr>} ")" | <array> "[" <expr> "]" | "(" <list> ")" */
     te_expr *ret;
     int arity;
 
-    switch (TYPE_MASK(s->type)) {
+    switch (s->type >= TOK_NULL ? s->type : TYPE_MASK(s->type)) {
         case TOK_NUMBER:
             ret = new_expr(TE_CONSTANT, 0);
             CHECK_NULL(ret);
@@ -336,6 +584,7 @@ static te_expr *base(state *s) {
 
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[0] = s->context;
+            if (s->type & TE_FLAG_PARTIALS) PARTIALS(ret) = (void*)s->derivative;
             next_token(s);
             if (s->type == TOK_OPEN) {
                 next_token(s);
@@ -354,6 +603,7 @@ static te_expr *base(state *s) {
 
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[1] = s->context;
+            if (s->type & TE_FLAG_PARTIALS) PARTIALS(ret) = (void*)s->derivative;
             next_token(s);
             ret->parameters[0] = power(s);
             CHECK_NULL(ret->parameters[0], te_free(ret));
@@ -370,6 +620,7 @@ static te_expr *base(state *s) {
 
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[arity] = s->context;
+            if (s->type & TE_FLAG_PARTIALS) PARTIALS(ret) = (void*)s->derivative;
             next_token(s);
 
             if (s->type != TOK_OPEN) {
@@ -394,6 +645,95 @@ static te_expr *base(state *s) {
 
             break;
 
+        case TE_VARIADIC: case TE_VECTOR_OP: {
+            /* The arguments are collected first, since they size the node. */
+            const int type = s->type;
+            const void *function = s->function;
+            te_expr **args = 0;
+            int count = 0, capacity = 0, i;
+
+            next_token(s);
+            if (s->type == TOK_OPEN && (function == total || function == product) && loop_index(s)) {
+                ret = loop(s, function == total ? add : mul);
+                break;
+            }
+
+            if (s->type == TOK_OPEN) {
+                do {
+                    next_token(s);
+                    te_expr *e = expr(s);
+                    if (e && count == capacity) {
+                        te_expr **grown = realloc(args, sizeof(te_expr*) * (capacity = capacity ? capacity * 2 : 8));
+                        if (grown) args = grown; else te_free(e), e = 0;
+                    }
+                    if (!e) {
+                        for (i = 0; i < count; ++i) te_free(args[i]);
+                        free(args);
+                        return NULL;
+                    }
+                    args[count++] = e;
+                } while (s->type == TOK_SEP && count < TE_VARIADIC_MAX);
+            }
+
+            if (!count) {
+                ret = new_expr(0, 0);
+                CHECK_NULL(ret);
+                ret->value = NAN;
+                s->type = TOK_ERROR;
+                break;
+            }
+
+            ret = new_expr(type | (count << TE_VARIADIC_SHIFT), (const te_expr**)args);
+            CHECK_NULL(ret, for (i = 0; i < count; ++i) te_free(args[i]); free(args));
+            free(args);
+            ret->function = function;
+
+            if (s->type != TOK_CLOSE) {
+                s->type = TOK_ERROR;
+            } else if (TYPE_MASK(type) == TE_VECTOR_OP && (function == vec ? count < 2 || count > TE_VECTOR_MAX : count != 2 - (function == length))) {
+                s->type = TOK_ERROR;
+            } else {
+                next_token(s);
+            }
+            break;
+        }
+
+        case TE_ARRAY: case TE_VECTOR: {
+            /* Reads elements, or whole vectors, through closures on the array. */
+            const int type = s->type;
+            void *array = s->context;
+            next_token(s);
+            if (type == TE_VECTOR && s->type != TOK_OPEN_BRACKET) {
+                ret = new_expr(TE_CLOSURE0, 0);
+                CHECK_NULL(ret);
+                ret->function = vector_ref;
+                ret->parameters[0] = array;
+                break;
+            }
+            if (s->type != TOK_OPEN_BRACKET) {
+                ret = new_expr(0, 0);
+                CHECK_NULL(ret);
+                s->type = TOK_ERROR;
+                ret->value = NAN;
+                break;
+            }
+
+            next_token(s);
+            te_expr *index = expr(s);
+            CHECK_NULL(index);
+            ret = NEW_EXPR(TE_CLOSURE1, index);
+            CHECK_NULL(ret, te_free(index));
+            ret->function = array_at;
+            ret->parameters[1] = array;
+
+            if (s->type != TOK_CLOSE_BRACKET) {
+                s->type = TOK_ERROR;
+            } else {
+                next_token(s);
+            }
+            break;
+        }
+
         case TOK_OPEN:
             next_token(s);
             ret = list(s);
@@ -546,8 +886,8 @@ static te_expr *term(state *s) {
 }
 
 
-static te_expr *expr(state *s) {
-    /* <expr>      =    <term> {("+" | "-") <term>} */
+static te_expr *sum(state *s) {
+    /* <sum>       =    <term> {("+" | "-") <term>} */
     te_expr *ret = term(s);
     CHECK_NULL(ret);
 
@@ -568,6 +908,102 @@ static te_expr *expr(state *s) {
 }
 
 
+static te_expr *comparison(state *s) {
+    /* <comparison> =   <sum> {("<" | ">" | "<=" | ">=" | "==" | "!=") <sum>} */
+    te_expr *ret = sum(s);
+    CHECK_NULL(ret);
+
+    while (s->type == TOK_INFIX && (s->function == lower || s->function == lower_eq || s->function == greater ||
+                s->function == greater_eq || s->function == equal || s->function == not_equal)) {
+        te_fun2 t = s->function;
+        next_token(s);
+        te_expr *se = sum(s);
+        CHECK_NULL(se, te_free(ret));
+
+        te_expr *prev = ret;
+        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, se);
+        CHECK_NULL(ret, te_free(se), te_free(prev));
+
+        ret->function = t;
+    }
+
+    return ret;
+}
+
+
+static te_expr *conjunction(state *s) {
+    /* <conjunction> =  <comparison> {"&&" <comparison>} */
+    te_expr *ret = comparison(s);
+    CHECK_NULL(ret);
+
+    while (s->type == TOK_INFIX && s->function == logical_and) {
+        next_token(s);
+        te_expr *c = comparison(s);
+        CHECK_NULL(c, te_free(ret));
+
+        te_expr *prev = ret;
+        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, c);
+        CHECK_NULL(ret, te_free(c), te_free(prev));
+
+        ret->function = logical_and;
+    }
+
+    return ret;
+}
+
+
+static te_expr *disjunction(state *s) {
+    /* <disjunction> =  <conjunction> {"||" <conjunction>} */
+    te_expr *ret = conjunction(s);
+    CHECK_NULL(ret);
+
+    while (s->type == TOK_INFIX && s->function == logical_or) {
+        next_token(s);
+        te_expr *c = conjunction(s);
+        CHECK_NULL(c, te_free(ret));
+
+        te_expr *prev = ret;
+        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, c);
+        CHECK_NULL(ret, te_free(c), te_free(prev));
+
+        ret->function = logical_or;
+    }
+
+    return ret;
+}
+
+
+static te_expr *expr(state *s) {
+    /* <expr>      =    <disjunction> ["?" <expr> ":" <expr>] */
+    te_expr *ret = disjunction(s);
+    CHECK_NULL(ret);
+
+    if (s->type == TOK_QUESTION) {
+        next_token(s);
+        te_expr *a = expr(s);
+        CHECK_NULL(a, te_free(ret));
+
+        if (s->type != TOK_COLON) {
+            te_free(a);
+            s->type = TOK_ERROR;
+            return ret;
+        }
+
+        next_token(s);
+        te_expr *b = expr(s);
+        CHECK_NULL(b, te_free(a), te_free(ret));
+
+        te_expr *prev = ret;
+        ret = NEW_EXPR(TE_FUNCTION3 | TE_FLAG_PURE, ret, a, b);
+        CHECK_NULL(ret, te_free(a), te_free(b), te_free(prev));
+
+        ret->function = ternary;
+    }
+
+    return ret;
+}
+
+
 static te_expr *list(state *s) {
     /* <list>      =    <expr> {"," <expr>} */
     te_expr *ret = expr(s);
@@ -589,123 +1025,4327 @@ static te_expr *list(state *s) {
 }
 
 
-#define TE_FUN(...) ((double(*)(__VA_ARGS__))n->function)
-#define M(e) te_eval(n->parameters[e])
+static int pure_tree(const te_expr *n) {
+    int i;
+    if (TYPE_MASK(n->type) == TE_CONSTANT || TYPE_MASK(n->type) == TE_VARIABLE) return 1;
+    if (!IS_PURE(n->type)) return 0;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        if (!pure_tree(n->parameters[i])) return 0;
+    }
+    return 1;
+}
 
 
-double te_eval(const te_expr *n) {
-    if (!n) return NAN;
+static int pure_loop(const te_expr *n) {
+    /* Whether all of a loop's expressions are pure, leaving out its */
+    /* index and holders. */
+    int i;
+    for (i = 1; i < ARITY(n->type); ++i) {
+        if ((i < 4 || i % 2) && !pure_tree(n->parameters[i])) return 0;
+    }
+    return 1;
+}
 
-    switch(TYPE_MASK(n->type)) {
-        case TE_CONSTANT: return n->value;
-        case TE_VARIABLE: return *n->bound;
 
-        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
-        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
-            switch(ARITY(n->type)) {
-                case 0: return TE_FUN(void)();
-                case 1: return TE_FUN(double)(M(0));
-                case 2: return TE_FUN(double, double)(M(0), M(1));
-                case 3: return TE_FUN(double, double, double)(M(0), M(1), M(2));
-                case 4: return TE_FUN(double, double, double, double)(M(0), M(1), M(2), M(3));
-                case 5: return TE_FUN(double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4));
-                case 6: return TE_FUN(double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5));
-                case 7: return TE_FUN(double, double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5), M(6));
-                default: return NAN;
-            }
+static int loop_index(state *s) {
+    /* Whether a sum or prod is a loop: its first argument binds a name */
+    /* with a single "=", which means nothing else in the grammar. */
+    const char *p = s->next;
+    while (isspace(*p)) ++p;
+    if (!isalpha(*p)) return 0;
+    while (isalpha(*p) || isdigit(*p) || *p == '_') ++p;
+    while (isspace(*p)) ++p;
+    return p[0] == '=' && p[1] != '=';
+}
 
-        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
-        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
-            switch(ARITY(n->type)) {
-                case 0: return TE_FUN(void*)(n->parameters[0]);
-                case 1: return TE_FUN(void*, double)(n->parameters[1], M(0));
-                case 2: return TE_FUN(void*, double, double)(n->parameters[2], M(0), M(1));
-                case 3: return TE_FUN(void*, double, double, double)(n->parameters[3], M(0), M(1), M(2));
-                case 4: return TE_FUN(void*, double, double, double, double)(n->parameters[4], M(0), M(1), M(2), M(3));
-                case 5: return TE_FUN(void*, double, double, double, double, double)(n->parameters[5], M(0), M(1), M(2), M(3), M(4));
-                case 6: return TE_FUN(void*, double, double, double, double, double, double)(n->parameters[6], M(0), M(1), M(2), M(3), M(4), M(5));
-                case 7: return TE_FUN(void*, double, double, double, double, double, double, double)(n->parameters[7], M(0), M(1), M(2), M(3), M(4), M(5), M(6));
-                default: return NAN;
-            }
 
-        default: return NAN;
-    }
+/* Loops are hoisted out of relative to a stack of the loops being searched. */
+/* A subtree depends on the outermost loop in the stack whose index or */
+/* holders it reads, or on none of them. */
+#define TE_LOOP_DEPTH 32
+enum {TE_NO_LOOP = TE_LOOP_DEPTH};
+
+/* A loop binds at most this many hoisted values, so that their columns fit */
+/* on the stack. Parsing hoists half as many, leaving room for a derivative */
+/* to add one holder per invariant. */
+#define TE_LOOP_HOLDERS 16
+
+typedef struct hoisting {
+    const te_expr *loops[TE_LOOP_DEPTH];
+    int depth;
+    te_expr **hoisted;
+    int count, capacity;
+} hoisting;
+
 
+static int loop_reads(const te_expr *loop, const te_real *address) {
+    int i;
+    if (address == &((te_expr*)loop->parameters[0])->value) return 1;
+    for (i = 4; i < ARITY(loop->type); i += 2) {
+        if (address == &((te_expr*)loop->parameters[i])->value) return 1;
+    }
+    return 0;
 }
 
-#undef TE_FUN
-#undef M
 
-static void optimize(te_expr *n) {
-    /* Evaluates as much as possible. */
-    if (n->type == TE_CONSTANT) return;
-    if (n->type == TE_VARIABLE) return;
+static int hoist(te_expr **slot, hoisting *h) {
+    /* Moves the largest pure subtrees that don't depend on the loop at the */
+    /* bottom of the stack into h->hoisted. Returns what *slot depends on, */
+    /* or -1 on allocation failure. */
+    te_expr *n = *slot;
+    int i, deps = TE_NO_LOOP;
 
-    /* Only optimize out functions flagged as pure. */
-    if (IS_PURE(n->type)) {
-        const int arity = ARITY(n->type);
-        int known = 1;
-        int i;
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return TE_NO_LOOP;
+        case TE_VARIABLE:
+            for (i = 0; i < h->depth; ++i) {
+                if (loop_reads(h->loops[i], n->bound)) return i;
+            }
+            return TE_NO_LOOP;
+    }
+
+    const int level = h->depth;
+    if (TYPE_MASK(n->type) == TE_LOOP) {
+        /* Whatever reads this loop's own index stays inside it. */
+        if (level == TE_LOOP_DEPTH) return 0;
+        h->loops[h->depth++] = n;
+    }
+
+    int child[7];
+    const int arity = ARITY(n->type);
+    for (i = 0; i < arity; ++i) {
+        const int d = hoist((te_expr**)&n->parameters[i], h);
+        if (d < 0) return -1;
+        if (i < 7) child[i] = d;
+        if (d < deps && d < level) deps = d;
+    }
+    h->depth = level;
+
+    const int whole = deps == TE_NO_LOOP && pure_tree(n);
+    if (!whole) {
+        /* This node stays in the body, but its invariant arguments can go. */
         for (i = 0; i < arity; ++i) {
-            optimize(n->parameters[i]);
-            if (((te_expr*)(n->parameters[i]))->type != TE_CONSTANT) {
-                known = 0;
+            te_expr *c = n->parameters[i];
+            const int d = i < 7 ? child[i] : 1;
+            if (d != TE_NO_LOOP || TYPE_MASK(c->type) == TE_CONSTANT || TYPE_MASK(c->type) == TE_VARIABLE) continue;
+            if (TYPE_MASK(n->type) == TE_LOOP && (i == 0 || i >= 4)) continue;
+            if (!pure_tree(c) || h->count == TE_LOOP_HOLDERS) continue;
+
+            if (h->count == h->capacity) {
+                te_expr **grown = realloc(h->hoisted, sizeof(te_expr*) * (h->capacity = h->capacity ? h->capacity * 2 : 8));
+                if (!grown) return -1;
+                h->hoisted = grown;
             }
-        }
-        if (known) {
-            const double value = te_eval(n);
-            te_free_parameters(n);
-            n->type = TE_CONSTANT;
-            n->value = value;
+            te_expr *holder = new_expr(TE_CONSTANT, 0);
+            te_expr *var = new_expr(TE_VARIABLE, 0);
+            if (!holder || !var) {
+                free(holder);
+                free(var);
+                return -1;
+            }
+            holder->value = NAN;
+            var->bound = &holder->value;
+            h->hoisted[h->count++] = holder;
+            h->hoisted[h->count++] = c;
+            n->parameters[i] = var;
         }
     }
+    return whole ? TE_NO_LOOP : (deps == TE_NO_LOOP ? 0 : deps);
 }
 
 
-te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
-    state s;
-    s.start = s.next = expression;
-    s.lookup = variables;
-    s.lookup_len = var_count;
-
-    next_token(&s);
-    te_expr *root = list(&s);
-    if (root == NULL) {
-        if (error) *error = -1;
-        return NULL;
+static te_expr *loop(state *s, te_fun2 function) {
+    /* <loop>      =    ("sum" | "prod") "(" <name> "=" <expr> ":" <expr> "," <expr> ")" */
+    te_expr *index = new_expr(TE_CONSTANT, 0), *from = 0, *to = 0, *body = 0, *ret;
+    local scope;
+    int i;
+    CHECK_NULL(index);
+
+    /* The index name was already checked by loop_index(). */
+    while (isspace(*s->next)) ++s->next;
+    scope.name = s->next;
+    while (isalpha(*s->next) || isdigit(*s->next) || *s->next == '_') ++s->next;
+    scope.len = s->next - scope.name;
+    scope.address = &index->value;
+    scope.next = s->locals;
+    while (*s->next != '=') ++s->next;
+    ++s->next;
+
+    next_token(s);
+    from = expr(s);
+    CHECK_NULL(from, free(index));
+    if (s->type == TOK_COLON) {
+        next_token(s);
+        to = expr(s);
+        CHECK_NULL(to, free(index), te_free(from));
+    }
+    if (to && s->type == TOK_SEP) {
+        s->locals = &scope;
+        next_token(s);
+        body = expr(s);
+        s->locals = scope.next;
+        CHECK_NULL(body, free(index), te_free(from), te_free(to));
     }
 
-    if (s.type != TOK_END) {
-        te_free(root);
-        if (error) {
-            *error = (s.next - s.start);
-            if (*error == 0) *error = 1;
+    if (!body || s->type != TOK_CLOSE) {
+        te_free(index);
+        te_free(from);
+        te_free(to);
+        te_free(body);
+        ret = new_expr(0, 0);
+        CHECK_NULL(ret);
+        ret->value = NAN;
+        s->type = TOK_ERROR;
+        return ret;
+    }
+    next_token(s);
+
+    /* Hoists loop invariants out of the body, after folding its constants. */
+    optimize(body);
+    ret = NEW_EXPR(TE_LOOP | (4 << TE_VARIADIC_SHIFT), index, from, to, body);
+    CHECK_NULL(ret, te_free(index), te_free(from), te_free(to), te_free(body));
+    ret->function = function;
+
+    hoisting h;
+    h.loops[0] = ret;
+    h.depth = 1;
+    h.hoisted = 0;
+    h.count = h.capacity = 0;
+    int deps = hoist((te_expr**)&ret->parameters[3], &h);
+    te_expr *hoisted = 0;
+
+    if (deps == TE_NO_LOOP && TYPE_MASK(body->type) != TE_CONSTANT && TYPE_MASK(body->type) != TE_VARIABLE && pure_tree(body) && h.count < TE_LOOP_HOLDERS) {
+        /* The whole body is invariant. */
+        te_expr *holder = new_expr(TE_CONSTANT, 0), *var = new_expr(TE_VARIABLE, 0);
+        te_expr **grown = realloc(h.hoisted, sizeof(te_expr*) * (h.count + 2));
+        if (grown) h.hoisted = grown;
+        if (!holder || !var || !grown) {
+            free(holder);
+            free(var);
+            deps = -1;
+        } else {
+            var->bound = &holder->value;
+            h.hoisted[h.count++] = holder;
+            h.hoisted[h.count++] = body;
+            ret->parameters[3] = var;
         }
-        return 0;
-    } else {
-        optimize(root);
-        if (error) *error = 0;
-        return root;
     }
-}
 
+    if (deps >= 0 && h.count) {
+        hoisted = new_expr(TE_LOOP | ((4 + h.count) << TE_VARIADIC_SHIFT), 0);
+        if (!hoisted) deps = -1;
+    }
 
-double te_interp(const char *expression, int *error) {
-    te_expr *n = te_compile(expression, 0, 0, error);
-    if (n == NULL) {
-        return NAN;
+    if (deps < 0) {
+        for (i = 0; i < h.count; ++i) te_free(h.hoisted[i]);
+        free(h.hoisted);
+        te_free(ret);
+        return NULL;
     }
 
-    double ret;
-    if (n) {
-        ret = te_eval(n);
-        te_free(n);
-    } else {
-        ret = NAN;
+    if (hoisted) {
+        memcpy(hoisted->parameters, ret->parameters, sizeof(void*) * 4);
+        memcpy(hoisted->parameters + 4, h.hoisted, sizeof(void*) * h.count);
+        hoisted->function = function;
+        free(ret);
+        ret = hoisted;
     }
+    free(h.hoisted);
+
+    if (pure_loop(ret)) ret->type |= TE_FLAG_PURE;
     return ret;
 }
 
+
+static int integer_value(te_real value, int64_t *out, int *sign) {
+    if (value != floor(value) || fabs(value) >= 9.2e18) return 0;
+    *out = (int64_t)value;
+    *sign = signbit(value) != 0;
+    return 1;
+}
+
+
+static te_real integer_real(int64_t value, int sign) {
+    /* Zero gets the sign floating point would have given it. */
+    return value ? (te_real)value : sign ? -(te_real)0 : 0;
+}
+
+
+static int integer_step(const te_expr *n, const int64_t *x, const int *s, int64_t *out, int *sign) {
+    /* Applies n exactly to whole numbers x, whose signs s also tell zeros */
+    /* apart. Returns 0 if the result overflows or isn't a whole number. */
+    const int64_t a = x[0], b = ARITY(n->type) > 1 ? x[1] : 0;
+    uint64_t c;
+    *sign = 0;
+
+    if (ARITY(n->type) == 1) {
+        if (n->function == floor || n->function == ceil) {
+            *out = a;
+            *sign = s[0];
+        } else if (n->function == negate || n->function == fabs) {
+            if (a == INT64_MIN) return 0;
+            *out = n->function == negate || a < 0 ? -a : a;
+            *sign = n->function == negate && !s[0];
+        } else if (n->function == square) {
+            if (a > 3037000499 || a < -3037000499) return 0;
+            *out = a * a;
+        } else if (n->function == fac) {
+            if (a < 0 || a > 20) return 0;
+            *out = (int64_t)factorials[a];
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+
+    if (n->function == add) {
+        if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return 0;
+        *out = a + b;
+        *sign = *out ? *out < 0 : s[0] && s[1];
+    } else if (n->function == sub) {
+        if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) return 0;
+        *out = a - b;
+        *sign = *out ? *out < 0 : s[0] && !s[1];
+    } else if (n->function == mul) {
+        if (a && b && (a == INT64_MIN || b == INT64_MIN ||
+                    (a < 0 ? -a : a) > INT64_MAX / (b < 0 ? -b : b))) return 0;
+        *out = a * b;
+        *sign = s[0] != s[1];
+    } else if (n->function == fmod) {
+        if (b == 0 || (a == INT64_MIN && b == -1)) return 0;
+        *out = a % b;
+        *sign = s[0];
+    } else if (n->function == ncr || n->function == npr) {
+        /* The same domain as ncr(), so both paths give the same results. */
+        if (a < 0 || b < 0 || a < b || a > UINT_MAX) return 0;
+        if (!ncr_integer((uint64_t)a, (uint64_t)b, &c) || c > INT64_MAX) return 0;
+        if (n->function == npr) {
+            if (b > 20 || c > INT64_MAX / factorials[b]) return 0;
+            c *= factorials[b];
+        }
+        *out = (int64_t)c;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+
+static int eval_integer(const te_expr *n, int64_t *out, int *sign) {
+    /* Evaluates n exactly in 64 bit integers. Returns 0 if any value along */
+    /* the way isn't a whole number or overflows, leaving it to te_eval(). */
+    int64_t x[2];
+    int s[2], i;
+
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return integer_value(n->value, out, sign);
+        case TE_VARIABLE: return integer_value(*n->bound, out, sign);
+
+        case TE_FUNCTION1: case TE_FUNCTION2:
+            for (i = 0; i < ARITY(n->type); ++i) {
+                if (!eval_integer(n->parameters[i], x + i, s + i)) return 0;
+            }
+            return integer_step(n, x, s, out, sign);
+
+        default: return 0;
+    }
+}
+
+
+static int integer_tree(const te_expr *n, int *combinatorial) {
+    /* Whether eval_integer() can handle all of n given whole number inputs. */
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return n->value == floor(n->value) && fabs(n->value) < 9.2e18;
+        case TE_VARIABLE: return 1;
+        case TE_FUNCTION1:
+            if (n->function == fac) *combinatorial = 1;
+            else if (n->function != floor && n->function != ceil && n->function != negate &&
+                    n->function != fabs && n->function != square) return 0;
+            return integer_tree(n->parameters[0], combinatorial);
+        case TE_FUNCTION2:
+            if (n->function == ncr || n->function == npr) *combinatorial = 1;
+            else if (n->function != add && n->function != sub && n->function != mul && n->function != fmod) return 0;
+            return integer_tree(n->parameters[0], combinatorial) && integer_tree(n->parameters[1], combinatorial);
+        default: return 0;
+    }
+}
+
+
+static void mark_integer(te_expr *n) {
+    /* Flags the largest integer subtrees that do some combinatorics, */
+    /* where evaluating in integers saves repeated conversions. */
+    int i, combinatorial = 0;
+    n->type &= ~TE_FLAG_INTEGER;
+    if (integer_tree(n, &combinatorial) && combinatorial) {
+        n->type |= TE_FLAG_INTEGER;
+        return;
+    }
+    for (i = 0; i < ARITY(n->type); ++i) mark_integer(n->parameters[i]);
+}
+
+
+static void call_batch(const te_expr *n, const te_real **args, te_real *out, int count) {
+    /* Calls a TE_FLAG_BATCH function or closure for count rows at once. */
+    if (IS_CLOSURE(n->type)) {
+        ((void(*)(void*, const te_real**, te_real*, int))n->function)(n->parameters[ARITY(n->type)], args, out, count);
+    } else {
+        ((void(*)(const te_real**, te_real*, int))n->function)(args, out, count);
+    }
+}
+
+
+static te_real call(const te_expr *n, const te_real *a);
+
+
+#define TE_FUN(...) ((te_real(*)(__VA_ARGS__))n->function)
+#define M(e) te_eval(n->parameters[e])
+
+
+static te_real eval_row(const te_expr *n, int lane);
+
+te_real te_eval(const te_expr *n) {
+    if (!n) return NAN;
+
+    if ((n->type & TE_FLAG_MEMO) && !(n->type & TE_FLAG_BATCH)) {
+        te_real a[7];
+        int i;
+        for (i = 0; i < ARITY(n->type); ++i) a[i] = M(i);
+        return call(n, a);
+    }
+
+    if (n->type & TE_FLAG_BATCH) {
+        te_real a[7], ret;
+        const te_real *args[7];
+        int i;
+        for (i = 0; i < ARITY(n->type); ++i) {
+            a[i] = M(i);
+            args[i] = a + i;
+        }
+        call_batch(n, args, &ret, 1);
+        return ret;
+    }
+
+    if (n->type & TE_FLAG_INTEGER) {
+        int64_t value;
+        int sign;
+        if (eval_integer(n, &value, &sign)) return integer_real(value, sign);
+    }
+
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return n->value;
+        case TE_VARIABLE: return *n->bound;
+
+        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+            /* Only the branches that are needed are evaluated. */
+            if (n->function == ternary) {
+                const te_real c = M(0);
+                return c != c ? NAN : (c != 0.0 ? M(1) : M(2));
+            }
+            if (n->function == logical_and) return M(0) != 0.0 && M(1) != 0.0;
+            if (n->function == logical_or) return M(0) != 0.0 || M(1) != 0.0;
+
+            switch(ARITY(n->type)) {
+                case 0: return TE_FUN(void)();
+                case 1: return TE_FUN(te_real)(M(0));
+                case 2: return TE_FUN(te_real, te_real)(M(0), M(1));
+                case 3: return TE_FUN(te_real, te_real, te_real)(M(0), M(1), M(2));
+                case 4: return TE_FUN(te_real, te_real, te_real, te_real)(M(0), M(1), M(2), M(3));
+                case 5: return TE_FUN(te_real, te_real, te_real, te_real, te_real)(M(0), M(1), M(2), M(3), M(4));
+                case 6: return TE_FUN(te_real, te_real, te_real, te_real, te_real, te_real)(M(0), M(1), M(2), M(3), M(4), M(5));
+                case 7: return TE_FUN(te_real, te_real, te_real, te_real, te_real, te_real, te_real)(M(0), M(1), M(2), M(3), M(4), M(5), M(6));
+                default: return NAN;
+            }
+
+        case TE_VARIADIC: {
+            /* A flat reduction over all of the arguments. */
+            const int count = ARITY(n->type);
+            const te_fun2 f = variadic_step(n);
+            te_real ret = f == hypot ? fabs(M(0)) : M(0);
+            int i;
+            for (i = 1; i < count; ++i) ret = f(ret, M(i));
+            return n->function == mean ? ret / count : ret;
+        }
+
+        case TE_VECTOR_OP: return eval_row(n, -1);
+
+        case TE_LOOP:
+            /* The index is bound as a column, so n is left untouched. */
+            return eval_row(n, -1);
+
+        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+            switch(ARITY(n->type)) {
+                case 0: return TE_FUN(void*)(n->parameters[0]);
+                case 1: return TE_FUN(void*, te_real)(n->parameters[1], M(0));
+                case 2: return TE_FUN(void*, te_real, te_real)(n->parameters[2], M(0), M(1));
+                case 3: return TE_FUN(void*, te_real, te_real, te_real)(n->parameters[3], M(0), M(1), M(2));
+                case 4: return TE_FUN(void*, te_real, te_real, te_real, te_real)(n->parameters[4], M(0), M(1), M(2), M(3));
+                case 5: return TE_FUN(void*, te_real, te_real, te_real, te_real, te_real)(n->parameters[5], M(0), M(1), M(2), M(3), M(4));
+                case 6: return TE_FUN(void*, te_real, te_real, te_real, te_real, te_real, te_real)(n->parameters[6], M(0), M(1), M(2), M(3), M(4), M(5));
+                case 7: return TE_FUN(void*, te_real, te_real, te_real, te_real, te_real, te_real, te_real)(n->parameters[7], M(0), M(1), M(2), M(3), M(4), M(5), M(6));
+                default: return NAN;
+            }
+
+        default: return NAN;
+    }
+
+}
+
+#undef TE_FUN
+#undef M
+
+static void optimize(te_expr *n) {
+    /* Evaluates as much as possible. */
+    if (n->type == TE_CONSTANT) return;
+    if (n->type == TE_VARIABLE) return;
+
+    /* Only optimize out functions flagged as pure. */
+    if (IS_PURE(n->type)) {
+        const int arity = ARITY(n->type);
+        int known = 1;
+        int i;
+        for (i = 0; i < arity; ++i) {
+            optimize(n->parameters[i]);
+            if (((te_expr*)(n->parameters[i]))->type != TE_CONSTANT) {
+                known = 0;
+            }
+        }
+        if (known) {
+            const te_real value = te_eval(n);
+            te_free_parameters(n);
+            n->type = TE_CONSTANT;
+            n->value = value;
+        }
+    }
+}
+
+
+te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
+    state s;
+    s.start = s.next = expression;
+    s.lookup = variables;
+    s.lookup_len = var_count;
+    s.locals = 0;
+    s.derivative = 0;
+
+    next_token(&s);
+    te_expr *root = list(&s);
+    if (root == NULL) {
+        if (error) *error = -1;
+        return NULL;
+    }
+
+    if (s.type != TOK_END) {
+        te_free(root);
+        if (error) {
+            *error = (s.next - s.start);
+            if (*error == 0) *error = 1;
+        }
+        return 0;
+    } else {
+        optimize(root);
+        mark_integer(root);
+        if (error) *error = 0;
+        return root;
+    }
+}
+
+
+te_real te_interp(const char *expression, int *error) {
+    te_expr *n = te_compile(expression, 0, 0, error);
+    if (n == NULL) {
+        return NAN;
+    }
+
+    te_real ret;
+    if (n) {
+        ret = te_eval(n);
+        te_free(n);
+    } else {
+        ret = NAN;
+    }
+    return ret;
+}
+
+
+/* Batch evaluation works on blocks of rows small enough to stay in cache. */
+/* Must be a multiple of 8. */
+#ifndef TE_BLOCK
+#define TE_BLOCK 64
+#endif
+
+typedef struct block {
+    const te_column *columns;
+    int column_count;
+    int offset;
+    int lane; /* The vector component being evaluated, or -1. */
+    const struct lane_table *known; /* Arguments evaluated for every lane, or NULL. */
+    const struct block *parent; /* The block a loop body's block is nested in, or NULL. */
+} block;
+
+
+static const te_column *find_column(const block *b, const te_real *address, int *offset) {
+    /* Searches b and the blocks it is nested in. Offsets are relative to */
+    /* the parent's, so they add up on the way out. */
+    int i;
+    for (*offset = 0; b; b = b->parent) {
+        *offset += b->offset;
+        for (i = 0; i < b->column_count; ++i) {
+            if (b->columns[i].address == address) return b->columns + i;
+        }
+    }
+    return 0;
+}
+
+
+static int column_size(int type) {
+    switch (type) {
+        case TE_COLUMN_DOUBLE: return sizeof(double);
+        case TE_COLUMN_FLOAT: return sizeof(float);
+        case TE_COLUMN_INT32: return sizeof(int32_t);
+        case TE_COLUMN_INT64: return sizeof(int64_t);
+        case TE_COLUMN_UINT8: return sizeof(uint8_t);
+        default: return sizeof(te_real);
+    }
+}
+
+
+/* Reads len rows of a column, converting each value to te_real. */
+#define TE_LOAD(TYPE) do {\
+    if (stride == sizeof(TYPE)) {\
+        const TYPE *values = (const TYPE*)data;\
+        for (i = 0; i < len; ++i) out[i] = (te_real)values[i];\
+    } else {\
+        for (i = 0; i < len; ++i) out[i] = (te_real)*(const TYPE*)(data + (size_t)i * stride);\
+    }} while (0)
+
+static void load_column(const te_column *c, int offset, int len, te_real *out) {
+    const int stride = c->stride ? c->stride : column_size(c->type);
+    const char *data = (const char*)c->data + c->offset + (size_t)offset * stride;
+    int i;
+
+    switch (c->type) {
+        case TE_COLUMN_DOUBLE: TE_LOAD(double); break;
+        case TE_COLUMN_FLOAT: TE_LOAD(float); break;
+        case TE_COLUMN_INT32: TE_LOAD(int32_t); break;
+        case TE_COLUMN_INT64: TE_LOAD(int64_t); break;
+        case TE_COLUMN_UINT8: TE_LOAD(uint8_t); break;
+        default:
+            if (stride == sizeof(te_real)) {
+                memcpy(out, data, sizeof(te_real) * len);
+            } else {
+                /* Gathers a field out of an array of structs. */
+                for (i = 0; i < len; ++i) out[i] = *(const te_real*)(data + (size_t)i * stride);
+            }
+            break;
+    }
+}
+
+#undef TE_LOAD
+
+
+#ifdef TE_MEMO_ATOMIC
+
+/* A two way set associative cache of results, shared by every expression */
+/* and thread. Each set has its own try-lock, and a busy set is simply skipped. */
+typedef struct memo_entry {
+    const void *function;
+    void *context;
+    te_real args[7];
+    te_real value;
+} memo_entry;
+
+typedef struct memo_set {
+    atomic_int lock;
+    int used;
+    memo_entry entries[2]; /* Most recently used first. */
+} memo_set;
+
+static memo_set memo[(TE_MEMO_SIZE + 1) / 2];
+static atomic_long memo_hits, memo_misses;
+
+
+static memo_set *memo_lock(const te_expr *n, const te_real *a) {
+    const int arity = ARITY(n->type);
+    const void *context = IS_CLOSURE(n->type) ? n->parameters[arity] : 0;
+    uint64_t h = (uint64_t)(uintptr_t)n->function ^ ((uint64_t)(uintptr_t)context << 7);
+    int i;
+    for (i = 0; i < arity; ++i) {
+        uint64_t bits = 0;
+        memcpy(&bits, a + i, sizeof(te_real));
+        h = (h ^ bits) * 0x100000001B3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+
+    memo_set *set = memo + (h % (sizeof(memo) / sizeof(memo_set)));
+    if (atomic_exchange_explicit(&set->lock, 1, memory_order_acquire)) return 0;
+    return set;
+}
+
+
+static void memo_unlock(memo_set *set) {
+    atomic_store_explicit(&set->lock, 0, memory_order_release);
+}
+
+
+static int memo_find(memo_set *set, const te_expr *n, const te_real *a) {
+    /* Returns 1 and moves the entry to the front if it's in the set. */
+    const int arity = ARITY(n->type);
+    const void *context = IS_CLOSURE(n->type) ? n->parameters[arity] : 0;
+    int i;
+    for (i = 0; i < set->used; ++i) {
+        const memo_entry *e = set->entries + i;
+        if (e->function == n->function && e->context == context &&
+                memcmp(e->args, a, sizeof(te_real) * arity) == 0) {
+            if (i) {
+                const memo_entry hit = *e;
+                set->entries[1] = set->entries[0];
+                set->entries[0] = hit;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static te_real call_function(const te_expr *n, const te_real *a);
+
+static te_real call(const te_expr *n, const te_real *a) {
+    /* Looks up TE_FLAG_MEMO functions in the cache before calling them. */
+    memo_set *set;
+    te_real ret;
+
+    if (!(n->type & TE_FLAG_MEMO)) return call_function(n, a);
+
+    set = memo_lock(n, a);
+    if (set) {
+        const int hit = memo_find(set, n, a);
+        ret = set->entries[0].value;
+        memo_unlock(set);
+        if (hit) {
+            atomic_fetch_add_explicit(&memo_hits, 1, memory_order_relaxed);
+            return ret;
+        }
+    }
+
+    atomic_fetch_add_explicit(&memo_misses, 1, memory_order_relaxed);
+    ret = call_function(n, a);
+
+    set = memo_lock(n, a);
+    if (set) {
+        /* Evicts the least recently used entry. */
+        memo_entry *e = set->entries;
+        e[1] = e[0];
+        e->function = n->function;
+        e->context = IS_CLOSURE(n->type) ? n->parameters[ARITY(n->type)] : 0;
+        memcpy(e->args, a, sizeof(te_real) * ARITY(n->type));
+        e->value = ret;
+        if (set->used < 2) ++set->used;
+        memo_unlock(set);
+    }
+    return ret;
+}
+
+
+void te_memo_stats(long *hits, long *misses) {
+    if (hits) *hits = atomic_load(&memo_hits);
+    if (misses) *misses = atomic_load(&memo_misses);
+}
+
+
+void te_memo_clear(void) {
+    int i;
+    for (i = 0; i < (int)(sizeof(memo) / sizeof(memo_set)); ++i) {
+        while (atomic_exchange_explicit(&memo[i].lock, 1, memory_order_acquire));
+        memo[i].used = 0;
+        memo_unlock(memo + i);
+    }
+    atomic_store(&memo_hits, 0);
+    atomic_store(&memo_misses, 0);
+}
+
+#else
+
+/* Without C11 atomics there is no cache, and memoized functions are always called. */
+#define call_function call
+
+void te_memo_stats(long *hits, long *misses) {
+    if (hits) *hits = 0;
+    if (misses) *misses = 0;
+}
+
+void te_memo_clear(void) {}
+
+#endif
+
+
+#define TE_FUN(...) ((te_real(*)(__VA_ARGS__))n->function)
+#define M(e) a[e]
+
+static te_real call_function(const te_expr *n, const te_real *a) {
+    /* Calls the function or closure of n with already evaluated arguments. */
+    const int arity = ARITY(n->type);
+
+    if (n->type & TE_FLAG_BATCH) {
+        const te_real *args[7];
+        te_real ret;
+        int i;
+        for (i = 0; i < arity; ++i) args[i] = a + i;
+        call_batch(n, args, &ret, 1);
+        return ret;
+    }
+
+    if (IS_CLOSURE(n->type)) {
+        void *context = n->parameters[arity];
+        switch(arity) {
+            case 0: return TE_FUN(void*)(context);
+            case 1: return TE_FUN(void*, te_real)(context, M(0));
+            case 2: return TE_FUN(void*, te_real, te_real)(context, M(0), M(1));
+            case 3: return TE_FUN(void*, te_real, te_real, te_real)(context, M(0), M(1), M(2));
+            case 4: return TE_FUN(void*, te_real, te_real, te_real, te_real)(context, M(0), M(1), M(2), M(3));
+            case 5: return TE_FUN(void*, te_real, te_real, te_real, te_real, te_real)(context, M(0), M(1), M(2), M(3), M(4));
+            case 6: return TE_FUN(void*, te_real, te_real, te_real, te_real, te_real, te_real)(context, M(0), M(1), M(2), M(3), M(4), M(5));
+            case 7: return TE_FUN(void*, te_real, te_real, te_real, te_real, te_real, te_real, te_real)(context, M(0), M(1), M(2), M(3), M(4), M(5), M(6));
+            default: return NAN;
+        }
+    }
+
+    switch(arity) {
+        case 0: return TE_FUN(void)();
+        case 1: return TE_FUN(te_real)(M(0));
+        case 2: return TE_FUN(te_real, te_real)(M(0), M(1));
+        case 3: return TE_FUN(te_real, te_real, te_real)(M(0), M(1), M(2));
+        case 4: return TE_FUN(te_real, te_real, te_real, te_real)(M(0), M(1), M(2), M(3));
+        case 5: return TE_FUN(te_real, te_real, te_real, te_real, te_real)(M(0), M(1), M(2), M(3), M(4));
+        case 6: return TE_FUN(te_real, te_real, te_real, te_real, te_real, te_real)(M(0), M(1), M(2), M(3), M(4), M(5));
+        case 7: return TE_FUN(te_real, te_real, te_real, te_real, te_real, te_real, te_real)(M(0), M(1), M(2), M(3), M(4), M(5), M(6));
+        default: return NAN;
+    }
+}
+
+
+static void eval_block(const te_expr *n, const block *b, int len, te_real *out);
+
+static void draw_block(const void *f, int len, te_real *out) {
+    /* Makes the next len draws for one call, hashed independently. Rows */
+    /* of an expression with several calls get their draws in a different */
+    /* order than one row at a time. */
+    const uint64_t key = rng.key, first = rng.counter;
+    int i;
+    rng.counter += len;
+    if (f == unif) {
+        for (i = 0; i < len; ++i) out[i] = uniform(draw(key, first + i));
+    } else {
+        for (i = 0; i < len; ++i) out[i] = gaussian(draw(key, first + i));
+    }
+}
+
+static void eval_block_call(const te_expr *n, const block *b, int len, te_real *out) {
+    /* Generic path: evaluate every argument block, then call once per row. */
+    te_real args[7][TE_BLOCK];
+    const int arity = ARITY(n->type);
+    int i, j;
+
+    for (j = 0; j < arity; ++j) {
+        eval_block(n->parameters[j], b, len, args[j]);
+    }
+
+    for (i = 0; i < len; ++i) {
+        te_real a[7];
+        for (j = 0; j < arity; ++j) a[j] = args[j][i];
+        out[i] = call(n, a);
+    }
+}
+
+
+
+static void eval_block_integer(const te_expr *n, const block *b, int len, int64_t *out, int *sign, unsigned char *ok) {
+    /* Like eval_integer() for every row of the block, clearing ok for */
+    /* the rows it can't do. */
+    int i, j;
+
+    if (TYPE_MASK(n->type) == TE_CONSTANT || TYPE_MASK(n->type) == TE_VARIABLE) {
+        te_real x[TE_BLOCK];
+        eval_block(n, b, len, x);
+        for (i = 0; i < len; ++i) ok[i] = integer_value(x[i], out + i, sign + i);
+        return;
+    }
+
+    int64_t args[2][TE_BLOCK];
+    int signs[2][TE_BLOCK];
+    unsigned char oks[2][TE_BLOCK];
+    const int arity = ARITY(n->type);
+    for (j = 0; j < arity; ++j) {
+        eval_block_integer(n->parameters[j], b, len, args[j], signs[j], oks[j]);
+    }
+
+    for (i = 0; i < len; ++i) {
+        int64_t x[2];
+        int s[2];
+        ok[i] = 1;
+        for (j = 0; j < arity; ++j) {
+            x[j] = args[j][i];
+            s[j] = signs[j][i];
+            ok[i] = ok[i] && oks[j][i];
+        }
+        ok[i] = ok[i] && integer_step(n, x, s, out + i, sign + i);
+    }
+}
+
+static void eval_block_loop(const te_expr *n, const block *b, int len, te_real *out) {
+    /* Runs a loop for every row of the block at once. The index and the */
+    /* hoisted invariants are bound as extra columns for the body. */
+    const int extra = 1 + (ARITY(n->type) - 4) / 2;
+    te_real from[TE_BLOCK], to[TE_BLOCK], x[TE_BLOCK], values[(1 + TE_LOOP_HOLDERS) * TE_BLOCK];
+    te_column columns[1 + TE_LOOP_HOLDERS];
+    long counts[TE_BLOCK], most = 0, k;
+    int i, j;
+
+    memset(columns, 0, sizeof(columns));
+    for (j = 0; j < extra; ++j) {
+        columns[j].address = &((te_expr*)n->parameters[j ? 2 + 2 * j : 0])->value;
+        columns[j].data = values + j * TE_BLOCK;
+        if (j) eval_block(n->parameters[3 + 2 * j], b, len, values + j * TE_BLOCK);
+    }
+
+    block inner;
+    inner.columns = columns;
+    inner.column_count = extra;
+    inner.offset = 0;
+    inner.lane = b->lane;
+    inner.known = 0;
+    inner.parent = b;
+
+    eval_block(n->parameters[1], b, len, from);
+    eval_block(n->parameters[2], b, len, to);
+    for (i = 0; i < len; ++i) {
+        const te_real steps = floor(to[i] - from[i]) + 1;
+        counts[i] = steps <= TE_LOOP_MAX ? (steps > 0 ? (long)steps : 0) : -1;
+        if (counts[i] > most) most = counts[i];
+        out[i] = n->function == mul ? 1 : 0;
+    }
+
+    if (!IS_PURE(n->type)) {
+        /* Impure loops run one row at a time, so finished rows make no */
+        /* calls, and each row draws from its own stream. */
+        const random_stream outer = rng;
+        for (i = 0; i < len; ++i) {
+            rng = row_stream(outer, i);
+            inner.offset = i;
+            for (k = 0; k < counts[i]; ++k) {
+                values[i] = from[i] + k;
+                eval_block(n->parameters[3], &inner, 1, x + i);
+                out[i] = n->function == mul ? out[i] * x[i] : out[i] + x[i];
+            }
+        }
+        rng.key = outer.key;
+        rng.counter = outer.counter + len;
+    } else {
+        for (k = 0; k < most; ++k) {
+            for (i = 0; i < len; ++i) values[i] = from[i] + k;
+            eval_block(n->parameters[3], &inner, len, x);
+            if (n->function == mul) {
+                for (i = 0; i < len; ++i) out[i] *= k < counts[i] ? x[i] : 1;
+            } else {
+                for (i = 0; i < len; ++i) out[i] += k < counts[i] ? x[i] : 0;
+            }
+        }
+    }
+
+    for (i = 0; i < len; ++i) {
+        if (counts[i] < 0) out[i] = NAN;
+    }
+}
+
+
+static int vector_width(const te_expr *n) {
+    /* How many components n has: 1 for scalars, 0 if sizes don't match. */
+    int i, w = 1;
+    if (TYPE_MASK(n->type) == TE_CLOSURE0 && n->function == vector_ref) {
+        const te_array *a = n->parameters[0];
+        return a->length >= 2 && a->length <= TE_VECTOR_MAX ? a->length : 0;
+    }
+    for (i = 0; i < ARITY(n->type); ++i) {
+        const int c = vector_width(n->parameters[i]);
+        if (!c || (c > 1 && w > 1 && c != w)) return 0;
+        if (c > 1) w = c;
+    }
+    if (TYPE_MASK(n->type) != TE_VECTOR_OP) return w;
+    if (n->function == vec) return w == 1 ? ARITY(n->type) : 0;
+    if (n->function == cross) return vector_width(n->parameters[0]) == 3 && w == 3 ? 3 : 0;
+    return 1;
+}
+
+
+/* The arguments of a node, each evaluated once for all of its lanes. */
+typedef struct lane_values {
+    const te_expr *node;
+    const te_real *values;
+    int stride; /* Between lanes: TE_BLOCK, or 0 for scalars. */
+} lane_values;
+
+typedef struct lane_table {
+    const lane_values *entries;
+    int count;
+} lane_table;
+
+
+static void eval_lanes(const te_expr *n, const block *b, int len, int w, te_real *out);
+
+static void fold_block(const te_expr *n, te_real *out, const te_real *x, int len) {
+    /* Folds one of the variadic n's argument blocks into out. With x NULL, */
+    /* out holds the first argument's block, and is made ready for folding. */
+    const te_fun2 f = variadic_step(n);
+    int i;
+    if (!x) {
+        if (f == hypot) {
+            for (i = 0; i < len; ++i) out[i] = fabs(out[i]);
+        }
+        return;
+    }
+    if (f == add) {
+        for (i = 0; i < len; ++i) out[i] += x[i];
+    } else if (f == mul) {
+        for (i = 0; i < len; ++i) out[i] *= x[i];
+    } else if (f == minimum) {
+        for (i = 0; i < len; ++i) out[i] = x[i] < out[i] || x[i] != x[i] ? x[i] : out[i];
+    } else if (f == maximum) {
+        for (i = 0; i < len; ++i) out[i] = x[i] > out[i] || x[i] != x[i] ? x[i] : out[i];
+    } else {
+        for (i = 0; i < len; ++i) out[i] = f(out[i], x[i]);
+    }
+}
+
+
+static void eval_broadcast(const te_expr *n, const block *b, int len, int w, te_real *out) {
+    /* Writes lane l of n to out + l * TE_BLOCK, repeating scalars. */
+    block scalar = *b;
+    int l;
+    scalar.lane = -1;
+    scalar.known = 0;
+    if (vector_width(n) > 1) {
+        eval_lanes(n, &scalar, len, w, out);
+        return;
+    }
+    eval_block(n, &scalar, len, out);
+    for (l = 1; l < w; ++l) memcpy(out + l * TE_BLOCK, out, sizeof(te_real) * len);
+}
+
+
+static void eval_lanes(const te_expr *n, const block *b, int len, int w, te_real *out) {
+    /* Evaluates all w lanes of a vector valued n in one pass, writing lane l */
+    /* to out + l * TE_BLOCK. Each argument is evaluated once, so scalar */
+    /* parts shared by the components aren't repeated for every lane. */
+    block lanes = *b;
+    const int arity = ARITY(n->type);
+    int i, j, l;
+    lanes.known = 0;
+
+    if (TYPE_MASK(n->type) == TE_VECTOR_OP && n->function == vec) {
+        lanes.lane = -1;
+        for (l = 0; l < w; ++l) eval_block(n->parameters[l], &lanes, len, out + l * TE_BLOCK);
+        return;
+    }
+
+    if (TYPE_MASK(n->type) == TE_VECTOR_OP && n->function == cross) {
+        te_real x[3 * TE_BLOCK], y[3 * TE_BLOCK];
+        eval_broadcast(n->parameters[0], b, len, 3, x);
+        eval_broadcast(n->parameters[1], b, len, 3, y);
+        for (l = 0; l < 3; ++l) {
+            const te_real *x1 = x + (l + 1) % 3 * TE_BLOCK, *x2 = x + (l + 2) % 3 * TE_BLOCK;
+            const te_real *y1 = y + (l + 1) % 3 * TE_BLOCK, *y2 = y + (l + 2) % 3 * TE_BLOCK;
+            for (i = 0; i < len; ++i) out[l * TE_BLOCK + i] = x1[i] * y2[i] - x2[i] * y1[i];
+        }
+        return;
+    }
+
+    if (TYPE_MASK(n->type) == TE_FUNCTION3 && n->function == ternary && vector_width(n->parameters[0]) == 1) {
+        /* A scalar condition picks whole vectors, and like eval_block() */
+        /* only evaluates both branches when the rows need both. */
+        te_real c[TE_BLOCK], a[TE_VECTOR_MAX * TE_BLOCK];
+        int any = 0, all = 1;
+        lanes.lane = -1;
+        eval_block(n->parameters[0], &lanes, len, c);
+        for (i = 0; i < len; ++i) {
+            any |= c[i] != 0.0;
+            all &= c[i] != 0.0 && c[i] == c[i];
+        }
+        if (all || !any) {
+            eval_broadcast(n->parameters[all ? 1 : 2], b, len, w, out);
+            return;
+        }
+        eval_broadcast(n->parameters[1], b, len, w, a);
+        eval_broadcast(n->parameters[2], b, len, w, out);
+        for (l = 0; l < w; ++l) {
+            for (i = 0; i < len; ++i) {
+                te_real *o = out + l * TE_BLOCK + i;
+                *o = c[i] == c[i] ? (c[i] != 0.0 ? a[l * TE_BLOCK + i] : *o) : NAN;
+            }
+        }
+        return;
+    }
+
+    const int type = TYPE_MASK(n->type);
+    if (type == TE_VARIADIC) {
+        /* Folds each argument's lanes into the result's. */
+        te_real x[TE_VECTOR_MAX * TE_BLOCK];
+        eval_broadcast(n->parameters[0], b, len, w, out);
+        for (l = 0; l < w; ++l) fold_block(n, out + l * TE_BLOCK, 0, len);
+        for (j = 1; j < arity; ++j) {
+            eval_broadcast(n->parameters[j], b, len, w, x);
+            for (l = 0; l < w; ++l) fold_block(n, out + l * TE_BLOCK, x + l * TE_BLOCK, len);
+        }
+        if (n->function == mean) {
+            for (l = 0; l < w; ++l) {
+                for (i = 0; i < len; ++i) out[l * TE_BLOCK + i] /= arity;
+            }
+        }
+        return;
+    }
+
+    if (!(IS_FUNCTION(type) || IS_CLOSURE(type)) || !arity) {
+        /* Vector variables and loops go a lane at a time. */
+        for (l = 0; l < w; ++l) {
+            lanes.lane = l;
+            eval_block(n, &lanes, len, out + l * TE_BLOCK);
+        }
+        return;
+    }
+
+    /* The node itself is applied a lane at a time, over its arguments' lanes. */
+    lane_values entries[7];
+    te_real values[7 * TE_VECTOR_MAX * TE_BLOCK];
+    for (j = 0; j < arity; ++j) {
+        const te_expr *a = n->parameters[j];
+        te_real *v = values + j * w * TE_BLOCK;
+        entries[j].node = a;
+        entries[j].values = v;
+        if (vector_width(a) > 1) {
+            lanes.lane = -1;
+            eval_lanes(a, &lanes, len, w, v);
+            entries[j].stride = TE_BLOCK;
+        } else {
+            lanes.lane = -1;
+            eval_block(a, &lanes, len, v);
+            entries[j].stride = 0;
+        }
+    }
+
+    lane_table table;
+    table.entries = entries;
+    table.count = arity;
+    lanes.known = &table;
+    for (l = 0; l < w; ++l) {
+        lanes.lane = l;
+        eval_block(n, &lanes, len, out + l * TE_BLOCK);
+    }
+}
+
+
+static void eval_block_vector(const te_expr *n, const block *b, int len, te_real *out) {
+    /* Vector variables and vec() give the block's lane, and cross works out */
+    /* its lane from the others; other nodes with vector arguments go */
+    /* through eval_lanes(). dot and length evaluate their arguments' lanes */
+    /* together, and reduce them to a scalar. */
+    te_real x[TE_VECTOR_MAX * TE_BLOCK], y[TE_VECTOR_MAX * TE_BLOCK];
+    block lanes = *b;
+    int i, l;
+
+    if (n->function == vector_ref) {
+        const te_array *a = n->parameters[0];
+        const te_real v = b->lane >= 0 && b->lane < a->length ? a->data[b->lane] : NAN;
+        for (i = 0; i < len; ++i) out[i] = v;
+        return;
+    }
+
+    if (n->function == vec && b->lane >= 0 && b->lane < ARITY(n->type)) {
+        eval_block(n->parameters[b->lane], b, len, out);
+        return;
+    }
+
+    if (n->function == cross && b->lane >= 0 && b->lane < 3 && vector_width(n) == 3) {
+        lanes.lane = (b->lane + 1) % 3;
+        eval_block(n->parameters[0], &lanes, len, x);
+        lanes.lane = (b->lane + 2) % 3;
+        eval_block(n->parameters[1], &lanes, len, y);
+        for (i = 0; i < len; ++i) out[i] = x[i] * y[i];
+        eval_block(n->parameters[0], &lanes, len, x);
+        lanes.lane = (b->lane + 1) % 3;
+        eval_block(n->parameters[1], &lanes, len, y);
+        for (i = 0; i < len; ++i) out[i] -= x[i] * y[i];
+        return;
+    }
+
+    const int w = n->function == dot || n->function == length ? vector_width(n->parameters[0]) : 0;
+    if (!w || vector_width(n) != 1) {
+        for (i = 0; i < len; ++i) out[i] = NAN;
+        return;
+    }
+
+    eval_broadcast(n->parameters[0], b, len, w, x);
+    if (n->function == dot) eval_broadcast(n->parameters[1], b, len, w, y);
+
+    for (i = 0; i < len; ++i) out[i] = 0;
+    for (l = 0; l < w; ++l) {
+        const te_real *xl = x + l * TE_BLOCK, *yl = n->function == dot ? y + l * TE_BLOCK : xl;
+        for (i = 0; i < len; ++i) out[i] += xl[i] * yl[i];
+    }
+    if (n->function == length) {
+        for (i = 0; i < len; ++i) out[i] = sqrt(out[i]);
+    }
+}
+
+
+static void eval_block(const te_expr *n, const block *b, int len, te_real *out) {
+    int i;
+
+    if (b->known) {
+        /* An argument of the node eval_lanes() is applying. */
+        for (i = 0; i < b->known->count; ++i) {
+            const lane_values *k = b->known->entries + i;
+            if (k->node == n) {
+                memcpy(out, k->values + (b->lane > 0 ? b->lane : 0) * k->stride, sizeof(te_real) * len);
+                return;
+            }
+        }
+    }
+
+    if (n->type & TE_FLAG_INTEGER) {
+        /* Exact as in te_eval(), with the rows that don't fit in floating point. */
+        int64_t exact[TE_BLOCK];
+        int sign[TE_BLOCK];
+        unsigned char ok[TE_BLOCK];
+        eval_block_integer(n, b, len, exact, sign, ok);
+        for (i = 0; i < len && ok[i]; ++i) {}
+        if (i < len) eval_block_call(n, b, len, out);
+        for (i = 0; i < len; ++i) {
+            if (ok[i]) out[i] = integer_real(exact[i], sign[i]);
+        }
+        return;
+    }
+
+    if (n->type & TE_FLAG_BATCH) {
+        /* One call for the whole block. */
+        te_real args[7][TE_BLOCK];
+        const te_real *a[7];
+        for (i = 0; i < ARITY(n->type); ++i) {
+            eval_block(n->parameters[i], b, len, args[i]);
+            a[i] = args[i];
+        }
+        call_batch(n, a, out, len);
+        return;
+    }
+
+    if (n->type & TE_FLAG_MEMO) {
+        /* Every row goes through the cache. */
+        eval_block_call(n, b, len, out);
+        return;
+    }
+
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT:
+            for (i = 0; i < len; ++i) out[i] = n->value;
+            return;
+
+        case TE_VARIABLE: {
+            int offset;
+            const te_column *column = find_column(b, n->bound, &offset);
+            if (column) {
+                load_column(column, offset, len, out);
+            } else {
+                const te_real value = *n->bound;
+                for (i = 0; i < len; ++i) out[i] = value;
+            }
+            return;
+        }
+
+        case TE_FUNCTION1: {
+            /* Unary functions are applied in place. */
+            eval_block(n->parameters[0], b, len, out);
+            if (n->function == negate) {
+                for (i = 0; i < len; ++i) out[i] = -out[i];
+            } else if (n->function == square) {
+                for (i = 0; i < len; ++i) out[i] *= out[i];
+            } else {
+                te_real (*f)(te_real) = TE_FUN(te_real);
+                for (i = 0; i < len; ++i) out[i] = f(out[i]);
+            }
+            return;
+        }
+
+        case TE_FUNCTION2: {
+            /* The infix operators get tight loops the compiler can vectorize. */
+            te_real right[TE_BLOCK];
+            eval_block(n->parameters[0], b, len, out);
+            eval_block(n->parameters[1], b, len, right);
+            if (n->function == add) {
+                for (i = 0; i < len; ++i) out[i] += right[i];
+            } else if (n->function == sub) {
+                for (i = 0; i < len; ++i) out[i] -= right[i];
+            } else if (n->function == mul) {
+                for (i = 0; i < len; ++i) out[i] *= right[i];
+            } else if (n->function == divide) {
+                for (i = 0; i < len; ++i) out[i] /= right[i];
+            } else if (n->function == comma) {
+                memcpy(out, right, sizeof(te_real) * len);
+            } else if (n->function == lower) {
+                for (i = 0; i < len; ++i) out[i] = out[i] < right[i];
+            } else if (n->function == lower_eq) {
+                for (i = 0; i < len; ++i) out[i] = out[i] <= right[i];
+            } else if (n->function == greater) {
+                for (i = 0; i < len; ++i) out[i] = out[i] > right[i];
+            } else if (n->function == greater_eq) {
+                for (i = 0; i < len; ++i) out[i] = out[i] >= right[i];
+            } else if (n->function == equal) {
+                for (i = 0; i < len; ++i) out[i] = out[i] == right[i];
+            } else if (n->function == not_equal) {
+                for (i = 0; i < len; ++i) out[i] = out[i] != right[i];
+            } else if (n->function == logical_and) {
+                for (i = 0; i < len; ++i) out[i] = (out[i] != 0.0) & (right[i] != 0.0);
+            } else if (n->function == logical_or) {
+                for (i = 0; i < len; ++i) out[i] = (out[i] != 0.0) | (right[i] != 0.0);
+            } else {
+                te_fun2 f = TE_FUN(te_real, te_real);
+                for (i = 0; i < len; ++i) out[i] = f(out[i], right[i]);
+            }
+            return;
+        }
+
+        case TE_FUNCTION3:
+            if (n->function == ternary) {
+                /* Both branches are only evaluated when the block needs both, */
+                /* then blended without branching. */
+                te_real a[TE_BLOCK], c[TE_BLOCK];
+                int any = 0, all = 1;
+                eval_block(n->parameters[0], b, len, c);
+                for (i = 0; i < len; ++i) {
+                    any |= c[i] != 0.0;
+                    all &= c[i] != 0.0 && c[i] == c[i];
+                }
+                if (all) {
+                    eval_block(n->parameters[1], b, len, out);
+                } else if (!any) {
+                    eval_block(n->parameters[2], b, len, out);
+                } else {
+                    eval_block(n->parameters[1], b, len, a);
+                    eval_block(n->parameters[2], b, len, out);
+                    for (i = 0; i < len; ++i) out[i] = c[i] != 0.0 ? a[i] : out[i];
+                    for (i = 0; i < len; ++i) out[i] = c[i] == c[i] ? out[i] : NAN;
+                }
+                return;
+            }
+            eval_block_call(n, b, len, out);
+            return;
+
+        case TE_VARIADIC: {
+            /* Folds each argument's block into the result. */
+            te_real x[TE_BLOCK];
+            const int count = ARITY(n->type);
+            int j;
+            eval_block(n->parameters[0], b, len, out);
+            fold_block(n, out, 0, len);
+            for (j = 1; j < count; ++j) {
+                eval_block(n->parameters[j], b, len, x);
+                fold_block(n, out, x, len);
+            }
+            if (n->function == mean) {
+                for (i = 0; i < len; ++i) out[i] /= count;
+            }
+            return;
+        }
+
+        case TE_LOOP:
+            eval_block_loop(n, b, len, out);
+            return;
+
+        case TE_VECTOR_OP:
+            eval_block_vector(n, b, len, out);
+            return;
+
+        case TE_CLOSURE0:
+            if (n->function == vector_ref) {
+                eval_block_vector(n, b, len, out);
+                return;
+            }
+            eval_block_call(n, b, len, out);
+            return;
+
+        case TE_FUNCTION0:
+            if (n->function == unif || n->function == normal) {
+                draw_block(n->function, len, out);
+                return;
+            }
+            eval_block_call(n, b, len, out);
+            return;
+
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+        case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+            eval_block_call(n, b, len, out);
+            return;
+
+        default:
+            for (i = 0; i < len; ++i) out[i] = NAN;
+            return;
+    }
+}
+
+#undef TE_FUN
+#undef M
+
+
+static te_real eval_row(const te_expr *n, int lane) {
+    /* Evaluates one lane of n as a single row, with variables read in place. */
+    te_real ret;
+    block b;
+    b.columns = 0;
+    b.column_count = 0;
+    b.offset = 0;
+    b.lane = lane;
+    b.known = 0;
+    b.parent = 0;
+    eval_block(n, &b, 1, &ret);
+    return ret;
+}
+
+
+int te_eval_vector(const te_expr *n, te_real *out) {
+    const int w = n ? vector_width(n) : 0;
+    int l;
+    if (w <= 1) {
+        out[0] = w ? te_eval(n) : NAN;
+        return w;
+    }
+    te_real lanes[TE_VECTOR_MAX * TE_BLOCK];
+    block b;
+    b.columns = 0;
+    b.column_count = 0;
+    b.offset = 0;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+    eval_lanes(n, &b, 1, w, lanes);
+    for (l = 0; l < w; ++l) out[l] = lanes[l * TE_BLOCK];
+    return w;
+}
+
+
+void te_eval_batch(const te_expr *n, const te_column *columns, int column_count, int rows, te_real *out) {
+    block b;
+    b.columns = columns;
+    b.column_count = column_count;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+
+    for (b.offset = 0; b.offset < rows; b.offset += TE_BLOCK) {
+        const int len = rows - b.offset < TE_BLOCK ? rows - b.offset : TE_BLOCK;
+        if (n) {
+            eval_block(n, &b, len, out + b.offset);
+        } else {
+            int i;
+            for (i = 0; i < len; ++i) out[b.offset + i] = NAN;
+        }
+    }
+}
+
+
+void te_eval_strided(const te_expr *n, const te_column *columns, int column_count, int rows, te_real *out, int stride) {
+    te_real values[TE_BLOCK];
+    char *dest = (char*)out;
+    int i;
+
+    block b;
+    b.columns = columns;
+    b.column_count = column_count;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+
+    if (!stride) stride = sizeof(te_real);
+    for (b.offset = 0; b.offset < rows; b.offset += TE_BLOCK) {
+        const int len = rows - b.offset < TE_BLOCK ? rows - b.offset : TE_BLOCK;
+        if (n) {
+            eval_block(n, &b, len, values);
+        } else {
+            for (i = 0; i < len; ++i) values[i] = NAN;
+        }
+        for (i = 0; i < len; ++i) *(te_real*)(dest + (size_t)(b.offset + i) * stride) = values[i];
+    }
+}
+
+
+void te_reduce(const te_expr *n, const te_column *columns, int column_count, int rows, int ops, te_reduction *result) {
+    /* Block sums are combined pairwise, like a binary counter, so the */
+    /* rounding error grows with log(rows) rather than rows. */
+    te_real partial[32];
+    int level[32];
+    int depth = 0;
+
+    te_real values[TE_BLOCK];
+    te_real lo = INFINITY, hi = -INFINITY;
+    int count = 0;
+
+    const int want_sum = ops & (TE_REDUCE_SUM | TE_REDUCE_MEAN);
+
+    block b;
+    b.columns = columns;
+    b.column_count = column_count;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+
+    for (b.offset = 0; b.offset < rows && n; b.offset += TE_BLOCK) {
+        const int len = rows - b.offset < TE_BLOCK ? rows - b.offset : TE_BLOCK;
+        int i;
+
+        eval_block(n, &b, len, values);
+
+        for (i = 0; i < len; ++i) {
+            const te_real v = values[i];
+            count += (v == v);
+            lo = v < lo ? v : lo;
+            hi = v > hi ? v : hi;
+        }
+
+        if (want_sum) {
+            int width;
+            for (i = 0; i < len; ++i) {
+                if (values[i] != values[i]) values[i] = 0;
+            }
+            for (i = len; i < TE_BLOCK; ++i) values[i] = 0;
+            for (width = TE_BLOCK / 2; width; width /= 2) {
+                for (i = 0; i < width; ++i) values[i] += values[i + width];
+            }
+
+            partial[depth] = values[0];
+            level[depth++] = 0;
+            while (depth > 1 && level[depth-1] == level[depth-2]) {
+                partial[depth-2] += partial[depth-1];
+                ++level[depth-2];
+                --depth;
+            }
+        }
+    }
+
+    te_real sum = 0;
+    while (depth) sum += partial[--depth];
+
+    memset(result, 0, sizeof(te_reduction));
+    if (ops & TE_REDUCE_SUM) result->sum = sum;
+    if (ops & TE_REDUCE_MIN) result->min = count ? lo : NAN;
+    if (ops & TE_REDUCE_MAX) result->max = count ? hi : NAN;
+    if (ops & TE_REDUCE_MEAN) result->mean = count ? sum / count : NAN;
+    if (ops & TE_REDUCE_COUNT) result->count = count;
+}
+
+static int select_block(const te_expr *n, const block *b, int len, unsigned char *keep) {
+    /* A row is selected when its value is neither zero nor NaN. */
+    te_real values[TE_BLOCK];
+    int i, count = 0;
+
+    eval_block(n, b, len, values);
+    for (i = 0; i < len; ++i) {
+        keep[i] = (values[i] != 0.0) & (values[i] == values[i]);
+        count += keep[i];
+    }
+    return count;
+}
+
+
+int te_filter(const te_expr *n, const te_column *columns, int column_count, int rows, unsigned char *bitmap) {
+    unsigned char keep[TE_BLOCK];
+    int count = 0;
+
+    block b;
+    b.columns = columns;
+    b.column_count = column_count;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+
+    memset(bitmap, 0, (rows + 7) / 8);
+    for (b.offset = 0; b.offset < rows && n; b.offset += TE_BLOCK) {
+        const int len = rows - b.offset < TE_BLOCK ? rows - b.offset : TE_BLOCK;
+        int i, k;
+
+        /* TE_BLOCK is a multiple of 8, so every block starts on a byte. */
+        count += select_block(n, &b, len, keep);
+        for (i = 0; i < len; i += 8) {
+            unsigned char bits = 0;
+            for (k = 0; k < 8 && i + k < len; ++k) bits |= keep[i + k] << k;
+            bitmap[(b.offset + i) / 8] = bits;
+        }
+    }
+
+    return count;
+}
+
+
+int te_select(const te_expr *n, const te_column *columns, int column_count, int rows, int *selection) {
+    unsigned char keep[TE_BLOCK];
+    int count = 0;
+
+    block b;
+    b.columns = columns;
+    b.column_count = column_count;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+
+    for (b.offset = 0; b.offset < rows && n; b.offset += TE_BLOCK) {
+        const int len = rows - b.offset < TE_BLOCK ? rows - b.offset : TE_BLOCK;
+        int i;
+
+        select_block(n, &b, len, keep);
+        for (i = 0; i < len; ++i) {
+            /* Always store, only advance on a match: no branch per row. */
+            selection[count] = b.offset + i;
+            count += keep[i];
+        }
+    }
+
+    return count;
+}
+
+static int rle_block(const te_rle_column *columns, int column_count, int *run, int *used, int rows, int longest, te_real *values, int *lengths) {
+    /* Splits the next rows into up to TE_BLOCK runs over which no column changes, */
+    /* none longer than longest. Writes the value of column j in run k to */
+    /* values[j * TE_BLOCK + k]. */
+    int j, k;
+
+    for (k = 0; k < TE_BLOCK && rows > 0; ++k) {
+        int len = rows < longest ? rows : longest;
+        for (j = 0; j < column_count; ++j) {
+            const te_rle_column *c = columns + j;
+            while (run[j] < c->runs && used[j] >= c->lengths[run[j]]) {
+                ++run[j];
+                used[j] = 0;
+            }
+            if (run[j] < c->runs) {
+                values[j * TE_BLOCK + k] = c->values[run[j]];
+                if (c->lengths[run[j]] - used[j] < len) len = c->lengths[run[j]] - used[j];
+            } else {
+                values[j * TE_BLOCK + k] = NAN;
+            }
+        }
+        for (j = 0; j < column_count; ++j) used[j] += len;
+        lengths[k] = len;
+        rows -= len;
+    }
+
+    return k;
+}
+
+
+static int eval_rle(const te_expr *n, const te_rle_column *columns, int column_count, int rows, te_real *out, te_real *values, int *lengths, int capacity) {
+    /* Evaluates once per run of rows over which no column changes, or once per row */
+    /* if n isn't pure. Expands the results to out if it is given, else merges */
+    /* them into at most capacity runs. Returns the number of runs, or -1. */
+    char *memory = malloc(column_count * (sizeof(te_column) + sizeof(te_real) * TE_BLOCK + sizeof(int) * 2) + 1);
+    if (!memory) return -1;
+
+    te_column *dense = (te_column*)memory;
+    te_real *buffer = (te_real*)(dense + column_count);
+    int *run = (int*)(buffer + column_count * TE_BLOCK);
+    int *used = run + column_count;
+
+    int i, j, row = 0, count = 0;
+    const int longest = !n || pure_tree(n) ? INT_MAX : 1;
+    memset(dense, 0, sizeof(te_column) * column_count);
+    for (j = 0; j < column_count; ++j) {
+        dense[j].address = columns[j].address;
+        dense[j].data = buffer + j * TE_BLOCK;
+        run[j] = used[j] = 0;
+    }
+
+    block b;
+    b.columns = dense;
+    b.column_count = column_count;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+    b.offset = 0;
+
+    te_real results[TE_BLOCK];
+    int len[TE_BLOCK];
+
+    while (row < rows) {
+        const int k = rle_block(columns, column_count, run, used, rows - row, longest, buffer, len);
+        if (n) {
+            eval_block(n, &b, k, results);
+        } else {
+            for (i = 0; i < k; ++i) results[i] = NAN;
+        }
+
+        for (i = 0; i < k; ++i) {
+            if (out) {
+                for (j = 0; j < len[i]; ++j) out[row + j] = results[i];
+            } else if (count && memcmp(values + count - 1, results + i, sizeof(te_real)) == 0) {
+                lengths[count - 1] += len[i];
+            } else if (count < capacity) {
+                values[count] = results[i];
+                lengths[count++] = len[i];
+            } else {
+                free(memory);
+                return -1;
+            }
+            row += len[i];
+        }
+    }
+
+    free(memory);
+    return count;
+}
+
+
+void te_eval_rle(const te_expr *n, const te_rle_column *columns, int column_count, int rows, te_real *out) {
+    if (eval_rle(n, columns, column_count, rows, out, 0, 0, 0) < 0) {
+        int i;
+        for (i = 0; i < rows; ++i) out[i] = NAN;
+    }
+}
+
+
+int te_eval_rle_runs(const te_expr *n, const te_rle_column *columns, int column_count, int rows, te_real *values, int *lengths, int capacity) {
+    return eval_rle(n, columns, column_count, rows, 0, values, lengths, capacity);
+}
+
+
+static void eval_dict_rows(const te_expr *n, const te_dict_column *columns, int column_count, int rows, te_real *out) {
+    /* Decodes and evaluates the rows a block at a time. */
+    char *memory = malloc(column_count * (sizeof(te_column) + sizeof(te_real) * TE_BLOCK) + 1);
+    te_column *dense = (te_column*)memory;
+    te_real *values = (te_real*)(dense + column_count);
+    int i, j, row;
+
+    block b;
+    b.columns = dense;
+    b.column_count = column_count;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+    b.offset = 0;
+
+    if (memory) memset(dense, 0, sizeof(te_column) * column_count);
+    for (row = 0; row < rows; row += TE_BLOCK) {
+        const int len = rows - row < TE_BLOCK ? rows - row : TE_BLOCK;
+        if (!memory || !n) {
+            for (i = 0; i < len; ++i) out[row + i] = NAN;
+            continue;
+        }
+        for (j = 0; j < column_count; ++j) {
+            const te_dict_column *c = columns + j;
+            te_real *v = values + j * TE_BLOCK;
+            for (i = 0; i < len; ++i) v[i] = c->dictionary[c->codes[row + i]];
+            dense[j].address = c->address;
+            dense[j].data = v;
+        }
+        eval_block(n, &b, len, out + row);
+    }
+
+    free(memory);
+}
+
+
+void te_eval_dict(const te_expr *n, const te_dict_column *columns, int column_count, int rows, te_real *out) {
+    /* Pure expressions are evaluated once for every combination of dictionary */
+    /* entries, unless there are more combinations than rows. */
+    te_real combinations = 1;
+    int i, j, stride;
+    for (j = 0; j < column_count; ++j) combinations *= columns[j].size;
+
+    char *memory = 0;
+    if (combinations <= rows && n && pure_tree(n)) {
+        memory = malloc(column_count * sizeof(te_column) + (column_count + 1) * sizeof(te_real) * (size_t)combinations + 1);
+    }
+    if (!memory) {
+        eval_dict_rows(n, columns, column_count, rows, out);
+        return;
+    }
+
+    /* Column j of the table cycles through its dictionary with a stride of */
+    /* the product of the sizes before it, like the digits of a number. */
+    const int size = (int)combinations;
+    te_column *dense = (te_column*)memory;
+    te_real *table = (te_real*)(dense + column_count);
+    memset(dense, 0, sizeof(te_column) * column_count);
+    for (j = 0, stride = 1; j < column_count; stride *= columns[j++].size) {
+        const te_dict_column *c = columns + j;
+        te_real *v = table + (j + 1) * size;
+        for (i = 0; i < size; ++i) v[i] = c->dictionary[(i / stride) % c->size];
+        dense[j].address = c->address;
+        dense[j].data = v;
+    }
+    te_eval_batch(n, dense, column_count, size, table);
+
+    for (i = 0; i < rows; ++i) {
+        int index = 0;
+        for (j = 0, stride = 1; j < column_count; stride *= columns[j++].size) {
+            index += columns[j].codes[i] * stride;
+        }
+        out[i] = table[index];
+    }
+
+    free(memory);
+}
+
+
+/* Interval evaluation bounds the values te_eval() can return. Since the */
+/* results of the arithmetic and of libm are monotone wherever the exact */
+/* functions are, bounds are found by evaluating at endpoints and extrema. */
+typedef struct interval {
+    te_real lo, hi;
+    int nan; /* Nonzero if NaN is also possible. An interval with lo > hi is always NaN. */
+} interval;
+
+#define IV_EMPTY(a) ((a).lo > (a).hi)
+#define IV_CAN_ZERO(a) ((a).lo <= 0 && (a).hi >= 0)
+#define IV_CAN_NONZERO(a) ((a).nan || (a).lo < 0 || (a).hi > 0)
+#define IV_ALL iv(-INFINITY, INFINITY, 1)
+
+static interval iv(te_real lo, te_real hi, int nan) {
+    interval r;
+    r.lo = lo;
+    r.hi = hi;
+    r.nan = nan;
+    return r;
+}
+
+static interval iv_point(te_real v) {
+    return v == v ? iv(v, v, 0) : iv(INFINITY, -INFINITY, 1);
+}
+
+static interval iv_hull(interval a, interval b) {
+    return iv(a.lo < b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi, a.nan || b.nan);
+}
+
+static interval iv_bool(int can_true, int can_false) {
+    return iv(can_false ? 0 : 1, can_true ? 1 : 0, 0);
+}
+
+static interval iv_clamp(interval a, te_real lo, te_real hi) {
+    /* Restricts a to a function's domain; values outside of it give NaN. */
+    if (a.lo < lo) {a.lo = lo; a.nan = 1;}
+    if (a.hi > hi) {a.hi = hi; a.nan = 1;}
+    return a;
+}
+
+static interval iv_monotone(te_real (*f)(te_real), interval a, int increasing) {
+    if (IV_EMPTY(a)) return a;
+    return increasing ? iv(f(a.lo), f(a.hi), a.nan) : iv(f(a.hi), f(a.lo), a.nan);
+}
+
+static interval iv_corners(te_fun2 f, interval a, interval b) {
+    /* For functions monotone in each argument the extremes are at the corners. */
+    const te_real c[4] = {f(a.lo, b.lo), f(a.lo, b.hi), f(a.hi, b.lo), f(a.hi, b.hi)};
+    interval r = iv(INFINITY, -INFINITY, a.nan || b.nan);
+    int i;
+    for (i = 0; i < 4; ++i) {
+        if (c[i] != c[i]) {r.nan = 1; continue;}
+        if (c[i] < r.lo) r.lo = c[i];
+        if (c[i] > r.hi) r.hi = c[i];
+    }
+    return IV_EMPTY(r) ? IV_ALL : r;
+}
+
+static int iv_contains_periodic(interval a, te_real point, te_real period) {
+    /* Whether a contains point + k * period for some integer k. */
+    return point + ceil((a.lo - point) / period) * period <= a.hi;
+}
+
+static interval iv_sincos(te_real (*f)(te_real), interval a, te_real peak) {
+    /* f is 1 at peak and -1 half a period later. */
+    if (IV_EMPTY(a)) return a;
+    if (a.lo == -INFINITY || a.hi == INFINITY) return iv(-1, 1, 1);
+    if (a.hi - a.lo >= 2 * pi()) return iv(-1, 1, a.nan);
+
+    const te_real x = f(a.lo), y = f(a.hi);
+    interval r = iv(x < y ? x : y, x > y ? x : y, a.nan);
+    if (iv_contains_periodic(a, peak, 2 * pi())) r.hi = 1;
+    if (iv_contains_periodic(a, peak + pi(), 2 * pi())) r.lo = -1;
+    return r;
+}
+
+static interval iv_pow(interval a, interval b) {
+    interval r;
+    if (IV_EMPTY(a) || IV_EMPTY(b)) {
+        r = iv(INFINITY, -INFINITY, 1);
+    } else if (a.lo >= 0) {
+        r = iv_corners(pow, a, b);
+    } else if (b.lo == b.hi && b.lo == floor(b.lo) && !b.nan) {
+        /* Integer powers of a possibly negative base. */
+        const te_real p = b.lo;
+        if (fmod(p, 2) == 0) {
+            const te_real m = a.hi > 0 ? (-a.lo > a.hi ? -a.lo : a.hi) : -a.lo;
+            r = iv_corners(pow, iv(a.hi >= 0 ? 0 : -a.hi, m, a.nan), b);
+        } else if (p > 0) {
+            r = iv(pow(a.lo, p), pow(a.hi, p), a.nan);
+        } else if (a.hi < 0) {
+            r = iv(pow(a.hi, p), pow(a.lo, p), a.nan);
+        } else {
+            r = iv(-INFINITY, INFINITY, a.nan);
+        }
+    } else {
+        r = IV_ALL;
+    }
+
+    /* pow(NaN, 0) and pow(1, NaN) are both 1. */
+    if ((a.nan && IV_CAN_ZERO(b)) || (b.nan && a.lo <= 1 && a.hi >= 1)) {
+        r = iv_hull(r, iv_point(1));
+    }
+    return r;
+}
+
+static interval iv_compare(const void *f, interval a, interval b) {
+    const int real = !IV_EMPTY(a) && !IV_EMPTY(b);
+    const int nan = a.nan || b.nan || !real;
+    int can_true = 0, can_false = 0;
+
+    if (real) {
+        if (f == lower) {
+            can_true = a.lo < b.hi; can_false = a.hi >= b.lo;
+        } else if (f == lower_eq) {
+            can_true = a.lo <= b.hi; can_false = a.hi > b.lo;
+        } else if (f == greater) {
+            can_true = a.hi > b.lo; can_false = a.lo <= b.hi;
+        } else if (f == greater_eq) {
+            can_true = a.hi >= b.lo; can_false = a.lo < b.hi;
+        } else {
+            const int overlap = a.lo <= b.hi && b.lo <= a.hi;
+            const int same = a.lo == a.hi && b.lo == b.hi && a.lo == b.lo;
+            can_true = f == equal ? overlap : !same;
+            can_false = f == equal ? !same : overlap;
+        }
+    }
+
+    /* Every comparison with NaN is false, except for !=. */
+    if (nan) {
+        if (f == not_equal) can_true = 1;
+        else can_false = 1;
+    }
+
+    return iv_bool(can_true, can_false);
+}
+
+static interval iv_function(const void *f, int arity, const interval *a) {
+    /* Bounds for the builtins and infix operators. */
+    if (arity == 1) {
+        const interval x = a[0];
+        if (f == negate) return iv(-x.hi, -x.lo, x.nan);
+        if (IV_EMPTY(x)) return x;
+
+        if (f == square) return iv_pow(x, iv_point(2));
+        if (f == fabs) {
+            if (x.lo >= 0) return x;
+            if (x.hi <= 0) return iv(-x.hi, -x.lo, x.nan);
+            return iv(0, -x.lo > x.hi ? -x.lo : x.hi, x.nan);
+        }
+        if (f == cosh) {
+            if (x.lo >= 0) return iv_monotone(cosh, x, 1);
+            if (x.hi <= 0) return iv_monotone(cosh, x, 0);
+            return iv(1, cosh(-x.lo > x.hi ? x.lo : x.hi), x.nan);
+        }
+        if (f == atan || f == ceil || f == floor || f == exp || f == sinh || f == tanh) {
+            return iv_monotone((te_real(*)(te_real))f, x, 1);
+        }
+        if (f == acos) return iv_monotone(acos, iv_clamp(x, -1, 1), 0);
+        if (f == asin) return iv_monotone(asin, iv_clamp(x, -1, 1), 1);
+        if (f == fac || f == log || f == log10 || f == sqrt) {
+            return iv_monotone((te_real(*)(te_real))f, iv_clamp(x, 0, INFINITY), 1);
+        }
+        if (f == cos) return iv_sincos(cos, x, 0);
+        if (f == sin) return iv_sincos(sin, x, pi() / 2);
+        if (f == tan) {
+            const int inf = x.lo == -INFINITY || x.hi == INFINITY;
+            if (inf || x.hi - x.lo >= pi() || iv_contains_periodic(x, pi() / 2, pi())) {
+                return iv(-INFINITY, INFINITY, x.nan || inf);
+            }
+            return iv_monotone(tan, x, 1);
+        }
+    } else if (arity == 2) {
+        const interval x = a[0], y = a[1];
+        if (f == lower || f == lower_eq || f == greater || f == greater_eq || f == equal || f == not_equal) {
+            return iv_compare(f, x, y);
+        }
+        if (f == logical_and) {
+            return iv_bool(IV_CAN_NONZERO(x) && IV_CAN_NONZERO(y), IV_CAN_ZERO(x) || IV_CAN_ZERO(y));
+        }
+        if (f == logical_or) {
+            return iv_bool(IV_CAN_NONZERO(x) || IV_CAN_NONZERO(y), IV_CAN_ZERO(x) && IV_CAN_ZERO(y));
+        }
+        if (f == comma) return y;
+        if (f == pow) return iv_pow(x, y);
+        if (IV_EMPTY(x) || IV_EMPTY(y)) return iv(INFINITY, -INFINITY, 1);
+
+        if (f == minimum) return iv(x.lo < y.lo ? x.lo : y.lo, x.hi < y.hi ? x.hi : y.hi, x.nan || y.nan);
+        if (f == maximum) return iv(x.lo > y.lo ? x.lo : y.lo, x.hi > y.hi ? x.hi : y.hi, x.nan || y.nan);
+        if (f == hypot) {
+            /* Increasing in the magnitude of both arguments. */
+            const interval ax = iv_function(fabs, 1, &x), ay = iv_function(fabs, 1, &y);
+            return iv(hypot(ax.lo, ay.lo), hypot(ax.hi, ay.hi), x.nan || y.nan);
+        }
+
+        if (f == add || f == sub || f == mul) return iv_corners((te_fun2)f, x, y);
+        if (f == divide) {
+            if (IV_CAN_ZERO(y)) return IV_ALL;
+            return iv_corners(divide, x, y);
+        }
+        if (f == fmod) {
+            /* The result has the sign of x and is smaller than |y|. */
+            const int nan = x.nan || y.nan || IV_CAN_ZERO(y) || x.lo == -INFINITY || x.hi == INFINITY;
+            const te_real m = -y.lo > y.hi ? -y.lo : y.hi;
+            const te_real least = y.lo > 0 ? y.lo : (y.hi < 0 ? -y.hi : 0);
+            if ((x.lo >= 0 && x.hi < least) || (x.hi <= 0 && -x.lo < least)) return iv(x.lo, x.hi, nan);
+            return iv(x.lo >= 0 ? 0 : (x.lo > -m ? x.lo : -m), x.hi <= 0 ? 0 : (x.hi < m ? x.hi : m), nan);
+        }
+        if (f == atan2) {
+            /* Continuous unless the box touches the origin or the negative x axis. */
+            if (y.lo <= 0 && x.lo <= 0 && x.hi >= 0) return iv(-pi(), pi(), x.nan || y.nan);
+            return iv_corners(atan2, x, y);
+        }
+        if (f == ncr || f == npr) {
+            /* Valid results are whole numbers of at least 1. */
+            if (x.hi < 0 || y.hi < 0 || y.lo > x.hi) return iv(INFINITY, -INFINITY, 1);
+            return iv(1, INFINITY, x.nan || y.nan || x.lo < 0 || y.lo < 0 || y.hi > x.lo);
+        }
+    } else if (arity == 3 && f == ternary) {
+        /* Either branch that the condition allows, or NaN with a NaN condition. */
+        interval r = iv(INFINITY, -INFINITY, a[0].nan);
+        if (a[0].lo < 0 || a[0].hi > 0) r = iv_hull(r, a[1]);
+        if (IV_CAN_ZERO(a[0])) r = iv_hull(r, a[2]);
+        return r;
+    } else if (arity == 0) {
+        if (f == unif) return iv(0, 1, 0);
+        if (f == normal) return iv(-INFINITY, INFINITY, 0);
+    }
+
+    return IV_ALL;
+}
+
+
+static interval iv_node(const te_expr *n, const interval *a) {
+    /* Bounds a function node from the bounds of its arguments. */
+    const int arity = ARITY(n->type);
+    te_real v[7];
+    int i, points = 1;
+
+    for (i = 0; i < arity; ++i) {
+        if (a[i].lo == a[i].hi && !a[i].nan) v[i] = a[i].lo;
+        else if (IV_EMPTY(a[i]) && a[i].nan) v[i] = NAN;
+        else points = 0;
+    }
+
+    /* Pure functions of known arguments have a known value. */
+    if (IS_PURE(n->type) && points) return iv_point(call(n, v));
+    if (IS_CLOSURE(n->type)) return IV_ALL;
+    return iv_function(n->function, arity, a);
+}
+
+
+static interval eval_interval(const te_expr *n, const te_range *ranges, int range_count, int fixed) {
+    /* With fixed set, variables without a range keep their current value, */
+    /* otherwise they could be anything. */
+    int i;
+
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return iv_point(n->value);
+
+        case TE_VARIABLE:
+            for (i = 0; i < range_count; ++i) {
+                if (ranges[i].address == n->bound) return iv(ranges[i].lo, ranges[i].hi, 0);
+            }
+            return fixed ? iv_point(*n->bound) : IV_ALL;
+
+        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7: {
+            interval a[7];
+            for (i = 0; i < ARITY(n->type); ++i) {
+                a[i] = eval_interval(n->parameters[i], ranges, range_count, fixed);
+            }
+            return iv_node(n, a);
+        }
+
+        case TE_VARIADIC: {
+            const int count = ARITY(n->type);
+            const te_fun2 f = variadic_step(n);
+            interval a[2];
+            a[0] = eval_interval(n->parameters[0], ranges, range_count, fixed);
+            if (f == hypot) a[0] = iv_function(fabs, 1, a);
+            for (i = 1; i < count; ++i) {
+                a[1] = eval_interval(n->parameters[i], ranges, range_count, fixed);
+                a[0] = iv_function(f, 2, a);
+            }
+            return n->function == mean ? iv(a[0].lo / count, a[0].hi / count, a[0].nan) : a[0];
+        }
+
+        default: return IV_ALL;
+    }
+}
+
+
+int te_eval_interval(const te_expr *n, const te_range *ranges, int range_count, te_real *lo, te_real *hi) {
+    const interval r = n ? eval_interval(n, ranges, range_count, 1) : iv_point(NAN);
+    *lo = IV_EMPTY(r) ? NAN : r.lo;
+    *hi = IV_EMPTY(r) ? NAN : r.hi;
+    return r.nan;
+}
+
+
+static int same_tree(const te_expr *a, const te_expr *b) {
+    /* Whether two subtrees always evaluate to the same value. */
+    int i;
+    if (a->type != b->type) return 0;
+
+    switch(TYPE_MASK(a->type)) {
+        case TE_CONSTANT: return memcmp(&a->value, &b->value, sizeof(te_real)) == 0;
+        case TE_VARIABLE: return a->bound == b->bound;
+        default:
+            if (!IS_PURE(a->type) || a->function != b->function) return 0;
+            if (IS_CLOSURE(a->type) && a->parameters[ARITY(a->type)] != b->parameters[ARITY(a->type)]) return 0;
+            for (i = 0; i < ARITY(a->type); ++i) {
+                if (!same_tree(a->parameters[i], b->parameters[i])) return 0;
+            }
+            return 1;
+    }
+}
+
+
+static int integral(const te_expr *n) {
+    /* Whether n only evaluates to whole numbers, infinities or NaN. */
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return n->value == floor(n->value);
+        case TE_FUNCTION1:
+            if (n->function == floor || n->function == ceil || n->function == fac) return 1;
+            if (n->function == negate || n->function == fabs || n->function == square) return integral(n->parameters[0]);
+            return 0;
+        case TE_FUNCTION2:
+            if (n->function == ncr || n->function == npr) return 1;
+            if (n->function == lower || n->function == lower_eq || n->function == greater || n->function == greater_eq ||
+                n->function == equal || n->function == not_equal || n->function == logical_and || n->function == logical_or) return 1;
+            if (n->function == add || n->function == sub || n->function == mul || n->function == fmod) {
+                return integral(n->parameters[0]) && integral(n->parameters[1]);
+            }
+            return 0;
+        case TE_FUNCTION3:
+            if (n->function == ternary) return integral(n->parameters[1]) && integral(n->parameters[2]);
+            return 0;
+        default: return 0;
+    }
+}
+
+
+static te_expr *refine(te_expr *n, const te_range *ranges, int range_count, interval *r) {
+    /* Simplifies n bottom-up using the bounds of its arguments. */
+    /* Returns the node that replaces n, which may be n itself. */
+    interval a[7];
+    int i;
+
+    if (TYPE_MASK(n->type) == TE_CONSTANT || TYPE_MASK(n->type) == TE_VARIABLE) {
+        *r = eval_interval(n, ranges, range_count, 0);
+        return n;
+    }
+
+    if (TYPE_MASK(n->type) == TE_LOOP || TYPE_MASK(n->type) == TE_VECTOR_OP) {
+        /* A loop's index and holders stay, anything else can be simplified. */
+        for (i = 0; i < ARITY(n->type); ++i) {
+            if (TYPE_MASK(n->type) == TE_VECTOR_OP || (i && (i < 4 || i % 2))) {
+                n->parameters[i] = refine(n->parameters[i], ranges, range_count, a);
+            }
+        }
+        *r = IV_ALL;
+        return n;
+    }
+
+    if (TYPE_MASK(n->type) == TE_VARIADIC) {
+        const int count = ARITY(n->type);
+        for (i = 0; i < count; ++i) {
+            n->parameters[i] = refine(n->parameters[i], ranges, range_count, a + 1);
+            a[0] = i ? iv_function(variadic_step(n), 2, a) : variadic_step(n) == hypot ? iv_function(fabs, 1, a + 1) : a[1];
+        }
+        *r = n->function == mean ? iv(a[0].lo / count, a[0].hi / count, a[0].nan) : a[0];
+        if (r->lo == r->hi && !r->nan && pure_tree(n)) {
+            te_free_parameters(n);
+            n->type = TE_CONSTANT;
+            n->value = r->lo;
+        }
+        return n;
+    }
+
+    for (i = 0; i < ARITY(n->type); ++i) {
+        n->parameters[i] = refine(n->parameters[i], ranges, range_count, a + i);
+    }
+    *r = iv_node(n, a);
+
+    /* Anything pure that can only take one value is a constant. */
+    if (r->lo == r->hi && !r->nan && pure_tree(n)) {
+        te_free_parameters(n);
+        n->type = TE_CONSTANT;
+        n->value = r->lo;
+        return n;
+    }
+
+    if (!IS_PURE(n->type) || IS_CLOSURE(n->type)) return n;
+    te_expr *arg = n->parameters[0];
+
+    if (n->function == fabs) {
+        if (a[0].lo >= 0) {
+            free(n);
+            return arg;
+        }
+        if (a[0].hi <= 0) n->function = negate;
+    } else if (n->function == floor || n->function == ceil) {
+        if (integral(arg)) {
+            free(n);
+            return arg;
+        }
+    } else if (n->function == pow && ((te_expr*)n->parameters[1])->type == TE_CONSTANT) {
+        const te_real p = ((te_expr*)n->parameters[1])->value;
+        if (p == 1) {
+            te_free(n->parameters[1]);
+            free(n);
+            return arg;
+        }
+        if (p == 2 || (p == 0.5 && a[0].lo >= 0)) {
+            te_free(n->parameters[1]);
+            n->type = TE_FUNCTION1 | TE_FLAG_PURE;
+            n->function = p == 2 ? square : sqrt;
+        }
+    } else if (n->function == ternary && !a[0].nan && (!IV_CAN_ZERO(a[0]) || (a[0].lo == 0 && a[0].hi == 0))) {
+        /* The condition always picks the same branch. */
+        const int taken = IV_CAN_ZERO(a[0]) ? 2 : 1;
+        te_expr *branch = n->parameters[taken];
+        te_free(arg);
+        te_free(n->parameters[3 - taken]);
+        free(n);
+        return branch;
+    } else if ((n->function == equal || n->function == not_equal) && !a[0].nan && same_tree(arg, n->parameters[1])) {
+        /* A NaN guard on something that cannot be NaN. */
+        const te_real value = n->function == equal;
+        te_free_parameters(n);
+        n->type = TE_CONSTANT;
+        n->value = value;
+        *r = iv_point(value);
+    }
+
+    return n;
+}
+
+
+te_expr *te_optimize(te_expr *n, const te_range *ranges, int range_count) {
+    interval r;
+    if (!n) return 0;
+    n = refine(n, ranges, range_count, &r);
+    mark_integer(n);
+    return n;
+}
+
+
+/* A set computes each subtree its expressions have in common once, into */
+/* a holder, and the copies become variables bound to the holder. */
+/* common[i] may use holders of later entries, so they're evaluated last */
+/* to first. */
+/* Affine expressions are taken out of roots, which become NULL, and packed */
+/* into a sparse matrix in CSR form: output outputs[k] is offsets[k] plus */
+/* values[j] times pool variable columns[j] for j from starts[k] to */
+/* starts[k + 1]. */
+struct te_set {
+    int count, shared;
+    te_expr **roots;
+    te_expr **holders, **common;
+
+    int affine, pool_size;
+    int *outputs, *starts, *columns;
+    te_real *values, *offsets;
+    const te_real **pool;
+    te_real *loads;
+};
+
+/* Marks the nodes of copies that were replaced, until they're freed. */
+enum {TE_FLAG_DROPPED = 1 << 15};
+
+typedef struct cse_node {
+    te_expr **slot;
+    te_expr *node;
+    unsigned long hash;
+    int size;
+} cse_node;
+
+
+static int count_nodes(const te_expr *n) {
+    int i, count = 1;
+    for (i = 0; i < ARITY(n->type); ++i) count += count_nodes(n->parameters[i]);
+    return count;
+}
+
+
+static unsigned long cse_collect(te_expr **slot, cse_node *list, int *count, int *size, int *pure) {
+    /* Records the pure subtrees below slot, and returns a hash of its */
+    /* structure. Loops aren't looked into, since their bodies depend on */
+    /* the index. */
+    te_expr *n = *slot;
+    unsigned long h = n->type;
+    int i;
+
+    *size = 1;
+    *pure = 1;
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: {
+            unsigned char bytes[sizeof(te_real)];
+            memcpy(bytes, &n->value, sizeof(te_real));
+            for (i = 0; i < (int)sizeof(te_real); ++i) h = h * 131 + bytes[i];
+            return h;
+        }
+        case TE_VARIABLE: return h * 131 + (unsigned long)(size_t)n->bound;
+        case TE_LOOP:
+            *pure = 0;
+            return (unsigned long)(size_t)n;
+    }
+
+    h = h * 131 + (unsigned long)(size_t)n->function;
+    if (IS_CLOSURE(n->type)) h = h * 131 + (unsigned long)(size_t)n->parameters[ARITY(n->type)];
+    *pure = IS_PURE(n->type);
+    for (i = 0; i < ARITY(n->type); ++i) {
+        int s, p;
+        h = h * 131 + cse_collect((te_expr**)&n->parameters[i], list, count, &s, &p);
+        *size += s;
+        *pure &= p;
+    }
+
+    if (*pure) {
+        list[*count].slot = slot;
+        list[*count].node = n;
+        list[*count].hash = h;
+        list[*count].size = *size;
+        ++*count;
+    }
+    return h;
+}
+
+
+static int cse_order(const void *a, const void *b) {
+    /* Largest first, so copies are shared whole rather than in pieces. */
+    const cse_node *x = a, *y = b;
+    if (x->size != y->size) return y->size - x->size;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+
+static int cse_live(const cse_node *c) {
+    return *c->slot == c->node && !(c->node->type & TE_FLAG_DROPPED);
+}
+
+
+static void drop(te_expr *n) {
+    int i;
+    n->type |= TE_FLAG_DROPPED;
+    for (i = 0; i < ARITY(n->type); ++i) drop(n->parameters[i]);
+}
+
+
+static te_expr *holder_variable(te_set *set) {
+    /* Adds a holder, and returns a variable bound to it. */
+    te_expr *holder = new_expr(TE_CONSTANT, 0), *var = new_expr(TE_VARIABLE, 0);
+    te_expr **holders = realloc(set->holders, sizeof(te_expr*) * (set->shared + 1));
+    if (holders) set->holders = holders;
+    te_expr **common = realloc(set->common, sizeof(te_expr*) * (set->shared + 1));
+    if (common) set->common = common;
+    if (!holder || !var || !holders || !common) {
+        free(holder);
+        free(var);
+        return 0;
+    }
+    holder->value = NAN;
+    var->bound = &holder->value;
+    set->holders[set->shared] = holder;
+    set->common[set->shared] = 0;
+    return var;
+}
+
+
+typedef struct affine_term {
+    const te_real *address;
+    int row, column;
+    te_real value;
+} affine_term;
+
+typedef struct affine_list {
+    affine_term *terms;
+    int count, capacity;
+} affine_list;
+
+
+static int affine_terms(const te_expr *n, te_real scale, int row, affine_list *list, te_real *offset) {
+    /* Adds scale times n to the terms of row if n is affine. */
+    int i;
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT:
+            *offset += scale * n->value;
+            return 1;
+
+        case TE_VARIABLE:
+            if (list->count == list->capacity) {
+                affine_term *grown = realloc(list->terms, sizeof(affine_term) * (list->capacity = list->capacity ? list->capacity * 2 : 64));
+                if (!grown) return 0;
+                list->terms = grown;
+            }
+            list->terms[list->count].address = n->bound;
+            list->terms[list->count].row = row;
+            list->terms[list->count].value = scale;
+            ++list->count;
+            return 1;
+
+        case TE_FUNCTION1:
+            if (n->function != negate) return 0;
+            return affine_terms(n->parameters[0], -scale, row, list, offset);
+
+        case TE_FUNCTION2: {
+            const te_expr *a = n->parameters[0], *b = n->parameters[1];
+            if (n->function == add || n->function == sub) {
+                return affine_terms(a, scale, row, list, offset) &&
+                    affine_terms(b, n->function == add ? scale : -scale, row, list, offset);
+            }
+            /* Constant factors, but not ones that could turn into NaN. */
+            if (n->function == mul && TYPE_MASK(a->type) == TE_CONSTANT && isfinite(a->value)) {
+                return affine_terms(b, scale * a->value, row, list, offset);
+            }
+            if ((n->function == mul || n->function == divide) && TYPE_MASK(b->type) == TE_CONSTANT && isfinite(b->value) && b->value != 0) {
+                return affine_terms(a, n->function == mul ? scale * b->value : scale / b->value, row, list, offset);
+            }
+            return 0;
+        }
+
+        case TE_VARIADIC:
+            if (n->function != total && n->function != mean) return 0;
+            if (n->function == mean) scale /= ARITY(n->type);
+            for (i = 0; i < ARITY(n->type); ++i) {
+                if (!affine_terms(n->parameters[i], scale, row, list, offset)) return 0;
+            }
+            return 1;
+
+        default: return 0;
+    }
+}
+
+
+static int by_address(const void *a, const void *b) {
+    const affine_term *x = a, *y = b;
+    return x->address < y->address ? -1 : x->address > y->address;
+}
+
+
+static int by_position(const void *a, const void *b) {
+    const affine_term *x = a, *y = b;
+    if (x->row != y->row) return x->row - y->row;
+    return x->column - y->column;
+}
+
+
+static void pack_affine(te_set *set) {
+    /* Moves affine roots into the sparse matrix. Running out of memory */
+    /* leaves them as they are. */
+    affine_list list = {0, 0, 0};
+    int i, j, k, rows = 0;
+
+    set->outputs = malloc(sizeof(int) * (set->count + 1));
+    set->offsets = malloc(sizeof(te_real) * (set->count + 1));
+    set->starts = malloc(sizeof(int) * (set->count + 2));
+    if (!set->outputs || !set->offsets || !set->starts) goto fail;
+
+    for (i = 0; i < set->count; ++i) {
+        const int start = list.count;
+        te_real offset = 0;
+        if (affine_terms(set->roots[i], 1, rows, &list, &offset)) {
+            set->outputs[rows] = i;
+            set->offsets[rows++] = offset;
+        } else {
+            list.count = start;
+        }
+    }
+    if (!rows) goto fail;
+
+    /* Each distinct variable is one column, loaded once per evaluation. */
+    qsort(list.terms, list.count, sizeof(affine_term), by_address);
+    set->pool = malloc(sizeof(te_real*) * (list.count + 1));
+    set->loads = malloc(sizeof(te_real) * (list.count + 1));
+    set->columns = malloc(sizeof(int) * (list.count + 1));
+    set->values = malloc(sizeof(te_real) * (list.count + 1));
+    if (!set->pool || !set->loads || !set->columns || !set->values) goto fail;
+    for (k = 0; k < list.count; ++k) {
+        if (!k || list.terms[k].address != list.terms[k - 1].address) set->pool[set->pool_size++] = list.terms[k].address;
+        list.terms[k].column = set->pool_size - 1;
+    }
+
+    /* Terms of the same variable in a row are added up. */
+    qsort(list.terms, list.count, sizeof(affine_term), by_position);
+    for (i = 0, j = 0, k = 0; i <= rows; ++i) {
+        set->starts[i] = k;
+        for (; j < list.count && list.terms[j].row == i; ++j) {
+            if (k > set->starts[i] && set->columns[k - 1] == list.terms[j].column) {
+                set->values[k - 1] += list.terms[j].value;
+            } else {
+                set->columns[k] = list.terms[j].column;
+                set->values[k++] = list.terms[j].value;
+            }
+        }
+    }
+
+    for (i = 0; i < rows; ++i) {
+        te_free(set->roots[set->outputs[i]]);
+        set->roots[set->outputs[i]] = 0;
+    }
+    set->affine = rows;
+    free(list.terms);
+    return;
+
+fail:
+    free(list.terms);
+    free(set->outputs);
+    free(set->offsets);
+    free(set->starts);
+    free(set->pool);
+    free(set->loads);
+    free(set->columns);
+    free(set->values);
+    set->outputs = set->starts = set->columns = 0;
+    set->offsets = set->values = set->loads = 0;
+    set->pool = 0;
+    set->pool_size = 0;
+}
+
+
+static void share(te_set *set) {
+    /* Finds copies among subtrees of equal size and hash. Running out of */
+    /* memory just leaves the rest unshared. */
+    int total = 0, count = 0, dropped_count = 0, i, j, k, m;
+    for (i = 0; i < set->count; ++i) {
+        if (set->roots[i]) total += count_nodes(set->roots[i]);
+    }
+    if (!total) return;
+
+    cse_node *list = malloc(sizeof(cse_node) * total);
+    te_expr **dropped = malloc(sizeof(te_expr*) * total);
+    if (!list || !dropped) {
+        free(list);
+        free(dropped);
+        return;
+    }
+
+    for (i = 0; i < set->count; ++i) {
+        int size, pure;
+        if (set->roots[i]) cse_collect(&set->roots[i], list, &count, &size, &pure);
+    }
+    qsort(list, count, sizeof(cse_node), cse_order);
+
+    for (i = 0; i < count; i = j) {
+        for (j = i + 1; j < count && list[j].hash == list[i].hash && list[j].size == list[i].size; ++j);
+
+        for (k = i; k < j; ++k) {
+            if (!cse_live(list + k)) continue;
+            for (m = k + 1; m < j; ++m) {
+                if (cse_live(list + m) && same_tree(list[k].node, list[m].node)) break;
+            }
+            if (m == j) continue;
+
+            te_expr *var = holder_variable(set);
+            if (!var) goto done;
+            set->common[set->shared++] = list[k].node;
+            *list[k].slot = var;
+
+            for (; m < j; ++m) {
+                if (!cse_live(list + m) || !same_tree(list[k].node, list[m].node)) continue;
+                te_expr *copy = new_expr(TE_VARIABLE, 0);
+                if (!copy) goto done;
+                copy->bound = var->bound;
+                *list[m].slot = copy;
+                drop(list[m].node);
+                dropped[dropped_count++] = list[m].node;
+            }
+        }
+    }
+
+done:
+    for (i = 0; i < dropped_count; ++i) te_free(dropped[i]);
+    free(dropped);
+    free(list);
+}
+
+
+te_set *te_compile_set(const char *const *expressions, int count, const te_variable *variables, int var_count, int *error) {
+    int i;
+    te_set *set = calloc(1, sizeof(te_set));
+    if (set) set->roots = calloc(count > 0 ? count : 1, sizeof(te_expr*));
+    if (!set || !set->roots) {
+        free(set);
+        if (error) *error = -1;
+        return 0;
+    }
+
+    set->count = count;
+    for (i = 0; i < count; ++i) {
+        set->roots[i] = te_compile(expressions[i], variables, var_count, error);
+        if (!set->roots[i]) {
+            te_free_set(set);
+            return 0;
+        }
+    }
+
+    pack_affine(set);
+    share(set);
+    return set;
+}
+
+
+void te_eval_set(const te_set *set, te_real *out) {
+    int i, j;
+
+    /* The affine outputs are a sparse matrix times the variables. */
+    for (j = 0; j < set->pool_size; ++j) set->loads[j] = *set->pool[j];
+    for (i = 0; i < set->affine; ++i) {
+        te_real y = set->offsets[i];
+        for (j = set->starts[i]; j < set->starts[i + 1]; ++j) y += set->values[j] * set->loads[set->columns[j]];
+        out[set->outputs[i]] = y;
+    }
+
+    for (i = set->shared - 1; i >= 0; --i) set->holders[i]->value = te_eval(set->common[i]);
+    for (i = 0; i < set->count; ++i) {
+        if (set->roots[i]) out[i] = te_eval(set->roots[i]);
+    }
+}
+
+
+void te_free_set(te_set *set) {
+    int i;
+    if (!set) return;
+    for (i = 0; i < set->count; ++i) te_free(set->roots[i]);
+    for (i = 0; i < set->shared; ++i) {
+        te_free(set->common[i]);
+        free(set->holders[i]);
+    }
+    free(set->roots);
+    free(set->holders);
+    free(set->common);
+    free(set->outputs);
+    free(set->offsets);
+    free(set->starts);
+    free(set->pool);
+    free(set->loads);
+    free(set->columns);
+    free(set->values);
+    free(set);
+}
+
+
+/* Forward-mode differentiation evaluates every node's derivative with */
+/* respect to one seed variable alongside its value, a block at a time. */
+/* Loop holders are bound to their derivatives in a list of tangents; any */
+/* other variable has a derivative of 1 if it's the seed and 0 if not. */
+typedef struct tangent {
+    const te_real *address;
+    const te_real *d;
+    const struct tangent *next;
+} tangent;
+
+/* Step for central differences, about the cube root of the rounding error. */
+#ifdef TE_FLOAT
+#define TE_DIFF_STEP 5e-3
+#else
+#define TE_DIFF_STEP 6e-6
+#endif
+
+
+static te_real chain(te_real derivative, te_real d) {
+    /* Arguments that don't depend on the seed contribute nothing, */
+    /* even where the function's derivative is infinite or NaN. */
+    return d == 0 ? 0 : derivative * d;
+}
+
+
+static void eval_dual(const te_expr *n, const block *b, int len, const te_real *seed, const tangent *t, te_real *v, te_real *d);
+
+
+static int builtin_partials(const te_expr *n, const te_real *x, te_real v, te_real *p) {
+    /* Writes the partial derivatives of a builtin at x, where it has the */
+    /* value v. Returns 0 for functions it doesn't know. */
+    const void *f = n->function;
+    if (IS_CLOSURE(n->type) || (n->type & TE_FLAG_PARTIALS)) return 0;
+
+    switch (ARITY(n->type)) {
+        case 0: return 1;
+
+        case 1:
+            if (f == negate) p[0] = -1;
+            else if (f == square) p[0] = 2 * x[0];
+            else if (f == fabs) p[0] = x[0] > 0 ? 1 : x[0] < 0 ? -1 : 0;
+            else if (f == ceil || f == floor || f == fac) p[0] = 0;
+            else if (f == acos) p[0] = -1 / sqrt(1 - x[0] * x[0]);
+            else if (f == asin) p[0] = 1 / sqrt(1 - x[0] * x[0]);
+            else if (f == atan) p[0] = 1 / (1 + x[0] * x[0]);
+            else if (f == cos) p[0] = -sin(x[0]);
+            else if (f == sin) p[0] = cos(x[0]);
+            else if (f == tan) p[0] = 1 + v * v;
+            else if (f == cosh) p[0] = sinh(x[0]);
+            else if (f == sinh) p[0] = cosh(x[0]);
+            else if (f == tanh) p[0] = 1 - v * v;
+            else if (f == exp) p[0] = v;
+            else if (f == log) p[0] = 1 / x[0];
+            else if (f == log10) p[0] = 1 / (x[0] * (te_real)log(10.0));
+            else if (f == sqrt) p[0] = 1 / (2 * v);
+            else return 0;
+            return 1;
+
+        case 2:
+            if (f == add) {p[0] = 1; p[1] = 1;}
+            else if (f == sub) {p[0] = 1; p[1] = -1;}
+            else if (f == mul) {p[0] = x[1]; p[1] = x[0];}
+            else if (f == divide) {p[0] = 1 / x[1]; p[1] = -v / x[1];}
+            else if (f == pow) {p[0] = x[1] * pow(x[0], x[1] - 1); p[1] = v * log(x[0]);}
+            else if (f == fmod) {p[0] = 1; p[1] = -trunc(x[0] / x[1]);}
+            else if (f == atan2) {
+                const te_real r = x[0] * x[0] + x[1] * x[1];
+                p[0] = x[1] / r;
+                p[1] = -x[0] / r;
+            }
+            else if (f == comma) {p[0] = 0; p[1] = 1;}
+            else if (f == greater || f == greater_eq || f == lower || f == lower_eq || f == equal || f == not_equal ||
+                     f == logical_and || f == logical_or || f == ncr || f == npr) {p[0] = 0; p[1] = 0;}
+            else return 0;
+            return 1;
+
+        default: return 0;
+    }
+}
+
+
+static te_real user_partial(const te_expr *n, te_real *x, int i) {
+    /* User functions give their partial derivatives, or else they're */
+    /* estimated from two more calls. x is restored afterwards. */
+    const te_real xi = x[i], h = TE_DIFF_STEP * (1 + fabs(xi));
+    te_real ret;
+
+    if (n->type & TE_FLAG_PARTIALS) {
+        if (IS_CLOSURE(n->type)) {
+            return ((te_real(*)(void*, const te_real*, int))PARTIALS(n))(n->parameters[ARITY(n->type)], x, i);
+        }
+        return ((te_real(*)(const te_real*, int))PARTIALS(n))(x, i);
+    }
+
+    x[i] = xi + h;
+    ret = call(n, x);
+    x[i] = xi - h;
+    ret = (ret - call(n, x)) / (2 * h);
+    x[i] = xi;
+    return ret;
+}
+
+
+static void eval_dual_function(const te_expr *n, const block *b, int len, const te_real *seed, const tangent *t, te_real *v, te_real *d) {
+    te_real a[7][TE_BLOCK], da[7][TE_BLOCK];
+    const int arity = ARITY(n->type);
+    int i, j;
+
+    if (n->function == ternary && TYPE_MASK(n->type) == TE_FUNCTION3) {
+        eval_block(n->parameters[0], b, len, a[0]);
+        eval_dual(n->parameters[1], b, len, seed, t, a[1], da[1]);
+        eval_dual(n->parameters[2], b, len, seed, t, a[2], da[2]);
+        for (i = 0; i < len; ++i) {
+            const te_real c = a[0][i];
+            v[i] = c != c ? NAN : c != 0.0 ? a[1][i] : a[2][i];
+            d[i] = c != c ? NAN : c != 0.0 ? da[1][i] : da[2][i];
+        }
+        return;
+    }
+
+    if (arity == 0) {
+        eval_block(n, b, len, v);
+        for (i = 0; i < len; ++i) d[i] = 0;
+        return;
+    }
+
+    for (j = 0; j < arity; ++j) eval_dual(n->parameters[j], b, len, seed, t, a[j], da[j]);
+    for (i = 0; i < len; ++i) {
+        te_real x[7], p[7];
+        for (j = 0; j < arity; ++j) x[j] = a[j][i];
+        v[i] = call(n, x);
+        d[i] = 0;
+
+        if (builtin_partials(n, x, v[i], p)) {
+            for (j = 0; j < arity; ++j) d[i] += chain(p[j], da[j][i]);
+        } else {
+            /* Only arguments that depend on the seed cost extra calls. */
+            for (j = 0; j < arity; ++j) {
+                if (da[j][i] != 0) d[i] += user_partial(n, x, j) * da[j][i];
+            }
+        }
+    }
+}
+
+
+static void eval_dual_variadic(const te_expr *n, const block *b, int len, const te_real *seed, const tangent *t, te_real *v, te_real *d) {
+    te_real x[TE_BLOCK], dx[TE_BLOCK];
+    const int count = ARITY(n->type);
+    const te_fun2 f = variadic_step(n);
+    int i, j;
+
+    eval_dual(n->parameters[0], b, len, seed, t, v, d);
+    for (i = 0; i < len && f == hypot; ++i) {
+        if (v[i] < 0) {
+            v[i] = -v[i];
+            d[i] = -d[i];
+        }
+    }
+    for (j = 1; j < count; ++j) {
+        eval_dual(n->parameters[j], b, len, seed, t, x, dx);
+        for (i = 0; i < len; ++i) {
+            if (f == add) {
+                v[i] += x[i];
+                d[i] += dx[i];
+            } else if (f == mul) {
+                d[i] = chain(x[i], d[i]) + chain(v[i], dx[i]);
+                v[i] *= x[i];
+            } else if (f == hypot) {
+                const te_real h = hypot(v[i], x[i]);
+                d[i] = chain(v[i] / h, d[i]) + chain(x[i] / h, dx[i]);
+                v[i] = h;
+            } else if (x[i] != x[i] || (f == minimum ? x[i] < v[i] : x[i] > v[i])) {
+                /* min and max take the derivative of the argument they pick. */
+                v[i] = x[i];
+                d[i] = dx[i];
+            }
+        }
+    }
+    if (n->function == mean) {
+        for (i = 0; i < len; ++i) {
+            v[i] /= count;
+            d[i] /= count;
+        }
+    }
+}
+
+
+static void eval_dual_loop(const te_expr *n, const block *b, int len, const te_real *seed, const tangent *t, te_real *v, te_real *d) {
+    /* Like eval_block_loop(), with the hoisted values' derivatives as */
+    /* tangents. The index doesn't depend on the seed. */
+    const int extra = 1 + (ARITY(n->type) - 4) / 2;
+    te_real from[TE_BLOCK], to[TE_BLOCK], x[TE_BLOCK], dx[TE_BLOCK];
+    te_real values[(1 + TE_LOOP_HOLDERS) * TE_BLOCK], derivatives[(1 + TE_LOOP_HOLDERS) * TE_BLOCK];
+    te_column columns[1 + TE_LOOP_HOLDERS];
+    tangent tangents[1 + TE_LOOP_HOLDERS];
+    long counts[TE_BLOCK], most = 0, k;
+    int i, j;
+    const tangent *inner_t = t;
+
+    memset(columns, 0, sizeof(columns));
+    for (j = 0; j < extra; ++j) {
+        const te_real *address = &((te_expr*)n->parameters[j ? 2 + 2 * j : 0])->value;
+        columns[j].address = address;
+        columns[j].data = values + j * TE_BLOCK;
+        if (j) {
+            eval_dual(n->parameters[3 + 2 * j], b, len, seed, t, values + j * TE_BLOCK, derivatives + j * TE_BLOCK);
+            tangents[j].address = address;
+            tangents[j].d = derivatives + j * TE_BLOCK;
+            tangents[j].next = inner_t;
+            inner_t = tangents + j;
+        }
+    }
+
+    block inner;
+    inner.columns = columns;
+    inner.column_count = extra;
+    inner.offset = 0;
+    inner.lane = b->lane;
+    inner.known = 0;
+    inner.parent = b;
+
+    eval_block(n->parameters[1], b, len, from);
+    eval_block(n->parameters[2], b, len, to);
+    for (i = 0; i < len; ++i) {
+        const te_real steps = floor(to[i] - from[i]) + 1;
+        counts[i] = steps <= TE_LOOP_MAX ? (steps > 0 ? (long)steps : 0) : -1;
+        if (counts[i] > most) most = counts[i];
+        v[i] = n->function == mul ? 1 : 0;
+        d[i] = 0;
+    }
+
+    for (k = 0; k < most; ++k) {
+        for (i = 0; i < len; ++i) values[i] = from[i] + k;
+        eval_dual(n->parameters[3], &inner, len, seed, inner_t, x, dx);
+        for (i = 0; i < len; ++i) {
+            if (k >= counts[i]) continue;
+            if (n->function == mul) {
+                d[i] = chain(x[i], d[i]) + chain(v[i], dx[i]);
+                v[i] *= x[i];
+            } else {
+                v[i] += x[i];
+                d[i] += dx[i];
+            }
+        }
+    }
+
+    for (i = 0; i < len; ++i) {
+        if (counts[i] < 0) v[i] = d[i] = NAN;
+    }
+}
+
+
+static void eval_dual_vector(const te_expr *n, const block *b, int len, const te_real *seed, const tangent *t, te_real *v, te_real *d) {
+    /* Like eval_block_vector(). Vector variables don't depend on the seed. */
+    te_real x[TE_BLOCK], dx[TE_BLOCK], y[TE_BLOCK], dy[TE_BLOCK];
+    block lanes = *b;
+    int i, l;
+
+    if (n->function == vector_ref) {
+        eval_block(n, b, len, v);
+        for (i = 0; i < len; ++i) d[i] = 0;
+        return;
+    }
+
+    if (n->function == vec && b->lane >= 0 && b->lane < ARITY(n->type)) {
+        eval_dual(n->parameters[b->lane], b, len, seed, t, v, d);
+        return;
+    }
+
+    if (n->function == cross && b->lane >= 0 && b->lane < 3 && vector_width(n) == 3) {
+        int sign;
+        for (i = 0; i < len; ++i) v[i] = d[i] = 0;
+        for (sign = 1; sign >= -1; sign -= 2) {
+            lanes.lane = (b->lane + (sign > 0 ? 1 : 2)) % 3;
+            eval_dual(n->parameters[0], &lanes, len, seed, t, x, dx);
+            lanes.lane = (b->lane + (sign > 0 ? 2 : 1)) % 3;
+            eval_dual(n->parameters[1], &lanes, len, seed, t, y, dy);
+            for (i = 0; i < len; ++i) {
+                v[i] += sign * x[i] * y[i];
+                d[i] += sign * (chain(y[i], dx[i]) + chain(x[i], dy[i]));
+            }
+        }
+        return;
+    }
+
+    const int w = n->function == dot || n->function == length ? vector_width(n->parameters[0]) : 0;
+    if (!w || vector_width(n) != 1) {
+        for (i = 0; i < len; ++i) v[i] = d[i] = NAN;
+        return;
+    }
+
+    for (i = 0; i < len; ++i) v[i] = d[i] = 0;
+    for (l = 0; l < w; ++l) {
+        lanes.lane = l;
+        eval_dual(n->parameters[0], &lanes, len, seed, t, x, dx);
+        if (n->function == dot) {
+            eval_dual(n->parameters[1], &lanes, len, seed, t, y, dy);
+        } else {
+            memcpy(y, x, sizeof(te_real) * len);
+            memcpy(dy, dx, sizeof(te_real) * len);
+        }
+        for (i = 0; i < len; ++i) {
+            v[i] += x[i] * y[i];
+            d[i] += chain(y[i], dx[i]) + chain(x[i], dy[i]);
+        }
+    }
+    if (n->function == length) {
+        for (i = 0; i < len; ++i) {
+            v[i] = sqrt(v[i]);
+            d[i] = chain(1 / (2 * v[i]), d[i]);
+        }
+    }
+}
+
+
+static void eval_dual(const te_expr *n, const block *b, int len, const te_real *seed, const tangent *t, te_real *v, te_real *d) {
+    int i;
+
+    if (n->type & TE_FLAG_INTEGER) {
+        /* The value is exact as in eval_block(). */
+        eval_dual_function(n, b, len, seed, t, v, d);
+        eval_block(n, b, len, v);
+        return;
+    }
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT:
+            for (i = 0; i < len; ++i) {
+                v[i] = n->value;
+                d[i] = 0;
+            }
+            return;
+
+        case TE_VARIABLE: {
+            const tangent *u = t;
+            while (u && u->address != n->bound) u = u->next;
+            eval_block(n, b, len, v);
+            for (i = 0; i < len; ++i) d[i] = n->bound == seed ? 1 : u ? u->d[i] : 0;
+            return;
+        }
+
+        case TE_VARIADIC:
+            eval_dual_variadic(n, b, len, seed, t, v, d);
+            return;
+
+        case TE_LOOP:
+            eval_dual_loop(n, b, len, seed, t, v, d);
+            return;
+
+        case TE_VECTOR_OP:
+            eval_dual_vector(n, b, len, seed, t, v, d);
+            return;
+
+        case TE_CLOSURE0:
+            if (n->function == vector_ref) {
+                eval_dual_vector(n, b, len, seed, t, v, d);
+                return;
+            }
+            eval_dual_function(n, b, len, seed, t, v, d);
+            return;
+
+        case TE_CLOSURE1:
+            if (n->function == array_at) {
+                /* Elements are piecewise constant in the index. */
+                eval_block(n, b, len, v);
+                for (i = 0; i < len; ++i) d[i] = 0;
+                return;
+            }
+            eval_dual_function(n, b, len, seed, t, v, d);
+            return;
+
+        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+        case TE_CLOSURE2: case TE_CLOSURE3:
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+            eval_dual_function(n, b, len, seed, t, v, d);
+            return;
+
+        default:
+            for (i = 0; i < len; ++i) v[i] = d[i] = NAN;
+            return;
+    }
+}
+
+
+void te_eval_dual(const te_expr *n, const te_real *seed, te_real *value, te_real *derivative) {
+    block b;
+    b.columns = 0;
+    b.column_count = 0;
+    b.offset = 0;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+    if (n) {
+        eval_dual(n, &b, 1, seed, 0, value, derivative);
+    } else {
+        *value = *derivative = NAN;
+    }
+}
+
+
+void te_eval_dual_batch(const te_expr *n, const te_column *columns, int column_count, int rows, const te_real *seed, te_real *values, te_real *derivatives) {
+    block b;
+    b.columns = columns;
+    b.column_count = column_count;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+
+    for (b.offset = 0; b.offset < rows; b.offset += TE_BLOCK) {
+        const int len = rows - b.offset < TE_BLOCK ? rows - b.offset : TE_BLOCK;
+        if (n) {
+            eval_dual(n, &b, len, seed, 0, values + b.offset, derivatives + b.offset);
+        } else {
+            int i;
+            for (i = 0; i < len; ++i) values[b.offset + i] = derivatives[b.offset + i] = NAN;
+        }
+    }
+}
+
+
+/* Reverse-mode differentiation gives the derivatives with respect to many */
+/* variables at once. A forward pass evaluates the tree and records each */
+/* node's partial derivatives on a tape; a backward pass then carries the */
+/* result's adjoint down the tree, reading the tape from the top, and adds */
+/* it up at the variables. The tape's size is known from the tree, so it's */
+/* allocated once, before either pass. */
+typedef struct wrt {
+    const te_real *address;
+    int index;
+} wrt;
+
+/* The adjoints of the hoisted values of the loops being differentiated. */
+typedef struct adjoint_scope {
+    const te_expr *loop;
+    te_real *adjoints;
+    const struct adjoint_scope *next;
+} adjoint_scope;
+
+typedef struct gradient_state {
+    te_real *tape;
+    int top;
+    const wrt *variables;
+    int count;
+    te_real *gradient;
+    const adjoint_scope *scope;
+    const block *bindings; /* The loop indices and hoisted values, call-local. */
+} gradient_state;
+
+
+static int by_wrt(const void *a, const void *b) {
+    const wrt *x = a, *y = b;
+    if (x->address != y->address) return x->address < y->address ? -1 : 1;
+    return x->index - y->index;
+}
+
+
+static int is_step(const te_expr *n) {
+    /* Nodes with a derivative of zero wherever they have one. They're left */
+    /* to te_eval() and don't go on the tape. */
+    const void *f = n->function;
+    switch (TYPE_MASK(n->type)) {
+        case TE_FUNCTION0: case TE_CLOSURE0: return 1;
+        case TE_CLOSURE1: return f == array_at;
+        case TE_FUNCTION1: return f == ceil || f == floor || f == fac;
+        case TE_FUNCTION2:
+            return f == greater || f == greater_eq || f == lower || f == lower_eq || f == equal || f == not_equal ||
+                   f == logical_and || f == logical_or || f == ncr || f == npr;
+        default: return 0;
+    }
+}
+
+
+static int tape_size(const te_expr *n) {
+    const int arity = ARITY(n->type);
+    int i, size = 0, other;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: case TE_VARIABLE: case TE_VECTOR_OP: return 0;
+
+        case TE_LOOP:
+            /* The hoisted values' adjoints, then room to differentiate */
+            /* the body or the expression of a hoisted value. */
+            size = tape_size(n->parameters[3]);
+            for (i = 5; i < arity; i += 2) {
+                other = tape_size(n->parameters[i]);
+                if (other > size) size = other;
+            }
+            return (arity - 4) / 2 + size;
+
+        default: break;
+    }
+
+    if (is_step(n)) return 0;
+    if (n->function == ternary && TYPE_MASK(n->type) == TE_FUNCTION3) {
+        /* Which branch was taken, then that branch. */
+        size = tape_size(n->parameters[1]);
+        other = tape_size(n->parameters[2]);
+        return 1 + (other > size ? other : size);
+    }
+
+    for (i = 0; i < arity; ++i) size += tape_size(n->parameters[i]);
+    /* Variadics keep their arguments' values as well as the partials. */
+    return size + (TYPE_MASK(n->type) == TE_VARIADIC ? 2 : 1) * arity;
+}
+
+
+static te_real *adjoint_of(const gradient_state *g, const te_real *address) {
+    const adjoint_scope *s;
+    int lo = 0, hi = g->count;
+
+    for (s = g->scope; s; s = s->next) {
+        int i;
+        for (i = 4; i < ARITY(s->loop->type); i += 2) {
+            if (address == &((te_expr*)s->loop->parameters[i])->value) return s->adjoints + (i - 4) / 2;
+        }
+    }
+
+    /* Repeated variables add up at their first entry. */
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (g->variables[mid].address < address) lo = mid + 1; else hi = mid;
+    }
+    return lo < g->count && g->variables[lo].address == address ? g->gradient + g->variables[lo].index : 0;
+}
+
+
+static te_real tape_eval(const te_expr *n, const gradient_state *g) {
+    /* Like te_eval(), with the bound loop values of the gradient's own. */
+    te_real ret;
+    eval_block(n, g->bindings, 1, &ret);
+    return ret;
+}
+
+
+static te_real tape_forward(const te_expr *n, gradient_state *g) {
+    const int arity = ARITY(n->type);
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return n->value;
+        case TE_VARIABLE: case TE_VECTOR_OP: return tape_eval(n, g);
+
+        case TE_LOOP:
+            /* The loop's room on the tape is only used going backward. */
+            g->top += tape_size(n);
+            return tape_eval(n, g);
+
+        case TE_VARIADIC: {
+            te_real *x = g->tape + g->top, *p, v;
+            const te_fun2 f = variadic_step(n);
+            int pick = 0;
+
+            g->top += arity;
+            for (i = 0; i < arity; ++i) x[i] = tape_forward(n->parameters[i], g);
+            p = g->tape + g->top;
+            g->top += arity;
+
+            v = f == hypot ? fabs(x[0]) : x[0];
+            for (i = 1; i < arity; ++i) {
+                if (f != add && f != mul && f != hypot && (x[i] != x[i] || (f == minimum ? x[i] < v : x[i] > v))) pick = i;
+                v = f(v, x[i]);
+            }
+
+            if (f == mul) {
+                /* Products of the arguments before each one, then after it. */
+                te_real after = 1;
+                p[0] = 1;
+                for (i = 1; i < arity; ++i) p[i] = p[i - 1] * x[i - 1];
+                for (i = arity - 1; i >= 0; --i) {
+                    p[i] *= after;
+                    after *= x[i];
+                }
+            } else {
+                for (i = 0; i < arity; ++i) {
+                    p[i] = f == add ? 1 : f == hypot ? x[i] / v : i == pick;
+                }
+            }
+
+            if (n->function == mean) {
+                for (i = 0; i < arity; ++i) p[i] /= arity;
+                return v / arity;
+            }
+            return v;
+        }
+
+        default: break;
+    }
+
+    if (is_step(n)) return tape_eval(n, g);
+
+    if (n->function == ternary && TYPE_MASK(n->type) == TE_FUNCTION3) {
+        const te_real c = tape_eval(n->parameters[0], g);
+        const int branch = c != c ? 0 : c != 0.0 ? 1 : 2;
+        const te_real v = branch ? tape_forward(n->parameters[branch], g) : NAN;
+        g->tape[g->top++] = branch;
+        return v;
+    }
+
+    te_real x[7], v;
+    for (i = 0; i < arity; ++i) x[i] = tape_forward(n->parameters[i], g);
+    v = call(n, x);
+    if (!builtin_partials(n, x, v, g->tape + g->top)) {
+        for (i = 0; i < arity; ++i) g->tape[g->top + i] = user_partial(n, x, i);
+    }
+    g->top += arity;
+    /* The value is exact as in te_eval(). */
+    return n->type & TE_FLAG_INTEGER ? tape_eval(n, g) : v;
+}
+
+
+static void tape_backward(const te_expr *n, te_real adjoint, gradient_state *g);
+
+
+static void loop_backward(const te_expr *n, te_real adjoint, gradient_state *g) {
+    /* Runs the loop again, differentiating the body once per iteration */
+    /* in the loop's room on the tape. The hoisted values collect their */
+    /* adjoints over all the iterations, then pass them on in turn. The */
+    /* index and hoisted values are bound in columns of the call's own. */
+    const int holders = (ARITY(n->type) - 4) / 2;
+    te_real values[1 + TE_LOOP_HOLDERS];
+    te_column columns[1 + TE_LOOP_HOLDERS];
+    adjoint_scope scope;
+    block inner;
+    long k, count;
+    int i;
+
+    g->top -= tape_size(n);
+    const int base = g->top;
+    scope.loop = n;
+    scope.adjoints = g->tape + base;
+    scope.next = g->scope;
+
+    const te_real from = tape_eval(n->parameters[1], g), steps = floor(tape_eval(n->parameters[2], g) - from) + 1;
+    if (!(steps <= TE_LOOP_MAX) || adjoint == 0) return;
+    count = steps > 0 ? (long)steps : 0;
+    memset(columns, 0, sizeof(columns));
+    for (i = 0; i <= holders; ++i) {
+        columns[i].address = &((te_expr*)n->parameters[i ? 2 + 2 * i : 0])->value;
+        columns[i].data = values + i;
+        if (i) {
+            values[i] = tape_eval(n->parameters[3 + 2 * i], g);
+            scope.adjoints[i - 1] = 0;
+        }
+    }
+
+    inner.columns = columns;
+    inner.column_count = 1 + holders;
+    inner.offset = 0;
+    inner.lane = g->bindings->lane;
+    inner.known = 0;
+    inner.parent = g->bindings;
+
+    g->scope = &scope;
+    g->bindings = &inner;
+    g->top = base + holders;
+    if (n->function == mul) {
+        /* Each factor's adjoint is the product of the others. */
+        te_real others = 1;
+        long zeros = 0, zero = 0;
+        for (k = 0; k < count; ++k) {
+            values[0] = from + k;
+            const te_real x = tape_eval(n->parameters[3], g);
+            if (x == 0) {
+                ++zeros;
+                zero = k;
+            } else {
+                others *= x;
+            }
+        }
+        for (k = 0; k < count && zeros < 2; ++k) {
+            values[0] = from + k;
+            const te_real x = tape_forward(n->parameters[3], g);
+            const te_real weight = zeros ? (k == zero ? others : 0) : others / x;
+            tape_backward(n->parameters[3], chain(weight, adjoint), g);
+        }
+    } else {
+        for (k = 0; k < count; ++k) {
+            values[0] = from + k;
+            tape_forward(n->parameters[3], g);
+            tape_backward(n->parameters[3], adjoint, g);
+        }
+    }
+    g->scope = scope.next;
+    g->bindings = inner.parent;
+
+    for (i = holders - 1; i >= 0; --i) {
+        tape_forward(n->parameters[5 + 2 * i], g);
+        tape_backward(n->parameters[5 + 2 * i], scope.adjoints[i], g);
+    }
+    g->top = base;
+}
+
+
+static void vector_backward(const te_expr *n, te_real adjoint, gradient_state *g) {
+    /* Vector ops are rare enough to differentiate in forward mode, */
+    /* once for each variable. */
+    const adjoint_scope *s;
+    te_real v, d;
+    int i;
+
+    if (adjoint == 0) return;
+
+    for (i = 0; i < g->count; ++i) {
+        eval_dual(n, g->bindings, 1, g->variables[i].address, 0, &v, &d);
+        g->gradient[g->variables[i].index] += chain(d, adjoint);
+    }
+    for (s = g->scope; s; s = s->next) {
+        for (i = 4; i < ARITY(s->loop->type); i += 2) {
+            eval_dual(n, g->bindings, 1, &((te_expr*)s->loop->parameters[i])->value, 0, &v, &d);
+            s->adjoints[(i - 4) / 2] += chain(d, adjoint);
+        }
+    }
+}
+
+
+static void tape_backward(const te_expr *n, te_real adjoint, gradient_state *g) {
+    const int arity = ARITY(n->type);
+    const te_real *p;
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return;
+
+        case TE_VARIABLE: {
+            te_real *a = adjoint_of(g, n->bound);
+            if (a) *a += adjoint;
+            return;
+        }
+
+        case TE_VECTOR_OP:
+            vector_backward(n, adjoint, g);
+            return;
+
+        case TE_LOOP:
+            loop_backward(n, adjoint, g);
+            return;
+
+        default: break;
+    }
+
+    if (is_step(n)) return;
+
+    if (n->function == ternary && TYPE_MASK(n->type) == TE_FUNCTION3) {
+        const int branch = (int)g->tape[--g->top];
+        if (branch) tape_backward(n->parameters[branch], adjoint, g);
+        return;
+    }
+
+    /* The arguments' tapes are below the partials, last argument on top. */
+    g->top -= arity;
+    p = g->tape + g->top;
+    for (i = arity - 1; i >= 0; --i) tape_backward(n->parameters[i], chain(p[i], adjoint), g);
+    if (TYPE_MASK(n->type) == TE_VARIADIC) g->top -= arity;
+}
+
+
+te_real te_gradient(const te_expr *n, const te_real *const *variables, int count, te_real *gradient) {
+    gradient_state g;
+    te_real ret;
+    block b;
+    int i;
+
+    wrt *sorted = n ? malloc(sizeof(wrt) * count + sizeof(te_real) * tape_size(n)) : 0;
+    if (!sorted) {
+        for (i = 0; i < count; ++i) gradient[i] = NAN;
+        return NAN;
+    }
+
+    for (i = 0; i < count; ++i) {
+        sorted[i].address = variables[i];
+        sorted[i].index = i;
+        gradient[i] = 0;
+    }
+    qsort(sorted, count, sizeof(wrt), by_wrt);
+
+    g.tape = (te_real*)(sorted + count);
+    g.top = 0;
+    g.variables = sorted;
+    g.count = count;
+    g.gradient = gradient;
+    g.scope = 0;
+    b.columns = 0;
+    b.column_count = 0;
+    b.offset = 0;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+    g.bindings = &b;
+
+    ret = tape_forward(n, &g);
+    tape_backward(n, 1, &g);
+
+    for (i = 1; i < count; ++i) {
+        if (sorted[i].address == sorted[i - 1].address) gradient[sorted[i].index] = gradient[sorted[i - 1].index];
+    }
+    free(sorted);
+    return ret;
+}
+
+
+/* Symbolic differentiation builds the derivative as a new tree, partly */
+/* from copies of the original's subtrees. Terms that are zero are left */
+/* out as it's built, like chain() leaves them out of te_eval_dual(), and */
+/* nodes with constant arguments are folded. Every builder below takes */
+/* ownership of its arguments and returns NULL if out of memory. */
+typedef struct rebind {
+    const te_real *from, *to;
+    const struct rebind *next;
+} rebind;
+
+typedef struct derivation {
+    const te_real *variable;
+    /* Copied loops get a new index and holders, and holders that depend */
+    /* on the variable get another holder for their derivative. A tangent */
+    /* bound to NULL is zero. */
+    const rebind *copies, *tangents;
+} derivation;
+
+
+static te_expr *copy_tree(const te_expr *n, const rebind *copies);
+
+
+static te_expr *constant(te_real value) {
+    te_expr leaf;
+    leaf.type = TE_CONSTANT;
+    leaf.value = value;
+    return copy_tree(&leaf, 0);
+}
+
+
+static te_expr *variable(const te_real *address) {
+    te_expr leaf;
+    leaf.type = TE_VARIABLE;
+    leaf.bound = address;
+    return copy_tree(&leaf, 0);
+}
+
+
+static int is_constant(const te_expr *n, te_real value) {
+    return n && TYPE_MASK(n->type) == TE_CONSTANT && n->value == value;
+}
+
+
+static te_expr *build(int type, const void *function, te_expr **args, int count) {
+    te_expr *ret = 0;
+    int i, known = IS_PURE(type);
+
+    for (i = 0; i < count && args[i]; ++i) {
+        if (TYPE_MASK(args[i]->type) != TE_CONSTANT) known = 0;
+    }
+    if (i == count) ret = new_expr(type, (const te_expr**)args);
+    if (!ret) {
+        for (i = 0; i < count; ++i) te_free(args[i]);
+        return NULL;
+    }
+    ret->function = function;
+
+    if (known) {
+        const te_real value = te_eval(ret);
+        te_free_parameters(ret);
+        ret->type = TE_CONSTANT;
+        ret->value = value;
+    }
+    return ret;
+}
+
+
+static te_expr *apply1(const void *function, te_expr *a) {
+    if (a && function == negate && TYPE_MASK(a->type) == TE_FUNCTION1 && a->function == negate) {
+        te_expr *ret = a->parameters[0];
+        free(a);
+        return ret;
+    }
+    return build(TE_FUNCTION1 | TE_FLAG_PURE, function, &a, 1);
+}
+
+
+static te_expr *apply2(const void *function, te_expr *a, te_expr *b) {
+    te_expr *args[2] = {a, b}, *keep = 0, *drop = 0;
+
+    if (a && b) {
+        if (function == add && is_constant(a, 0)) keep = b, drop = a;
+        else if ((function == add || function == sub) && is_constant(b, 0)) keep = a, drop = b;
+        else if (function == mul && (is_constant(a, 0) || is_constant(b, 1))) keep = a, drop = b;
+        else if (function == mul && (is_constant(b, 0) || is_constant(a, 1))) keep = b, drop = a;
+        else if (function == divide && (is_constant(a, 0) || is_constant(b, 1))) keep = a, drop = b;
+
+        if (keep) {
+            te_free(drop);
+            return keep;
+        }
+        if ((function == sub && is_constant(a, 0)) || (function == mul && is_constant(a, -1))) {
+            te_free(a);
+            return apply1(negate, b);
+        }
+    }
+    return build(TE_FUNCTION2 | TE_FLAG_PURE, function, args, 2);
+}
+
+
+/* A custom function's partial derivative as a closure on a partial_call, */
+/* which is kept in the node's own memory after its context. */
+typedef struct partial_call {
+    const void *derivative;
+    void *context;
+    int closure, index;
+} partial_call;
+
+static te_real partial_with(const partial_call *p, const te_real *x) {
+    if (p->closure) return ((te_real(*)(void*, const te_real*, int))p->derivative)(p->context, x, p->index);
+    return ((te_real(*)(const te_real*, int))p->derivative)(x, p->index);
+}
+static te_real partial_at1(void *p, te_real a) {const te_real x[] = {a}; return partial_with(p, x);}
+static te_real partial_at2(void *p, te_real a, te_real b) {const te_real x[] = {a, b}; return partial_with(p, x);}
+static te_real partial_at3(void *p, te_real a, te_real b, te_real c) {const te_real x[] = {a, b, c}; return partial_with(p, x);}
+static te_real partial_at4(void *p, te_real a, te_real b, te_real c, te_real d) {
+    const te_real x[] = {a, b, c, d};
+    return partial_with(p, x);
+}
+static te_real partial_at5(void *p, te_real a, te_real b, te_real c, te_real d, te_real e) {
+    const te_real x[] = {a, b, c, d, e};
+    return partial_with(p, x);
+}
+static te_real partial_at6(void *p, te_real a, te_real b, te_real c, te_real d, te_real e, te_real f) {
+    const te_real x[] = {a, b, c, d, e, f};
+    return partial_with(p, x);
+}
+static te_real partial_at7(void *p, te_real a, te_real b, te_real c, te_real d, te_real e, te_real f, te_real g) {
+    const te_real x[] = {a, b, c, d, e, f, g};
+    return partial_with(p, x);
+}
+static const void *const partial_at[] = {
+    0, partial_at1, partial_at2, partial_at3, partial_at4, partial_at5, partial_at6, partial_at7
+};
+
+
+static te_expr *new_partial(int type, const partial_call *p) {
+    const int arity = ARITY(type);
+    const int size = sizeof(te_expr) + sizeof(void*) * arity + sizeof(partial_call);
+    te_expr *ret = malloc(size);
+    CHECK_NULL(ret);
+
+    memset(ret, 0, size);
+    ret->type = type;
+    ret->function = partial_at[arity];
+    ret->parameters[arity] = memcpy((char*)ret + size - sizeof(partial_call), p, sizeof(partial_call));
+    return ret;
+}
+
+
+static int is_partial(const te_expr *n) {
+    return IS_CLOSURE(n->type) && n->function == partial_at[ARITY(n->type)];
+}
+
+
+static const te_real *rebound(const rebind *r, const te_real *address) {
+    for (; r; r = r->next) {
+        if (r->from == address) return r->to;
+    }
+    return address;
+}
+
+
+static te_expr *copy_tree(const te_expr *n, const rebind *copies) {
+    const int arity = ARITY(n->type);
+    te_expr *ret = is_partial(n) ? new_partial(n->type, n->parameters[arity]) : new_expr(n->type, 0);
+    int i;
+    CHECK_NULL(ret);
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT:
+            ret->value = n->value;
+            return ret;
+
+        case TE_VARIABLE:
+            ret->bound = rebound(copies, n->bound);
+            return ret;
+
+        case TE_LOOP: {
+            /* The hoisted expressions are outside of the loop's scope. */
+            const int holders = (arity - 4) / 2;
+            rebind *inner = malloc(sizeof(rebind) * (1 + holders));
+            ret->function = n->function;
+            CHECK_NULL(inner, free(ret));
+
+            for (i = 0; i <= holders; ++i) {
+                const int at = i ? 2 + 2 * i : 0;
+                ret->parameters[at] = constant(NAN);
+                CHECK_NULL(ret->parameters[at], free(inner), te_free(ret));
+                inner[i].from = &((te_expr*)n->parameters[at])->value;
+                inner[i].to = &((te_expr*)ret->parameters[at])->value;
+                inner[i].next = i ? inner + i - 1 : copies;
+            }
+            for (i = 1; i < arity; ++i) {
+                if (i >= 4 && i % 2 == 0) continue;
+                ret->parameters[i] = copy_tree(n->parameters[i], i == 3 ? inner + holders : copies);
+                CHECK_NULL(ret->parameters[i], free(inner), te_free(ret));
+            }
+            free(inner);
+            return ret;
+        }
+
+        default:
+            ret->function = n->function;
+            for (i = 0; i < arity; ++i) {
+                ret->parameters[i] = copy_tree(n->parameters[i], copies);
+                CHECK_NULL(ret->parameters[i], te_free(ret));
+            }
+            if (IS_CLOSURE(n->type) && !is_partial(n)) ret->parameters[arity] = n->parameters[arity];
+            if (n->type & TE_FLAG_PARTIALS) PARTIALS(ret) = PARTIALS(n);
+            return ret;
+    }
+}
+
+
+static te_expr *derive(const te_expr *n, const derivation *d);
+
+
+static int partial(const te_expr *n, int i, const rebind *c, te_expr **out) {
+    /* Builds the partial derivative of a builtin with respect to argument */
+    /* i, the same as builtin_partials(). Returns 0 for other functions. */
+    const void *f = n->function;
+    const te_expr *a = n->parameters[0], *b = n->parameters[ARITY(n->type) > 1];
+#define X copy_tree(a, c)
+#define Y copy_tree(b, c)
+#define V copy_tree(n, c)
+
+    if (IS_CLOSURE(n->type) || (n->type & TE_FLAG_PARTIALS)) return 0;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_FUNCTION1:
+            if (f == negate) *out = constant(-1);
+            else if (f == square) *out = apply2(mul, constant(2), X);
+            else if (f == fabs) *out = apply2(sub, apply2(greater, X, constant(0)), apply2(lower, X, constant(0)));
+            else if (f == acos || f == asin) {
+                *out = apply2(divide, constant(f == acos ? -1 : 1), apply1(sqrt, apply2(sub, constant(1), apply1(square, X))));
+            }
+            else if (f == atan) *out = apply2(divide, constant(1), apply2(add, constant(1), apply1(square, X)));
+            else if (f == cos) *out = apply1(negate, apply1(sin, X));
+            else if (f == sin) *out = apply1(cos, X);
+            else if (f == tan) *out = apply2(add, constant(1), apply1(square, V));
+            else if (f == cosh) *out = apply1(sinh, X);
+            else if (f == sinh) *out = apply1(cosh, X);
+            else if (f == tanh) *out = apply2(sub, constant(1), apply1(square, V));
+            else if (f == exp) *out = V;
+            else if (f == log) *out = apply2(divide, constant(1), X);
+            else if (f == log10) *out = apply2(divide, constant(1), apply2(mul, X, constant(log(10.0))));
+            else if (f == sqrt) *out = apply2(divide, constant(0.5), V);
+            else return 0;
+            return 1;
+
+        case TE_FUNCTION2:
+            if (f == add) *out = constant(1);
+            else if (f == sub) *out = constant(i ? -1 : 1);
+            else if (f == mul) *out = i ? X : Y;
+            else if (f == divide) *out = i ? apply1(negate, apply2(divide, V, Y)) : apply2(divide, constant(1), Y);
+            else if (f == pow) {
+                *out = i ? apply2(mul, V, apply1(log, X)) : apply2(mul, Y, apply2(pow, X, apply2(sub, Y, constant(1))));
+            }
+            else if (f == fmod) *out = i ? apply1(negate, apply1(trunc, apply2(divide, X, Y))) : constant(1);
+            else if (f == atan2) *out = apply2(divide, i ? apply1(negate, X) : Y, apply2(add, apply1(square, X), apply1(square, Y)));
+            else if (f == comma) *out = constant(i);
+            else return 0;
+            return 1;
+
+        default: return 0;
+    }
+#undef X
+#undef Y
+#undef V
+}
+
+
+static te_expr *partial_node(const te_expr *n, int i, const rebind *c) {
+    /* Calls a custom function's derivative with the same arguments. */
+    const int arity = ARITY(n->type);
+    partial_call p;
+    int j;
+
+    p.derivative = PARTIALS(n);
+    p.closure = IS_CLOSURE(n->type);
+    p.context = p.closure ? n->parameters[arity] : 0;
+    p.index = i;
+
+    te_expr *ret = new_partial((TE_CLOSURE0 + arity) | (n->type & TE_FLAG_PURE), &p);
+    CHECK_NULL(ret);
+    for (j = 0; j < arity; ++j) {
+        ret->parameters[j] = copy_tree(n->parameters[j], c);
+        CHECK_NULL(ret->parameters[j], te_free(ret));
+    }
+    return ret;
+}
+
+
+static te_expr *difference(const te_expr *n, int i, const rebind *c) {
+    /* The central difference te_eval_dual() uses for functions without */
+    /* a derivative, as a tree. */
+    const te_expr *x = n->parameters[i];
+    te_expr *h = apply2(mul, constant(TE_DIFF_STEP), apply2(add, constant(1), apply1(fabs, copy_tree(x, c))));
+    te_expr *up = copy_tree(n, c), *down = copy_tree(n, c);
+
+    if (h && up && down) {
+        te_free(up->parameters[i]);
+        te_free(down->parameters[i]);
+        up->parameters[i] = apply2(add, copy_tree(x, c), copy_tree(h, 0));
+        down->parameters[i] = apply2(sub, copy_tree(x, c), copy_tree(h, 0));
+        if (up->parameters[i] && down->parameters[i]) {
+            return apply2(divide, apply2(sub, up, down), apply2(mul, constant(2), h));
+        }
+    }
+    te_free(h);
+    te_free(up);
+    te_free(down);
+    return NULL;
+}
+
+
+static te_expr *derive_function(const te_expr *n, const derivation *d) {
+    const int arity = ARITY(n->type);
+    te_expr *ret = constant(0);
+    int i;
+
+    if (n->function == ternary && TYPE_MASK(n->type) == TE_FUNCTION3) {
+        te_expr *args[3] = {0, derive(n->parameters[1], d), derive(n->parameters[2], d)};
+        if (is_constant(args[1], 0) && is_constant(args[2], 0)) {
+            te_free(ret);
+            te_free(args[2]);
+            return args[1];
+        }
+        args[0] = copy_tree(n->parameters[0], d->copies);
+        te_free(ret);
+        return build(TE_FUNCTION3 | TE_FLAG_PURE, ternary, args, 3);
+    }
+
+    for (i = 0; i < arity && ret; ++i) {
+        te_expr *da = derive(n->parameters[i], d), *p = 0;
+        if (is_constant(da, 0)) {
+            te_free(da);
+            continue;
+        }
+        if (da && !partial(n, i, d->copies, &p)) {
+            p = n->type & TE_FLAG_PARTIALS ? partial_node(n, i, d->copies) : difference(n, i, d->copies);
+        }
+        ret = apply2(add, ret, apply2(mul, p, da));
+    }
+    return ret;
+}
+
+
+static te_expr *derive_variadic(const te_expr *n, const derivation *d) {
+    const int count = ARITY(n->type);
+    const te_fun2 f = variadic_step(n);
+    te_expr *ret = constant(0);
+    int i, j;
+
+    for (i = 0; i < count && ret; ++i) {
+        const te_expr *x = n->parameters[i];
+        te_expr *dx = derive(x, d), *p;
+
+        if (f == minimum || f == maximum) {
+            /* The argument picked is x if x is NaN or beats all before it. */
+            if (!i || (is_constant(dx, 0) && is_constant(ret, 0))) {
+                if (i) te_free(dx); else te_free(ret), ret = dx;
+                continue;
+            }
+            te_expr *before = copy_tree(n->parameters[0], d->copies);
+            if (i > 1) {
+                te_expr *all = new_expr(TE_VARIADIC | TE_FLAG_PURE | (i << TE_VARIADIC_SHIFT), 0);
+                if (all) {
+                    all->function = n->function;
+                    all->parameters[0] = before;
+                    for (j = 1; j < i; ++j) all->parameters[j] = copy_tree(n->parameters[j], d->copies);
+                    for (j = 0; j < i && all->parameters[j]; ++j);
+                    if (j < i) te_free(all), all = 0;
+                } else {
+                    te_free(before);
+                }
+                before = all;
+            }
+            te_expr *args[3] = {
+                apply2(logical_or, apply2(f == minimum ? lower : greater, copy_tree(x, d->copies), before),
+                    apply2(not_equal, copy_tree(x, d->copies), copy_tree(x, d->copies))),
+                dx, ret};
+            ret = build(TE_FUNCTION3 | TE_FLAG_PURE, ternary, args, 3);
+            continue;
+        }
+
+        if (is_constant(dx, 0)) {
+            te_free(dx);
+            continue;
+        }
+        if (f == add) {
+            p = constant(n->function == mean ? (te_real)1 / count : 1);
+        } else if (f == hypot) {
+            p = apply2(divide, copy_tree(x, d->copies), copy_tree(n, d->copies));
+        } else {
+            /* The product of the others. */
+            p = constant(1);
+            for (j = 0; j < count; ++j) {
+                if (j != i) p = apply2(mul, p, copy_tree(n->parameters[j], d->copies));
+            }
+        }
+        ret = apply2(add, ret, apply2(mul, p, dx));
+    }
+    return ret;
+}
+
+
+static te_expr *widen(te_expr *n, int width) {
+    /* dot and cross need scalars spelled out as vectors. */
+    te_expr *args[TE_VECTOR_MAX];
+    int i;
+    if (!n || width < 2 || vector_width(n) != 1) return n;
+    args[0] = n;
+    for (i = 1; i < width; ++i) args[i] = copy_tree(n, 0);
+    return build(TE_VECTOR_OP | (width << TE_VARIADIC_SHIFT), vec, args, width);
+}
+
+
+static te_expr *derive_vector(const te_expr *n, const derivation *d) {
+    const int arity = ARITY(n->type);
+    te_expr *da[TE_VECTOR_MAX], *ret;
+    int i, zero = 1;
+
+    for (i = 0; i < arity; ++i) {
+        da[i] = derive(n->parameters[i], d);
+        if (!da[i]) {
+            while (i--) te_free(da[i]);
+            return NULL;
+        }
+        if (!is_constant(da[i], 0)) zero = 0;
+    }
+    if (zero) {
+        for (i = 1; i < arity; ++i) te_free(da[i]);
+        return da[0];
+    }
+    if (n->function == vec) return build(n->type, vec, da, arity);
+
+    const int w = vector_width(n->parameters[0]);
+    const te_expr *x = n->parameters[0], *y = n->parameters[arity - 1];
+    if (n->function == length) {
+        te_expr *args[2] = {copy_tree(x, d->copies), widen(da[0], w)};
+        return apply2(divide, build(TE_VECTOR_OP | (2 << TE_VARIADIC_SHIFT), dot, args, 2), copy_tree(n, d->copies));
+    }
+
+    /* dot and cross have a product rule. */
+    ret = constant(0);
+    for (i = 0; i < 2; ++i) {
+        if (is_constant(da[i], 0)) {
+            te_free(da[i]);
+            continue;
+        }
+        te_expr *args[2] = {i ? copy_tree(x, d->copies) : widen(da[0], w), i ? widen(da[1], w) : copy_tree(y, d->copies)};
+        ret = apply2(add, ret, build(n->type, n->function, args, 2));
+    }
+    return ret;
+}
+
+
+static te_expr *derive_loop(const te_expr *n, const derivation *d) {
+    /* A sum's derivative is a sum of the body's over the same range. A */
+    /* product's has the body's derivative times the product of the other */
+    /* iterations, as an inner loop. The copied holders are kept, followed */
+    /* by holders for the derivatives of those that depend on the variable. */
+    const int arity = ARITY(n->type), holders = (arity - 4) / 2;
+    te_expr **args = calloc(arity + 2 * holders, sizeof(te_expr*)), *ret = 0;
+    rebind *r = malloc(sizeof(rebind) * (2 + 2 * holders));
+    derivation inner;
+    int i, count = arity;
+
+    if (!args || !r) goto fail;
+    args[0] = constant(NAN);
+    if (!args[0]) goto fail;
+    r[0].from = &((te_expr*)n->parameters[0])->value;
+    r[0].to = &args[0]->value;
+    r[0].next = d->copies;
+
+    inner = *d;
+    for (i = 0; i < holders; ++i) {
+        const te_expr *e = n->parameters[5 + 2 * i];
+        te_expr *de = derive(e, d);
+        args[4 + 2 * i] = constant(NAN);
+        args[5 + 2 * i] = copy_tree(e, d->copies);
+        if (!de || !args[4 + 2 * i] || !args[5 + 2 * i]) {
+            te_free(de);
+            goto fail;
+        }
+
+        rebind *copy = r + 1 + i, *slope = r + 1 + holders + i;
+        copy->from = slope->from = &((te_expr*)n->parameters[4 + 2 * i])->value;
+        copy->to = &args[4 + 2 * i]->value;
+        copy->next = i ? copy - 1 : r;
+        slope->to = 0;
+        slope->next = inner.tangents;
+        inner.tangents = slope;
+
+        if (is_constant(de, 0)) {
+            te_free(de);
+        } else if (count == 4 + 2 * TE_LOOP_HOLDERS) {
+            /* No room left for the derivative's holder. */
+            te_free(de);
+            goto fail;
+        } else {
+            args[count] = constant(NAN);
+            args[count + 1] = de;
+            if (!args[count]) goto fail;
+            slope->to = &args[count]->value;
+            count += 2;
+        }
+    }
+    inner.copies = r + holders;
+
+    args[1] = copy_tree(n->parameters[1], d->copies);
+    args[2] = copy_tree(n->parameters[2], d->copies);
+    args[3] = derive(n->parameters[3], &inner);
+    if (!args[1] || !args[2] || !args[3]) goto fail;
+    if (is_constant(args[3], 0)) {
+        ret = args[3];
+        args[3] = 0;
+        goto fail;
+    }
+
+    if (n->function == mul) {
+        /* The index of the inner loop takes priority over the outer copy's. */
+        te_expr *others[4] = {constant(NAN), copy_tree(n->parameters[1], d->copies), copy_tree(n->parameters[2], d->copies), 0};
+        rebind *other = r + 1 + 2 * holders;
+        if (others[0]) {
+            other->from = r[0].from;
+            other->to = &others[0]->value;
+            other->next = inner.copies;
+            te_expr *pick[3] = {apply2(equal, variable(other->to), variable(r[0].to)), constant(1), copy_tree(n->parameters[3], other)};
+            others[3] = build(TE_FUNCTION3 | TE_FLAG_PURE, ternary, pick, 3);
+        }
+        te_expr *product = build(TE_LOOP | (4 << TE_VARIADIC_SHIFT), mul, others, 4);
+        if (product && pure_loop(product)) product->type |= TE_FLAG_PURE;
+        args[3] = apply2(mul, args[3], product);
+        if (!args[3]) goto fail;
+    }
+
+    ret = new_expr(TE_LOOP | (count << TE_VARIADIC_SHIFT), (const te_expr**)args);
+    if (!ret) goto fail;
+    ret->function = add;
+    if (pure_loop(ret)) ret->type |= TE_FLAG_PURE;
+    free(args);
+    free(r);
+    return ret;
+
+fail:
+    if (args) {
+        for (i = 0; i < arity + 2 * holders; ++i) te_free(args[i]);
+    }
+    free(args);
+    free(r);
+    return ret;
+}
+
+
+static te_expr *derive(const te_expr *n, const derivation *d) {
+    const rebind *t;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return constant(0);
+
+        case TE_VARIABLE:
+            if (n->bound == d->variable) return constant(1);
+            for (t = d->tangents; t; t = t->next) {
+                if (t->from == n->bound) return t->to ? variable(t->to) : constant(0);
+            }
+            return constant(0);
+
+        case TE_VARIADIC: return derive_variadic(n, d);
+        case TE_LOOP: return derive_loop(n, d);
+        case TE_VECTOR_OP: return derive_vector(n, d);
+
+        default:
+            if (is_step(n)) return constant(0);
+            return derive_function(n, d);
+    }
+}
+
+
+te_expr *te_derive(const te_expr *n, const te_real *variable) {
+    derivation d;
+    te_expr *ret;
+    if (!n) return 0;
+
+    d.variable = variable;
+    d.copies = 0;
+    d.tangents = 0;
+    ret = derive(n, &d);
+    if (ret) mark_integer(ret);
+    return ret;
+}
+
+
+/* Root finding runs a safeguarded Newton iteration on each row: Newton */
+/* steps while they stay inside the bracket and shrink it fast enough, */
+/* bisection otherwise. A block of rows is iterated together, with the */
+/* variable bound to a column of their current guesses, so each step */
+/* costs one forward-mode pass over the block. */
+#ifdef TE_FLOAT
+#define TE_SOLVE_TOLERANCE 1e-6
+#else
+#define TE_SOLVE_TOLERANCE 1e-13
+#endif
+
+enum {TE_SOLVING, TE_SOLVED, TE_UNSOLVED};
+
+
+int te_solve_batch(const te_expr *n, const te_real *variable, const te_column *columns, int column_count, int rows, const te_real *targets, const te_real *brackets, te_real *out, unsigned char *converged) {
+    te_real x[TE_BLOCK], lo[TE_BLOCK], hi[TE_BLOCK], step[TE_BLOCK], last[TE_BLOCK], v[TE_BLOCK], d[TE_BLOCK];
+    int status[TE_BLOCK], start, i, j, k, solved = 0;
+
+    /* The guesses come first, so they override a column for the variable. */
+    te_column *shifted = malloc(sizeof(te_column) * (column_count + 1));
+    if (!n || !shifted) {
+        for (i = 0; i < rows; ++i) {
+            out[i] = NAN;
+            if (converged) converged[i] = 0;
+        }
+        free(shifted);
+        return 0;
+    }
+    memset(shifted, 0, sizeof(te_column));
+    shifted[0].address = variable;
+    shifted[0].data = x;
+
+    block b;
+    b.columns = shifted;
+    b.column_count = column_count + 1;
+    b.offset = 0;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+
+    for (start = 0; start < rows; start += TE_BLOCK) {
+        const int len = rows - start < TE_BLOCK ? rows - start : TE_BLOCK;
+        int active = 0;
+
+        for (j = 0; j < column_count; ++j) {
+            const te_column *c = columns + j;
+            shifted[j + 1] = *c;
+            shifted[j + 1].data = (const char*)c->data + (size_t)start * (c->stride ? c->stride : column_size(c->type));
+        }
+
+        /* The bracket must hold a sign change. lo keeps the end where */
+        /* the function is below the target, hi where it's above. */
+        for (i = 0; i < len; ++i) x[i] = brackets[2 * (start + i)];
+        eval_block(n, &b, len, v);
+        for (i = 0; i < len; ++i) x[i] = brackets[2 * (start + i) + 1];
+        eval_block(n, &b, len, d);
+
+        for (i = 0; i < len; ++i) {
+            const te_real target = targets ? targets[start + i] : 0;
+            const te_real a = brackets[2 * (start + i)], c = brackets[2 * (start + i) + 1];
+            const te_real fa = v[i] - target, fc = d[i] - target;
+
+            status[i] = TE_SOLVING;
+            if (fa == 0 || fc == 0) {
+                x[i] = fa == 0 ? a : c;
+                status[i] = TE_SOLVED;
+            } else if (fa < 0 && fc > 0) {
+                lo[i] = a;
+                hi[i] = c;
+            } else if (fa > 0 && fc < 0) {
+                lo[i] = c;
+                hi[i] = a;
+            } else {
+                x[i] = NAN;
+                status[i] = TE_UNSOLVED;
+            }
+
+            if (status[i] == TE_SOLVING) {
+                x[i] = (a + c) / 2;
+                step[i] = last[i] = fabs(c - a);
+                ++active;
+            }
+        }
+
+        for (k = 0; k < TE_SOLVE_MAX && active; ++k) {
+            eval_dual(n, &b, len, variable, 0, v, d);
+            for (i = 0; i < len; ++i) {
+                if (status[i] != TE_SOLVING) continue;
+                const te_real g = v[i] - (targets ? targets[start + i] : 0);
+
+                if (g == 0) {
+                    status[i] = TE_SOLVED;
+                    --active;
+                    continue;
+                }
+                if (g < 0) lo[i] = x[i]; else hi[i] = x[i];
+
+                /* Newton's step if it lands inside the bracket and at least */
+                /* halves the step before last, which also rules out NaNs. */
+                const te_real newton = g / d[i];
+                if (((x[i] - hi[i]) * d[i] - g) * ((x[i] - lo[i]) * d[i] - g) <= 0 && fabs(2 * g) <= fabs(last[i] * d[i])) {
+                    last[i] = step[i];
+                    step[i] = newton;
+                    x[i] -= newton;
+                } else {
+                    last[i] = step[i];
+                    step[i] = (hi[i] - lo[i]) / 2;
+                    x[i] = lo[i] + step[i];
+                }
+
+                if (fabs(step[i]) <= TE_SOLVE_TOLERANCE * (1 + fabs(x[i])) || x[i] == lo[i] || x[i] == hi[i]) {
+                    status[i] = TE_SOLVED;
+                    --active;
+                }
+            }
+        }
+
+        for (i = 0; i < len; ++i) {
+            out[start + i] = x[i];
+            if (converged) converged[start + i] = status[i] == TE_SOLVED;
+            solved += status[i] == TE_SOLVED;
+        }
+    }
+
+    free(shifted);
+    return solved;
+}
+
+
+/* Integration runs adaptive 15 point Gauss-Kronrod quadrature on each row. */
+/* The range starts as TE_PANELS equal panels, and the panels with the */
+/* largest error, estimated against the embedded 7 point Gauss rule, are */
+/* halved until the total error meets the tolerance. Each round evaluates */
+/* the nodes of TE_PANELS panels together through eval_block. */
+#define TE_KRONROD 15
+#define TE_PANELS (TE_BLOCK / TE_KRONROD)
+
+#if TE_PANELS < 2
+#error "TE_BLOCK is too small for te_integrate()"
+#endif
+
+/* Nodes from the ends inward, then the middle. */
+static const te_real kronrod_nodes[7] = {
+    0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+    0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+    0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245
+};
+
+static const te_real kronrod_weights[8] = {
+    0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+    0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+    0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+};
+
+/* The Gauss nodes are the odd Kronrod nodes and the middle. */
+static const te_real gauss_weights[4] = {
+    0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+    0.381830050505118944950369775488975, 0.417959183673469387755102040816327
+};
+
+
+static void kronrod(const te_expr *n, const block *b, te_real *x, int count, const te_real *from, const te_real *to, te_real *sum, te_real *error) {
+    /* Integrates count panels in one block, with x bound to the variable. */
+    te_real f[TE_BLOCK];
+    int i, k;
+
+    for (k = 0; k < count; ++k) {
+        const te_real middle = (from[k] + to[k]) / 2, half = (to[k] - from[k]) / 2;
+        te_real *p = x + k * TE_KRONROD;
+        for (i = 0; i < 7; ++i) {
+            p[i] = middle - half * kronrod_nodes[i];
+            p[14 - i] = middle + half * kronrod_nodes[i];
+        }
+        p[7] = middle;
+    }
+
+    eval_block(n, b, count * TE_KRONROD, f);
+
+    for (k = 0; k < count; ++k) {
+        const te_real *g = f + k * TE_KRONROD;
+        te_real kronrod_sum = kronrod_weights[7] * g[7], gauss_sum = gauss_weights[3] * g[7];
+        for (i = 0; i < 7; ++i) {
+            kronrod_sum += kronrod_weights[i] * (g[i] + g[14 - i]);
+            if (i & 1) gauss_sum += gauss_weights[i / 2] * (g[i] + g[14 - i]);
+        }
+        sum[k] = kronrod_sum * (to[k] - from[k]) / 2;
+        error[k] = fabs((kronrod_sum - gauss_sum) * (to[k] - from[k]) / 2);
+    }
+}
+
+
+int te_integrate_batch(const te_expr *n, const te_real *variable, const te_column *columns, int column_count, int rows, const te_real *bounds, te_real tolerance, te_real *out, unsigned char *converged) {
+    te_real x[TE_BLOCK], from[TE_PANELS], to[TE_PANELS], s[TE_PANELS], e[TE_PANELS];
+    int worst[TE_PANELS / 2], row, i, j, k, m, count, done = 0;
+
+    /* The nodes come first, so they override a column for the variable. */
+    /* Each row's other columns are repeated across a block, followed by */
+    /* the row's panels. */
+    te_column *shifted = malloc(sizeof(te_column) * (column_count + 1) + sizeof(te_real) * (TE_BLOCK * column_count + 4 * TE_INTEGRATE_MAX));
+    if (!n || !shifted) {
+        for (i = 0; i < rows; ++i) {
+            out[i] = NAN;
+            if (converged) converged[i] = 0;
+        }
+        free(shifted);
+        return 0;
+    }
+    te_real *values = (te_real*)(shifted + column_count + 1);
+    te_real *lo = values + TE_BLOCK * column_count, *hi = lo + TE_INTEGRATE_MAX;
+    te_real *sum = hi + TE_INTEGRATE_MAX, *error = sum + TE_INTEGRATE_MAX;
+
+    memset(shifted, 0, sizeof(te_column) * (column_count + 1));
+    shifted[0].address = variable;
+    shifted[0].data = x;
+    for (j = 0; j < column_count; ++j) {
+        shifted[j + 1].address = columns[j].address;
+        shifted[j + 1].data = values + j * TE_BLOCK;
+    }
+
+    block b;
+    b.columns = shifted;
+    b.column_count = column_count + 1;
+    b.offset = 0;
+    b.lane = -1;
+    b.known = 0;
+    b.parent = 0;
+
+    for (row = 0; row < rows; ++row) {
+        const te_real a = bounds[2 * row], c = bounds[2 * row + 1];
+        te_real result;
+        int status = TE_SOLVING;
+
+        for (j = 0; j < column_count; ++j) {
+            te_real *v = values + j * TE_BLOCK;
+            load_column(columns + j, row, 1, v);
+            for (i = 1; i < TE_BLOCK; ++i) v[i] = v[0];
+        }
+
+        count = TE_PANELS;
+        for (k = 0; k < count; ++k) {
+            lo[k] = a + (c - a) * k / count;
+            hi[k] = k + 1 == count ? c : a + (c - a) * (k + 1) / count;
+        }
+        kronrod(n, &b, x, count, lo, hi, sum, error);
+
+        for (;;) {
+            te_real total = 0;
+            result = 0;
+            for (k = 0; k < count; ++k) {
+                result += sum[k];
+                total += error[k];
+            }
+
+            if (total <= tolerance || total <= tolerance * fabs(result)) {
+                status = TE_SOLVED;
+                break;
+            }
+            if (total != total || count + TE_PANELS / 2 > TE_INTEGRATE_MAX) break;
+
+            /* Halves the panels with the largest errors, keeping the left */
+            /* halves in place and appending the right ones. */
+            for (m = 0; m < TE_PANELS / 2; ++m) {
+                int w = 0;
+                for (k = 1; k < count; ++k) if (error[k] > error[w]) w = k;
+                const te_real middle = (lo[w] + hi[w]) / 2;
+                if (middle == lo[w] || middle == hi[w]) break;
+                from[2 * m] = lo[w];
+                to[2 * m] = from[2 * m + 1] = middle;
+                to[2 * m + 1] = hi[w];
+                worst[m] = w;
+                error[w] = -1;
+            }
+            if (m < TE_PANELS / 2) break;
+
+            kronrod(n, &b, x, 2 * m, from, to, s, e);
+            for (m = 0; m < TE_PANELS / 2; ++m) {
+                lo[worst[m]] = from[2 * m];
+                hi[worst[m]] = to[2 * m];
+                sum[worst[m]] = s[2 * m];
+                error[worst[m]] = e[2 * m];
+                lo[count] = from[2 * m + 1];
+                hi[count] = to[2 * m + 1];
+                sum[count] = s[2 * m + 1];
+                error[count] = e[2 * m + 1];
+                ++count;
+            }
+        }
+
+        out[row] = result;
+        if (converged) converged[row] = status == TE_SOLVED;
+        done += status == TE_SOLVED;
+    }
+
+    free(shifted);
+    return done;
+}
+
+
+te_real te_integrate(const te_expr *n, const te_real *variable, te_real a, te_real b, te_real tolerance) {
+    const te_real bounds[2] = {a, b};
+    te_real result;
+    te_integrate_batch(n, variable, 0, 0, 1, bounds, tolerance, &result, 0);
+    return result;
+}
+
+
 static void pn (const te_expr *n, int depth) {
     int i, arity;
     printf("%*s", depth, "");
@@ -718,6 +5358,7 @@ static void pn (const te_expr *n, int depth) {
     case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
     case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
     case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+    case TE_VARIADIC: case TE_LOOP: case TE_VECTOR_OP:
          arity = ARITY(n->type);
          printf("f%d", arity);
          for(i = 0; i < arity; i++) {
@@ -32,10 +32,20 @@ extern "C" {
 #endif
 
 
+/* Define TE_FLOAT to evaluate in single precision.
+ * Variables, results and custom functions then use float instead of double. */
+/* #define TE_FLOAT */
+
+#ifdef TE_FLOAT
+typedef float te_real;
+#else
+typedef double te_real;
+#endif
+
 
 typedef struct te_expr {
     int type;
-    union {double value; const double *bound; const void *function;};
+    union {te_real value; const te_real *bound; const void *function;};
     void *parameters[1];
 } te_expr;
 
@@ -43,34 +53,232 @@ typedef struct te_expr {
 enum {
     TE_VARIABLE = 0,
 
+    /* The address points to a te_array, whose elements are read as a[i]. */
+    TE_ARRAY = 4,
+
+    /* The address points to a te_array of 2 to TE_VECTOR_MAX components, */
+    /* see te_eval_vector(). */
+    TE_VECTOR = 5,
+
     TE_FUNCTION0 = 8, TE_FUNCTION1, TE_FUNCTION2, TE_FUNCTION3,
     TE_FUNCTION4, TE_FUNCTION5, TE_FUNCTION6, TE_FUNCTION7,
 
     TE_CLOSURE0 = 16, TE_CLOSURE1, TE_CLOSURE2, TE_CLOSURE3,
     TE_CLOSURE4, TE_CLOSURE5, TE_CLOSURE6, TE_CLOSURE7,
 
-    TE_FLAG_PURE = 32
+    TE_FLAG_PURE = 32,
+
+    /* Called with whole arrays of arguments, as f(args, out, count) or */
+    /* f(context, args, out, count) for closures, where args[i][j] is */
+    /* argument i of row j and out[j] receives the result for row j. */
+    TE_FLAG_BATCH = 64,
+
+    /* Results are cached by arguments and context, see te_memo_stats(). */
+    TE_FLAG_MEMO = 128
 };
 
+/* Functions and closures may give a derivative for te_eval_dual(): */
+/* d(args, i) or d(context, args, i) returns the partial derivative with */
+/* respect to argument i at args. Without one, central differences are used. */
 typedef struct te_variable {
     const char *name;
     const void *address;
     int type;
     void *context;
+    const void *derivative;
 } te_variable;
 
 
+#define TE_VECTOR_MAX 4
+
+/* Elements data[0] to data[length - 1]; other indices read as NaN. */
+/* Both fields may change between evaluations. */
+typedef struct te_array {
+    const te_real *data;
+    int length;
+} te_array;
+
+
+/* Binds a variable's address to an array of row values for batch evaluation. */
+/* Variables without a column keep their current (scalar) value for every row. */
+/* Row i is read from (char*)data + offset + i * stride; a stride of 0 means */
+/* tightly packed values, so {&x, xs} binds x to the array xs. */
+/* Values are te_real unless type gives another TE_COLUMN_* element type. */
+enum {
+    TE_COLUMN_REAL = 0, TE_COLUMN_DOUBLE, TE_COLUMN_FLOAT, TE_COLUMN_INT32, TE_COLUMN_INT64, TE_COLUMN_UINT8
+};
+
+typedef struct te_column {
+    const te_real *address;
+    const void *data;
+    int stride;
+    int offset;
+    int type;
+} te_column;
+
+
+/* Binds a variable's address to run-length encoded rows: */
+/* values[i] repeats for lengths[i] rows. */
+typedef struct te_rle_column {
+    const te_real *address;
+    const te_real *values;
+    const int *lengths;
+    int runs;
+} te_rle_column;
+
+
+/* Binds a variable's address to dictionary encoded rows: */
+/* row i has the value dictionary[codes[i]], with codes below size. */
+typedef struct te_dict_column {
+    const te_real *address;
+    const te_real *dictionary;
+    int size;
+    const int *codes;
+} te_dict_column;
+
+
+enum {
+    TE_REDUCE_SUM = 1, TE_REDUCE_MIN = 2, TE_REDUCE_MAX = 4,
+    TE_REDUCE_MEAN = 8, TE_REDUCE_COUNT = 16
+};
+
+typedef struct te_reduction {
+    te_real sum, min, max, mean;
+    int count;
+} te_reduction;
+
+
+/* Bounds a variable's value for interval evaluation. */
+typedef struct te_range {
+    const te_real *address;
+    te_real lo, hi;
+} te_range;
+
+
 
 /* Parses the input expression, evaluates it, and frees it. */
 /* Returns NaN on error. */
-double te_interp(const char *expression, int *error);
+te_real te_interp(const char *expression, int *error);
 
 /* Parses the input expression and binds variables. */
 /* Returns NULL on error. */
 te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error);
 
 /* Evaluates the expression. */
-double te_eval(const te_expr *n);
+te_real te_eval(const te_expr *n);
+
+/* Evaluates an expression that may be vector valued, with operators applied */
+/* componentwise. Writes the components to out, which needs room for TE_VECTOR_MAX. */
+/* Returns how many there are: 1 for scalars, 0 if vectors of different sizes meet. */
+int te_eval_vector(const te_expr *n, te_real *out);
+
+/* Evaluates the expression and its derivative with respect to the variable */
+/* bound to seed. */
+void te_eval_dual(const te_expr *n, const te_real *seed, te_real *value, te_real *derivative);
+
+/* Like te_eval_batch, but also writes each row's derivative with respect to */
+/* the variable bound to seed, which may itself be read from a column. */
+void te_eval_dual_batch(const te_expr *n, const te_column *columns, int column_count, int rows, const te_real *seed, te_real *values, te_real *derivatives);
+
+/* Evaluates the expression and writes its derivatives with respect to the */
+/* count variables bound to the given addresses to gradient, in one pass. */
+te_real te_gradient(const te_expr *n, const te_real *const *variables, int count, te_real *gradient);
+
+/* Builds an expression for the derivative of n with respect to the variable */
+/* bound to the given address. The result is separate from n, and is freed */
+/* with te_free(). Returns NULL if out of memory, or if a loop would hoist */
+/* too many values (only repeated derivatives of loops with many invariants */
+/* do). */
+te_expr *te_derive(const te_expr *n, const te_real *variable);
+
+/* Solves n = targets[i] for the variable bound to the given address, once per */
+/* row, within the bracket brackets[2 * i] to brackets[2 * i + 1]. Other */
+/* variables are read from columns as in te_eval_batch. Writes each row's root */
+/* to out and, if converged isn't NULL, whether it was found to converged. */
+/* A NULL targets solves n = 0. Returns the number of rows solved. */
+int te_solve_batch(const te_expr *n, const te_real *variable, const te_column *columns, int column_count, int rows, const te_real *targets, const te_real *brackets, te_real *out, unsigned char *converged);
+
+/* Integrates n over the variable bound to the given address from a to b, */
+/* using adaptive Gauss-Kronrod quadrature until the error estimate is at */
+/* most tolerance, or tolerance times the result. Returns the best estimate, */
+/* even if the tolerance wasn't met, or NaN if n is NULL. */
+te_real te_integrate(const te_expr *n, const te_real *variable, te_real a, te_real b, te_real tolerance);
+
+/* Like te_integrate, once per row over bounds[2 * i] to bounds[2 * i + 1]. */
+/* Other variables are read from columns as in te_eval_batch. Writes each */
+/* row's result to out and, if converged isn't NULL, whether it met the */
+/* tolerance to converged. Returns the number of rows that did. */
+int te_integrate_batch(const te_expr *n, const te_real *variable, const te_column *columns, int column_count, int rows, const te_real *bounds, te_real tolerance, te_real *out, unsigned char *converged);
+
+/* Evaluates the expression once per row, reading bound variables from columns. */
+/* Writes rows results to out. */
+void te_eval_batch(const te_expr *n, const te_column *columns, int column_count, int rows, te_real *out);
+
+/* Like te_eval_batch, but writes row i's result to (char*)out + i * stride. */
+void te_eval_strided(const te_expr *n, const te_column *columns, int column_count, int rows, te_real *out, int stride);
+
+/* Evaluates the expression once per row and reduces the results without storing them. */
+/* NaN results are skipped; ops is a combination of TE_REDUCE_* flags. */
+void te_reduce(const te_expr *n, const te_column *columns, int column_count, int rows, int ops, te_reduction *result);
+
+/* Evaluates the expression as a predicate once per row. */
+/* Sets bit (row % 8) of bitmap[row / 8] for rows that are neither zero nor NaN. */
+/* Returns the number of selected rows. */
+int te_filter(const te_expr *n, const te_column *columns, int column_count, int rows, unsigned char *bitmap);
+
+/* Like te_filter, but writes the indices of the selected rows to selection. */
+/* selection must have room for rows entries. Returns the number of selected rows. */
+int te_select(const te_expr *n, const te_column *columns, int column_count, int rows, int *selection);
+
+/* Evaluates the expression once per run of rows over which no column changes, */
+/* and writes rows results to out. */
+void te_eval_rle(const te_expr *n, const te_rle_column *columns, int column_count, int rows, te_real *out);
+
+/* Like te_eval_rle, but writes run-length encoded results, merging equal neighbours. */
+/* values and lengths have room for capacity runs. Returns the number of runs */
+/* written, or -1 if out of memory or capacity runs aren't enough. Pure */
+/* expressions give at most as many runs as all the columns have together, */
+/* impure ones up to one per row. */
+int te_eval_rle_runs(const te_expr *n, const te_rle_column *columns, int column_count, int rows, te_real *values, int *lengths, int capacity);
+
+/* Evaluates the expression once per combination of dictionary entries, */
+/* then writes rows results to out by looking up each row's codes. */
+void te_eval_dict(const te_expr *n, const te_dict_column *columns, int column_count, int rows, te_real *out);
+
+/* Finds bounds lo <= te_eval(n) <= hi that hold whenever each ranged variable */
+/* lies within its range. Variables without a range keep their current value. */
+/* Returns nonzero if the result may also be NaN; lo and hi are NaN if it always is. */
+int te_eval_interval(const te_expr *n, const te_range *ranges, int range_count, te_real *lo, te_real *hi);
+
+/* Simplifies the expression knowing that each ranged variable lies within its range. */
+/* Returns the simplified expression, which replaces n: only the returned pointer */
+/* should be used or freed afterwards. */
+te_expr *te_optimize(te_expr *n, const te_range *ranges, int range_count);
+
+/* Expressions compiled together, sharing the subexpressions they have in common. */
+typedef struct te_set te_set;
+
+/* Compiles count expressions into a set. Returns NULL on error, with error */
+/* set by te_compile() for the first expression that failed. */
+te_set *te_compile_set(const char *const *expressions, int count, const te_variable *variables, int var_count, int *error);
+
+/* Evaluates every expression in the set, writing expression i's result to out[i]. */
+void te_eval_set(const te_set *set, te_real *out);
+
+/* Frees the set. */
+/* This is safe to call on NULL pointers. */
+void te_free_set(te_set *set);
+
+/* Restarts the draws of unif() and normal() on the calling thread. Equal */
+/* seeds and streams give equal draws; different streams give independent ones. */
+void te_seed(unsigned long long seed, unsigned long long stream);
+
+/* Reports how many calls to TE_FLAG_MEMO functions were served from the cache. */
+void te_memo_stats(long *hits, long *misses);
+
+/* Empties the cache and resets its statistics. */
+/* Call this when what a memoized closure's context points to changes. */
+void te_memo_clear(void);
 
 /* Prints debugging information on the syntax tree. */
 void te_print(const te_expr *n);